@@ -1,10 +1,12 @@
 #include <cstdint>
+#include <atomic>
 #include <chrono>
 #include <cstring>
 
 #include "aclint.h"
 #include "constants.h"
 #include "hartexc.h"
+#include "sbi.h"
 
 uint64_t time_start = 0;
 
@@ -12,7 +14,15 @@ uint64_t time_start = 0;
 uint64_t slow_time = 0;
 #endif // SLOW_TIMER
 
+bool aclint_virtual_time = false;
+uint64_t aclint_virtual_ns = 0;
+bool aclint_idle_skip = false;
+// host time skipped over while the harts were idle
+uint64_t aclint_skipped_ns = 0;
+
 uint64_t* mtimer_regs;
+// no mtimecmp below this is waiting to fire, so the harts only need a look once mtime reaches it
+std::atomic<uint64_t> mtimer_next = UINT64_MAX;
 uint32_t* mswi_regs;
 uint32_t* sswi_regs;
 
@@ -29,7 +39,7 @@ void aclint_mtimer_reset() {
 }
 
 void aclint_mswi_init() {
-  mswi_regs = new uint32_t[MACH_HART_COUNT];
+  mswi_regs = new uint32_t[MACH_HART_COUNT] {0};
 }
 
 void aclint_sswi_init() {
@@ -43,51 +53,125 @@ uint64_t aclint_mtime_get() {
 void* aclint_mtimer_r (uint64_t offset, [[maybe_unused]] uint8_t len) {
   if (offset == 0x7ff8) {
     handler_output = aclint_mtime_get();
+  } else if (offset / 8 < MACH_HART_COUNT) {
+    handler_output = mtimer_regs[offset / 8];
   } else {
-    handler_output = mtimer_regs[offset];
+    handler_output = 0;
   }
   return (void*) &handler_output;
 }
 void aclint_mtimer_w (uint64_t offset, void* dataptr, [[maybe_unused]] uint8_t len) {
   if (offset == 0x7ff8) {
     time_start = readtime() - *(uint64_t*)dataptr * 100;
-  } else {
-    mtimer_regs[offset] = *(uint64_t*)dataptr;
+    mtimer_next = 0; // every deadline moved
+  } else if (offset / 8 < MACH_HART_COUNT) {
     // mtimecmp updated, we should check if the interrupt is still pending
-    aclint_mtimer_chk(hartlist[offset]);
+    aclint_mtimer_set(hartlist[offset / 8], *(uint64_t*)dataptr);
   }
 }
 
 void aclint_mtimer_chk(HartState& hs) {
-#ifdef SLOW_MTIMER
-  slow_time++;
-#endif // SLOW_MTIMER
   //if (hs.mip & (1 << 7)) return; // the hart already has an interrupt pending, we do not need to trigger
+  // with the built-in SBI, the timer belongs to S-mode
+  uint64_t tip = sbi_enabled ? 1 << 5 /* STIP */ : 1 << 7 /* MTIP */;
   if (mtimer_regs[hs.hartid] <= aclint_mtime_get()) {
-    hs.mip |= 1 << 7; // MTIP
+    hart_raise_int(hs, tip);
     //setup_pending_int(hs);
   } else {
-    hs.mip &= ~(1 << 7);
+    hart_lower_int(hs, tip);
+  }
+}
+
+void aclint_mtimer_lower(uint64_t value) {
+  uint64_t next = mtimer_next.load();
+  while (value < next && !mtimer_next.compare_exchange_weak(next, value));
+}
+
+void aclint_mtimer_set(HartState& hs, uint64_t value) {
+  // sequentially consistent like the reset of mtimer_next in aclint_mtimer_tick, so either the tick sees the new value,
+  // or the load of mtimer_next here sees the reset and lowers it again
+  std::atomic_ref<uint64_t>(mtimer_regs[hs.hartid]).store(value);
+  aclint_mtimer_lower(value);
+  aclint_mtimer_chk(hs);
+}
+
+void aclint_mtimer_tick() {
+#ifdef SLOW_MTIMER
+  slow_time++;
+#endif // SLOW_MTIMER
+  uint64_t now = aclint_mtime_get();
+  uint64_t next = mtimer_next.load(std::memory_order_relaxed);
+  if (now < next) return;
+  // after mtime was written or restored, a deadline still ahead may have a TIP left over that has to be lowered
+  bool recheck = next == 0;
+  // a deadline was reached, raise it and find the next one
+  // an mtimecmp written meanwhile lowers mtimer_next again after this, or is seen by the loop
+  mtimer_next = UINT64_MAX;
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    uint64_t cmp = std::atomic_ref<uint64_t>(mtimer_regs[i]).load();
+    if (cmp <= now) {
+      aclint_mtimer_chk(hartlist[i]);
+    } else {
+      aclint_mtimer_lower(cmp);
+      if (recheck) aclint_mtimer_chk(hartlist[i]);
+    }
   }
 }
 
 uint64_t readtime(){
+  if (aclint_virtual_time) return aclint_virtual_ns;
 #ifdef SLOW_MTIMER
-  return slow_time;
+  return slow_time + aclint_skipped_ns;
 #else
   using namespace std::chrono;
-  return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count() + aclint_skipped_ns;
 #endif // SLOW_MTIMER
 }
 
+bool aclint_skip_to_deadline() {
+  uint64_t now = aclint_mtime_get();
+  uint64_t deadline = UINT64_MAX; // all ones is never
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    // deadlines already passed belong to harts that do not wait for them
+    if (mtimer_regs[i] > now && mtimer_regs[i] < deadline) deadline = mtimer_regs[i];
+  }
+  if (deadline == UINT64_MAX || deadline - now > (UINT64_MAX - readtime()) / 100) return false;
+  uint64_t skip = (deadline - now) * 100;
+  if (aclint_virtual_time) {
+    aclint_virtual_ns += skip;
+  } else {
+    aclint_skipped_ns += skip;
+  }
+  return true;
+}
+
 void* aclint_mswi_r (uint64_t offset, [[maybe_unused]] uint8_t len) {
-  return &mswi_regs[offset];
+  handler_output = offset / 4 < MACH_HART_COUNT ? mswi_regs[offset / 4] : 0;
+  return &handler_output;
 }
 void aclint_mswi_w (uint64_t offset, void* dataptr, [[maybe_unused]] uint8_t len) {
-  mswi_regs[offset] = *(uint64_t*)dataptr & 0b1;
-}
-void aclint_mswi_chk(HartState& hs) {
+  if (offset / 4 >= MACH_HART_COUNT) return;
+  // delivered right away, instead of on the next round of the main thread
+  HartState& hs = hartlist[offset / 4];
+  mswi_regs[hs.hartid] = *(uint32_t*)dataptr & 0b1;
   if (mswi_regs[hs.hartid]) {
-    hs.mip |= 1 << 3; // MSIP
+    hart_raise_int(hs, 1 << 3); // MSIP
+  } else {
+    hart_lower_int(hs, 1 << 3);
   }
 }
+
+void aclint_save(std::vector<uint8_t>& out) {
+  uint64_t mtime = aclint_mtime_get();
+  snap_put(out, &mtime, sizeof(mtime));
+  snap_put(out, mtimer_regs, MACH_HART_COUNT * sizeof(uint64_t));
+  snap_put(out, mswi_regs, MACH_HART_COUNT * sizeof(uint32_t));
+}
+
+bool aclint_restore(snap_reader& in) {
+  uint64_t mtime;
+  if (!snap_get(in, &mtime, sizeof(mtime))) return false;
+  time_start = readtime() - mtime * 100;
+  mtimer_next = 0;
+  return snap_get(in, mtimer_regs, MACH_HART_COUNT * sizeof(uint64_t)) && snap_get(in, mswi_regs, MACH_HART_COUNT * sizeof(uint32_t));
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include <cstdint>
+#include <vector>
 
 #include "cpu.h"
+#include "snapshot.h"
 
 void aclint_mtimer_init();
 void aclint_mtimer_reset();
@@ -12,9 +14,27 @@ uint64_t aclint_mtime_get();
 void* aclint_mtimer_r (uint64_t offset, uint8_t len);
 void aclint_mtimer_w (uint64_t offset, void* dataptr, uint8_t len);
 void aclint_mtimer_chk(HartState& hs);
+// sets mtimecmp of a hart, for the SBI timer
+void aclint_mtimer_set(HartState& hs, uint64_t value);
+// raises the timer interrupts of the harts whose mtimecmp has been reached since the last call
+// called by whoever updates the devices, and only goes through the harts once a deadline has passed
+void aclint_mtimer_tick();
 
+// nanoseconds, from the host clock, or from aclint_virtual_ns when aclint_virtual_time is set
 uint64_t readtime();
+// set before the harts start, the time is then advanced by whoever runs the harts
+extern bool aclint_virtual_time;
+extern uint64_t aclint_virtual_ns;
+// with -I, once every hart waits for an interrupt and none is pending, time jumps to the next mtimecmp
+// instead of passing while nothing happens
+extern bool aclint_idle_skip;
+// moves the time forward to the earliest mtimecmp still ahead, returns false if there is none
+bool aclint_skip_to_deadline();
 
 void* aclint_mswi_r (uint64_t offset, uint8_t len);
+// a write sets or clears MSIP of the hart at once
 void aclint_mswi_w (uint64_t offset, void* dataptr, uint8_t len);
-void aclint_mswi_chk(HartState& hs);
+
+// mtime is saved as a value, and keeps counting from it after a restore
+void aclint_save(std::vector<uint8_t>& out);
+bool aclint_restore(snap_reader& in);
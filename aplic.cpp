@@ -0,0 +1,305 @@
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <bit>
+#include <mutex>
+#include <string>
+
+#include "aplic.h"
+#include "imsic.h"
+#include "io.h"
+#include "constants.h"
+
+#define APLIC_WORDS (APLIC_SOURCE_COUNT / 32)
+
+// source modes, sourcecfg.SM
+#define APLIC_SM_INACTIVE 0
+#define APLIC_SM_DETACHED 1
+
+// the value it reads as, with the mode fixed to MSI delivery and the byte order to little-endian
+uint32_t aplic_domaincfg;
+#define APLIC_DOMAINCFG_IE (1 << 8)
+#define APLIC_DOMAINCFG_RO (0x80u << 24 | 1 << 2)
+
+// indexed by source, so index 0 is unused
+uint32_t* aplic_sourcecfg;
+uint32_t* aplic_target;
+uint32_t* aplic_pend;
+uint32_t* aplic_en;
+uint32_t aplic_genmsi;
+
+// the registers are written by the harts and the device threads
+std::mutex aplic_mtx;
+
+void aplic_init() {
+  aplic_domaincfg = APLIC_DOMAINCFG_RO;
+  aplic_sourcecfg = new uint32_t[APLIC_SOURCE_COUNT] {0};
+  aplic_target = new uint32_t[APLIC_SOURCE_COUNT] {0};
+  aplic_pend = new uint32_t[APLIC_WORDS] {0};
+  aplic_en = new uint32_t[APLIC_WORDS] {0};
+  aplic_genmsi = 0;
+}
+
+bool aplic_active(uint32_t source) {
+  return source != 0 && source < APLIC_SOURCE_COUNT && aplic_sourcecfg[source] != APLIC_SM_INACTIVE;
+}
+
+// target and genmsi: hart index in bits 31:18, EIID in bits 10:0
+void aplic_msi(uint32_t target) {
+  imsic_send(target >> 18, true, target & 0x7FF);
+}
+
+// sends a pending and enabled source on as an MSI, which clears its pending bit
+void aplic_forward(uint32_t source) {
+  uint32_t bit = 1u << (source % 32);
+  if (!(aplic_domaincfg & APLIC_DOMAINCFG_IE) || !(aplic_pend[source / 32] & aplic_en[source / 32] & bit)) return;
+  aplic_pend[source / 32] &= ~bit;
+  aplic_msi(aplic_target[source]);
+}
+
+void aplic_forward_all() {
+  for (uint16_t regnum = 0; regnum < APLIC_WORDS; regnum++) {
+    for (uint32_t bits = aplic_pend[regnum] & aplic_en[regnum]; bits; bits &= bits - 1) {
+      aplic_forward(regnum * 32 + std::countr_zero(bits));
+    }
+  }
+}
+
+void aplic_set_pend(uint32_t source) {
+  if (!aplic_active(source)) return;
+  aplic_pend[source / 32] |= 1u << (source % 32);
+  aplic_forward(source);
+}
+
+void aplic_set_en(uint32_t source, bool enabled) {
+  if (!aplic_active(source)) return;
+  if (enabled) {
+    aplic_en[source / 32] |= 1u << (source % 32);
+    aplic_forward(source);
+  } else {
+    aplic_en[source / 32] &= ~(1u << (source % 32));
+  }
+}
+
+void aplic_send_int(uint16_t source) {
+  std::lock_guard<std::mutex> lock(aplic_mtx);
+  // a detached source only takes the pending bits the harts set
+  if (!aplic_active(source) || aplic_sourcecfg[source] == APLIC_SM_DETACHED) return;
+  aplic_set_pend(source);
+}
+
+void* aplic_r (uint64_t offset, [[maybe_unused]] uint8_t len) {
+  if (offset == 0) {
+    return &aplic_domaincfg;
+  }
+  if (0x4 <= offset && offset < 0x4 * APLIC_SOURCE_COUNT) {
+    return &aplic_sourcecfg[offset / 4];
+  }
+  if (0x1C00 <= offset && offset < 0x1C00 + 4 * APLIC_WORDS) { // setip
+    return &aplic_pend[(offset - 0x1C00) / 4];
+  }
+  if (0x1E00 <= offset && offset < 0x1E00 + 4 * APLIC_WORDS) { // setie
+    return &aplic_en[(offset - 0x1E00) / 4];
+  }
+  if (offset == 0x3000) {
+    return &aplic_genmsi;
+  }
+  if (0x3004 <= offset && offset < 0x3000 + 0x4 * APLIC_SOURCE_COUNT) {
+    return &aplic_target[(offset - 0x3000) / 4];
+  }
+  // the MSI address registers belong to an M-level domain, and in_clrip reads the inputs, which are never held high
+  return &ZERO;
+}
+
+void aplic_w (uint64_t offset, void* dataptr, [[maybe_unused]] uint8_t len) {
+  std::lock_guard<std::mutex> lock(aplic_mtx);
+  uint32_t value = *(uint32_t*)dataptr;
+  if (offset == 0) {
+    aplic_domaincfg = APLIC_DOMAINCFG_RO | (value & APLIC_DOMAINCFG_IE);
+    aplic_forward_all();
+  } else if (0x4 <= offset && offset < 0x4 * APLIC_SOURCE_COUNT) {
+    uint16_t source = offset / 4;
+    // no child domain to delegate to, and modes 2 and 3 are reserved
+    uint32_t mode = value & 0x7;
+    aplic_sourcecfg[source] = (value & (1 << 10) || mode == 2 || mode == 3) ? APLIC_SM_INACTIVE : mode;
+    if (aplic_sourcecfg[source] == APLIC_SM_INACTIVE) {
+      aplic_pend[source / 32] &= ~(1u << (source % 32));
+      aplic_en[source / 32] &= ~(1u << (source % 32));
+    }
+  } else if (0x1C00 <= offset && offset < 0x1C00 + 4 * APLIC_WORDS) { // setip
+    for (uint32_t bits = value; bits; bits &= bits - 1) aplic_set_pend((offset - 0x1C00) / 4 * 32 + std::countr_zero(bits));
+  } else if (offset == 0x1CDC || offset == 0x2000) { // setipnum, setipnum_le
+    aplic_set_pend(value);
+  } else if (offset == 0x2004) { // setipnum_be
+    aplic_set_pend(__builtin_bswap32(value));
+  } else if (0x1D00 <= offset && offset < 0x1D00 + 4 * APLIC_WORDS) { // in_clrip
+    aplic_pend[(offset - 0x1D00) / 4] &= ~value;
+  } else if (offset == 0x1DDC) { // clripnum
+    if (value < APLIC_SOURCE_COUNT) aplic_pend[value / 32] &= ~(1u << (value % 32));
+  } else if (0x1E00 <= offset && offset < 0x1E00 + 4 * APLIC_WORDS) { // setie
+    for (uint32_t bits = value; bits; bits &= bits - 1) aplic_set_en((offset - 0x1E00) / 4 * 32 + std::countr_zero(bits), true);
+  } else if (offset == 0x1EDC) { // setienum
+    aplic_set_en(value, true);
+  } else if (0x1F00 <= offset && offset < 0x1F00 + 4 * APLIC_WORDS) { // clrie
+    for (uint32_t bits = value; bits; bits &= bits - 1) aplic_set_en((offset - 0x1F00) / 4 * 32 + std::countr_zero(bits), false);
+  } else if (offset == 0x1FDC) { // clrienum
+    aplic_set_en(value, false);
+  } else if (offset == 0x3000) {
+    // sent at once, so it is never busy
+    aplic_genmsi = value & 0xFFFC'07FF;
+    aplic_msi(aplic_genmsi);
+  } else if (0x3004 <= offset && offset < 0x3000 + 0x4 * APLIC_SOURCE_COUNT) {
+    // no guest interrupt files
+    aplic_target[(offset - 0x3000) / 4] = value & 0xFFFC'07FF;
+  }
+}
+
+uint32_t fdt_max_phandle(fdt_node& node) {
+  uint32_t max = fdt_get_u32(node, "phandle", 0);
+  for (fdt_node& child : node.children) max = std::max(max, fdt_max_phandle(child));
+  return max;
+}
+
+// points the devices of the PLIC at the APLIC, whose sources take a second cell for the trigger type
+void aia_move_devices(fdt_node& node, uint32_t plic, uint32_t aplic) {
+  fdt_prop* interrupts = fdt_get_prop(node, "interrupts");
+  if (interrupts && fdt_get_u32(node, "interrupt-parent", 0) == plic) {
+    std::vector<uint32_t> cells;
+    for (size_t i = 0; i + 4 <= interrupts->value.size(); i += 4) {
+      const uint8_t* cell = &interrupts->value[i];
+      cells.push_back((uint32_t)cell[0] << 24 | cell[1] << 16 | cell[2] << 8 | cell[3]);
+      cells.push_back(4); // level high
+    }
+    fdt_set_prop(node, "interrupt-parent", fdt_cells({aplic}));
+    fdt_set_prop(node, "interrupts", fdt_cells(cells));
+  }
+  for (fdt_node& child : node.children) aia_move_devices(child, plic, aplic);
+}
+
+bool aia_fixup_dtb(fdt_node& root) {
+  if (!aia_enabled) return true;
+  uint32_t phandle = fdt_max_phandle(root);
+
+  // the local interrupt controllers of the harts, in hart order
+  std::vector<uint32_t> intcs(MACH_HART_COUNT, 0);
+  for (fdt_node& cpus : root.children) {
+    if (cpus.name != "cpus") continue;
+    for (fdt_node& cpu : cpus.children) {
+      if (!cpu.name.starts_with("cpu@")) continue;
+      uint32_t hartid = fdt_get_u32(cpu, "reg", UINT32_MAX);
+      fdt_prop* isa = fdt_get_prop(cpu, "riscv,isa");
+      if (isa) {
+        std::string isa_str((const char*)isa->value.data());
+        if (isa_str.find("_smaia") == std::string::npos) fdt_set_prop(cpu, "riscv,isa", fdt_string((isa_str + "_smaia_ssaia").c_str()));
+      }
+      fdt_prop* extensions = fdt_get_prop(cpu, "riscv,isa-extensions");
+      if (extensions) {
+        std::vector<uint8_t> value = extensions->value;
+        for (const char* ext : {"smaia", "ssaia"}) {
+          std::vector<uint8_t> str = fdt_string(ext);
+          value.insert(value.end(), str.begin(), str.end());
+        }
+        fdt_set_prop(cpu, "riscv,isa-extensions", value);
+      }
+      for (fdt_node& intc : cpu.children) {
+        if (!intc.name.starts_with("interrupt-controller") || hartid >= MACH_HART_COUNT) continue;
+        if (!fdt_get_prop(intc, "phandle")) fdt_set_prop(intc, "phandle", fdt_cells({++phandle}));
+        intcs[hartid] = fdt_get_u32(intc, "phandle", 0);
+      }
+    }
+  }
+
+  // a file is found by its position in interrupts-extended, so only the harts up to the first one missing from the DTB get one
+  intcs.resize(std::find(intcs.begin(), intcs.end(), 0) - intcs.begin());
+
+  for (fdt_node& soc : root.children) {
+    if (soc.name != "soc") continue;
+    uint32_t addr_cells = fdt_get_u32(soc, "#address-cells", 2);
+    uint32_t size_cells = fdt_get_u32(soc, "#size-cells", 1);
+
+    uint32_t plic = 0;
+    for (size_t i = 0; i < soc.children.size(); i++) {
+      if (!soc.children[i].name.starts_with("plic@")) continue;
+      plic = fdt_get_u32(soc.children[i], "phandle", 0);
+      soc.children.erase(soc.children.begin() + i);
+      break;
+    }
+
+    uint32_t imsic_s = 0;
+    for (bool s_level : {false, true}) {
+      uint64_t base = s_level ? IMSIC_S_BASE : IMSIC_M_BASE;
+      char name[32];
+      snprintf(name, sizeof(name), "imsics@%lx", base);
+      fdt_node imsic;
+      imsic.name = name;
+      std::vector<uint8_t> compatible = fdt_string("qemu,imsics");
+      std::vector<uint8_t> riscv = fdt_string("riscv,imsics");
+      compatible.insert(compatible.end(), riscv.begin(), riscv.end());
+      fdt_set_prop(imsic, "compatible", compatible);
+      std::vector<uint8_t> reg;
+      if (!fdt_append_num(reg, base, addr_cells) || !fdt_append_num(reg, (uint64_t)intcs.size() * IMSIC_FILE_SIZE, size_cells)) {
+        dbgerr_print("IMSIC registers do not fit in the cells of the dtb");
+        dbgerr_endl();
+        return false;
+      }
+      fdt_set_prop(imsic, "reg", reg);
+      std::vector<uint32_t> parents;
+      for (uint32_t intc : intcs) {
+        parents.push_back(intc);
+        parents.push_back(s_level ? 9 : 11);
+      }
+      fdt_set_prop(imsic, "interrupts-extended", fdt_cells(parents));
+      fdt_set_prop(imsic, "interrupt-controller", {});
+      fdt_set_prop(imsic, "#interrupt-cells", fdt_cells({0}));
+      fdt_set_prop(imsic, "msi-controller", {});
+      fdt_set_prop(imsic, "#msi-cells", fdt_cells({0}));
+      fdt_set_prop(imsic, "riscv,num-ids", fdt_cells({IMSIC_ID_COUNT - 1}));
+      fdt_set_prop(imsic, "phandle", fdt_cells({++phandle}));
+      if (s_level) imsic_s = phandle;
+      soc.children.push_back(imsic);
+    }
+
+    fdt_node aplic;
+    char name[48];
+    snprintf(name, sizeof(name), "interrupt-controller@%x", APLIC_BASE);
+    aplic.name = name;
+    std::vector<uint8_t> compatible = fdt_string("qemu,aplic");
+    std::vector<uint8_t> riscv = fdt_string("riscv,aplic");
+    compatible.insert(compatible.end(), riscv.begin(), riscv.end());
+    fdt_set_prop(aplic, "compatible", compatible);
+    std::vector<uint8_t> reg;
+    if (!fdt_append_num(reg, APLIC_BASE, addr_cells) || !fdt_append_num(reg, APLIC_SIZE, size_cells)) {
+      dbgerr_print("APLIC registers do not fit in the cells of the dtb");
+      dbgerr_endl();
+      return false;
+    }
+    fdt_set_prop(aplic, "reg", reg);
+    fdt_set_prop(aplic, "interrupt-controller", {});
+    fdt_set_prop(aplic, "#interrupt-cells", fdt_cells({2}));
+    fdt_set_prop(aplic, "msi-parent", fdt_cells({imsic_s}));
+    fdt_set_prop(aplic, "riscv,num-sources", fdt_cells({APLIC_SOURCE_COUNT - 1}));
+    fdt_set_prop(aplic, "phandle", fdt_cells({++phandle}));
+    soc.children.push_back(aplic);
+
+    if (plic) aia_move_devices(root, plic, phandle);
+  }
+  return true;
+}
+
+void aplic_save(std::vector<uint8_t>& out) {
+  snap_put(out, &aplic_domaincfg, sizeof(aplic_domaincfg));
+  snap_put(out, aplic_sourcecfg, APLIC_SOURCE_COUNT * sizeof(uint32_t));
+  snap_put(out, aplic_target, APLIC_SOURCE_COUNT * sizeof(uint32_t));
+  snap_put(out, aplic_pend, APLIC_WORDS * sizeof(uint32_t));
+  snap_put(out, aplic_en, APLIC_WORDS * sizeof(uint32_t));
+  snap_put(out, &aplic_genmsi, sizeof(aplic_genmsi));
+}
+
+bool aplic_restore(snap_reader& in) {
+  return snap_get(in, &aplic_domaincfg, sizeof(aplic_domaincfg))
+      && snap_get(in, aplic_sourcecfg, APLIC_SOURCE_COUNT * sizeof(uint32_t))
+      && snap_get(in, aplic_target, APLIC_SOURCE_COUNT * sizeof(uint32_t))
+      && snap_get(in, aplic_pend, APLIC_WORDS * sizeof(uint32_t))
+      && snap_get(in, aplic_en, APLIC_WORDS * sizeof(uint32_t))
+      && snap_get(in, &aplic_genmsi, sizeof(aplic_genmsi));
+}
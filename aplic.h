@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "fdt.h"
+#include "snapshot.h"
+
+// with -a, the wired sources go to an APLIC domain in MSI mode, which forwards them as MSIs
+// to the S-level interrupt files of the harts its target registers choose
+// there is no M-level domain above it, so its MSI addresses are fixed to the S-level IMSICs
+
+#define APLIC_BASE 0xD00'0000
+#define APLIC_SIZE 0x8000
+// source 0 does not exist, so this is the full 1023 sources
+#define APLIC_SOURCE_COUNT 1024
+
+void aplic_init();
+
+// a device raised its interrupt, called in place of plic_send_int
+void aplic_send_int(uint16_t source);
+
+void* aplic_r (uint64_t offset, uint8_t len);
+void aplic_w (uint64_t offset, void* dataptr, uint8_t len);
+
+// adds the IMSICs and the APLIC to the DTB, moves the devices from the PLIC to the APLIC and removes the PLIC
+// fails if their registers do not fit in the cells of the soc node
+bool aia_fixup_dtb(fdt_node& root);
+
+void aplic_save(std::vector<uint8_t>& out);
+bool aplic_restore(snap_reader& in);
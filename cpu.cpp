@@ -9,6 +9,9 @@
 #include "io.h"
 #include "hartexc.h"
 #include "aclint.h"
+#include "sbi.h"
+#include "hart_sched.h"
+#include "imsic.h"
 
 // for MULH and friends
 #ifdef __SIZEOF_INT128__
@@ -85,8 +88,8 @@ cycle_end:
   hs.instret = hs.minstret;
   
   // check for mip, sip
-  if (hs.chk_int) {
-    hs.chk_int = false;
+  if (hart_take_doorbell(hs)) {
+    if (sbi_enabled) sbi_poll(hs);
     setup_pending_int(hs);
   }
   
@@ -999,7 +1002,7 @@ HartException decode_exc(HartState &hs){
               hs.mstatus &= ~(0b11 << 11); // set mstatus.MPP to 0b00 (U-mode)
               if (hs.privmode != 0b11) hs.mstatus &= ~(0b1 <<  17); // clear mstatus.MPRV
               
-              hs.chk_int = true;
+              hart_recheck(hs);
               break;
             }
             
@@ -1017,7 +1020,7 @@ HartException decode_exc(HartState &hs){
               hs.mstatus &= ~(0b1 << 8); // set mstatus.SPP to 0b0 (U-mode)
               if (hs.privmode != 0b11) hs.mstatus &= ~(0b1 <<  17); // clear mstatus.MPRV
               
-              hs.chk_int = true;
+              hart_recheck(hs);
               break;
             }
             
@@ -1026,8 +1029,13 @@ HartException decode_exc(HartState &hs){
                 return create_exception(hs,HartException::ILLINST, hs.inst);
               }
               
-              std::this_thread::sleep_for(std::chrono::microseconds(100));
-              hs.chk_int = true;
+              // sleep until the doorbell rings, unless an interrupt is pending already
+              // a scheduled hart is taken off its worker instead
+              if (!sched_enabled && !sched_deterministic && !(hs.mip & (hs.mie | hs.sie))) {
+                harts_waiting++;
+                std::atomic_ref<uint32_t>(hs.irq_doorbell).wait(0);
+                harts_waiting--;
+              }
               break;
             }
             
@@ -1079,12 +1087,19 @@ HartException decode_exc(HartState &hs){
                 wvalue = hs.regs[rs1];
               }
               
-              if (0x3A0 <= imm && imm < 0x3B0) { // pmpcfgX CSRs require special handling
+              // pmpcfgX and the AIA CSRs require special handling
+              // they may trap, so the pc only moves on and the instruction only retires once they are done
+              bool pmpcfg = 0x3A0 <= imm && imm < 0x3B0;
+              if (pmpcfg || aia_csr(imm)) {
+                HartException he = pmpcfg
+                  ? pmpcfg_rw(hs, (uint16_t)imm, (uint64_t*)&hs.regs[rd], wvalue, uint8_t(funct3 & 0b11))
+                  : aia_csr_rw(hs, (uint16_t)imm, (uint64_t*)&hs.regs[rd], wvalue, uint8_t(funct3 & 0b11));
+                if (he != HartException::NOEXC) return he;
                 if (!pc_chgd) {
                   hs.pc += hs.inst_len / 8;
                 }
                 hs.minstret++; // minstret CSR
-                return pmpcfg_rw(hs, (uint16_t)imm, (uint64_t*)&hs.regs[rd], wvalue, uint8_t(funct3 & 0b11));
+                return HartException::NOEXC;
               }
               
               // sstatus is mirrored to mstatus
@@ -1126,7 +1141,7 @@ HartException decode_exc(HartState &hs){
                 if (imm == 0x301) break; // misa writes are currently not supported
                 
                 if (imm == 0x300 || imm == 0x302 || imm == 0x303 || imm == 0x304 || imm == 0x344) { // interrupt related CSRs, we must check for interrupts
-                  hs.chk_int = true;
+                  hart_recheck(hs);
                 }
                 
                 switch (funct3 & 0b11){
@@ -1214,12 +1229,7 @@ HartException decode_exc(HartState &hs){
                 hs.mem_status = true; // notify page_table_walk that we are reading, not executing
                 uint64_t lr_phy_addr = page_table_walk(hs,hs.regs[rs1],false);
                 HANDLE_MEM_ERROR(S, hs.regs[rs1]);
-                for (uint16_t i = 0; i < MACH_HART_COUNT;i++) {
-                  if (hs.hartid != i && reservations[i] == lr_phy_addr) {
-                    reservations[i] = 0; // remove existing reservations on this memory address by other harts
-                  }
-                }
-                reservations[hs.hartid] = lr_phy_addr;
+                mem_reserve(hs.hartid, lr_phy_addr); // removes existing reservations on this memory address by other harts
                 break;
               }
               
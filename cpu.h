@@ -28,7 +28,8 @@ struct ExpPMP {
   uint8_t lxwr;
 };
 
-struct HartState {
+// aligned to a cache line, so harts next to each other in hartlist do not share one
+struct alignas(64) HartState {
   uint16_t hartid;
   int64_t regs[32];
   uint64_t pc;
@@ -54,7 +55,7 @@ struct HartState {
   uint64_t mepc, sepc;
   uint64_t mcause, scause;
   uint64_t mtval, stval;
-  uint64_t mip; // sip is just a mirror of mip with some bits masked
+  uint64_t mip; // sip is just a mirror of mip with some bits masked, only the hart itself writes it
   
   uint64_t mcycle, minstret;
   
@@ -80,7 +81,14 @@ struct HartState {
   uint64_t pmp_all_enabled;
   uint64_t min_lbound, max_ubound;
   
-  bool chk_int; // signal hart to check interrupts in the next cycle
+  // hart state management of the built-in SBI, see sbi.h
+  uint8_t hsm_state;
+  uint64_t hsm_suspend_type;
+  uint64_t hsm_resume_addr, hsm_opaque;
+  
+  // interrupts raised and lowered for the hart, by the devices, other harts and itself, see hart_raise_int
+  // on a cache line of its own, so that ringing it does not take the registers above away from the hart
+  alignas(64) uint32_t irq_doorbell;
 };
 
 #include "constants.h"
@@ -22,12 +22,12 @@ size_t load_elf(int fd, uint64_t mem_offset = 0) {
   e = elf_begin(fd, ELF_C_READ, NULL);
   if (!e) {
     // can't open ELF, fallback to treating file as flat binary
-    return read(fd, main_mem + mem_offset, 0x200'0000);
+    return mem_load_file(fd, 0, ram_banks[0].base + mem_offset, 0x200'0000);
   }
   
   if (elf_kind(e) != ELF_K_ELF) {
     // ELF has wrong format, fallback to treating file as flat binary
-    return read(fd, main_mem + mem_offset, 0x200'0000);
+    return mem_load_file(fd, 0, ram_banks[0].base + mem_offset, 0x200'0000);
   }
   
   size_t n = 0;
@@ -37,9 +37,11 @@ size_t load_elf(int fd, uint64_t mem_offset = 0) {
     gelf_getphdr(e, i, &phdr);
     if (phdr.p_type != PT_LOAD) continue;
     if (phdr.p_paddr < 0x8000'0000) continue;
-    uint64_t load_addr = phdr.p_paddr + mem_offset - 0x8000'0000;
-    ssize_t loaded_size = pread(fd, main_mem + load_addr, phdr.p_memsz, phdr.p_offset);
-    if (loaded_size == -1) {
+    // segments may land in any RAM bank, but must not straddle two
+    if (!phy_mem_ptr(phdr.p_paddr + mem_offset, phdr.p_memsz)) return 0;
+    // only the file part is loaded, the rest up to p_memsz is bss and RAM is still zero there
+    size_t loaded_size = mem_load_file(fd, phdr.p_offset, phdr.p_paddr + mem_offset, phdr.p_filesz);
+    if (loaded_size != phdr.p_filesz) {
       return 0;
     }
     file_size += loaded_size;
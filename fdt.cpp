@@ -0,0 +1,196 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "fdt.h"
+
+#define FDT_MAGIC 0xd00dfeed
+#define FDT_HEADER_SIZE 40
+
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
+
+// everything in a DTB is big-endian
+
+uint32_t fdt_be32(const uint8_t* ptr) {
+  return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | ptr[3];
+}
+
+void fdt_put32(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back(value >> 24);
+  out.push_back(value >> 16);
+  out.push_back(value >> 8);
+  out.push_back(value);
+}
+
+void fdt_pad(std::vector<uint8_t>& out) {
+  while (out.size() % 4) out.push_back(0);
+}
+
+// reads one node starting after its FDT_BEGIN_NODE token, pos is left after its FDT_END_NODE
+bool fdt_parse_node(const uint8_t* dt, size_t dt_len, const uint8_t* strings, size_t strings_len, size_t& pos, fdt_node& node, int depth) {
+  if (depth > 64) return false;
+  const uint8_t* name_end = (const uint8_t*)memchr(dt + pos, 0, dt_len - pos);
+  if (!name_end) return false;
+  node.name.assign((const char*)dt + pos, name_end - dt - pos);
+  pos = (name_end - dt + 4) & ~3;
+  while (pos + 4 <= dt_len) {
+    uint32_t token = fdt_be32(dt + pos);
+    pos += 4;
+    switch (token) {
+      case FDT_BEGIN_NODE:
+        node.children.emplace_back();
+        if (!fdt_parse_node(dt, dt_len, strings, strings_len, pos, node.children.back(), depth + 1)) return false;
+        break;
+      case FDT_END_NODE:
+        return true;
+      case FDT_PROP: {
+        if (pos + 8 > dt_len) return false;
+        uint32_t len = fdt_be32(dt + pos);
+        uint32_t nameoff = fdt_be32(dt + pos + 4);
+        pos += 8;
+        if (len > dt_len - pos || nameoff >= strings_len) return false;
+        const char* name = (const char*)strings + nameoff;
+        if (!memchr(name, 0, strings_len - nameoff)) return false;
+        node.props.push_back({name, std::vector<uint8_t>(dt + pos, dt + pos + len)});
+        pos = (pos + len + 3) & ~3;
+        break;
+      }
+      case FDT_NOP:
+        break;
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+bool fdt_parse(const uint8_t* blob, size_t max_len, fdt_tree& tree) {
+  if (max_len < FDT_HEADER_SIZE || fdt_be32(blob) != FDT_MAGIC) return false;
+  uint32_t total = fdt_be32(blob + 4);
+  uint32_t off_struct = fdt_be32(blob + 8);
+  uint32_t off_strings = fdt_be32(blob + 12);
+  uint32_t off_rsv = fdt_be32(blob + 16);
+  uint32_t strings_len = fdt_be32(blob + 32);
+  uint32_t struct_len = fdt_be32(blob + 36);
+  if (total > max_len || off_struct > total || struct_len > total - off_struct
+      || off_strings > total || strings_len > total - off_strings || off_rsv > total) return false;
+  tree.boot_cpuid = fdt_be32(blob + 28);
+
+  tree.mem_rsv.clear();
+  for (size_t pos = off_rsv; pos + 16 <= total; pos += 16) {
+    uint64_t addr = (uint64_t)fdt_be32(blob + pos) << 32 | fdt_be32(blob + pos + 4);
+    uint64_t size = (uint64_t)fdt_be32(blob + pos + 8) << 32 | fdt_be32(blob + pos + 12);
+    if (!addr && !size) break;
+    tree.mem_rsv.push_back(addr);
+    tree.mem_rsv.push_back(size);
+  }
+
+  const uint8_t* dt = blob + off_struct;
+  size_t pos = 0;
+  while (pos + 4 <= struct_len && fdt_be32(dt + pos) == FDT_NOP) pos += 4;
+  if (pos + 4 > struct_len || fdt_be32(dt + pos) != FDT_BEGIN_NODE) return false;
+  pos += 4;
+  tree.root = fdt_node();
+  return fdt_parse_node(dt, struct_len, blob + off_strings, strings_len, pos, tree.root, 0);
+}
+
+void fdt_write_node(const fdt_node& node, std::vector<uint8_t>& dt, std::string& strings, std::unordered_map<std::string, uint32_t>& string_offs) {
+  fdt_put32(dt, FDT_BEGIN_NODE);
+  dt.insert(dt.end(), node.name.begin(), node.name.end());
+  dt.push_back(0);
+  fdt_pad(dt);
+  for (const fdt_prop& prop : node.props) {
+    auto it = string_offs.find(prop.name);
+    if (it == string_offs.end()) {
+      it = string_offs.emplace(prop.name, strings.size()).first;
+      strings.append(prop.name);
+      strings.push_back(0);
+    }
+    fdt_put32(dt, FDT_PROP);
+    fdt_put32(dt, prop.value.size());
+    fdt_put32(dt, it->second);
+    dt.insert(dt.end(), prop.value.begin(), prop.value.end());
+    fdt_pad(dt);
+  }
+  for (const fdt_node& child : node.children) {
+    fdt_write_node(child, dt, strings, string_offs);
+  }
+  fdt_put32(dt, FDT_END_NODE);
+}
+
+size_t fdt_write(const fdt_tree& tree, uint8_t* blob, size_t max_len) {
+  std::vector<uint8_t> dt;
+  std::string strings;
+  std::unordered_map<std::string, uint32_t> string_offs;
+  fdt_write_node(tree.root, dt, strings, string_offs);
+  fdt_put32(dt, FDT_END);
+
+  // header, then the reserve map, the structure block and the strings block
+  std::vector<uint8_t> out;
+  uint32_t off_rsv = FDT_HEADER_SIZE;
+  uint32_t off_struct = off_rsv + 16 * (tree.mem_rsv.size() / 2 + 1);
+  uint32_t off_strings = off_struct + dt.size();
+  uint32_t total = off_strings + strings.size();
+  for (uint32_t value : {(uint32_t)FDT_MAGIC, total, off_struct, off_strings, off_rsv, 17U, 16U,
+                         tree.boot_cpuid, (uint32_t)strings.size(), (uint32_t)dt.size()}) {
+    fdt_put32(out, value);
+  }
+  for (uint64_t value : tree.mem_rsv) {
+    fdt_put32(out, value >> 32);
+    fdt_put32(out, value);
+  }
+  out.insert(out.end(), 16, 0);
+  out.insert(out.end(), dt.begin(), dt.end());
+  out.insert(out.end(), strings.begin(), strings.end());
+  if (out.size() > max_len) return 0;
+  memcpy(blob, out.data(), out.size());
+  return out.size();
+}
+
+fdt_prop* fdt_get_prop(fdt_node& node, const char* name) {
+  for (fdt_prop& prop : node.props) {
+    if (prop.name == name) return &prop;
+  }
+  return nullptr;
+}
+
+void fdt_set_prop(fdt_node& node, const char* name, const std::vector<uint8_t>& value) {
+  fdt_prop* prop = fdt_get_prop(node, name);
+  if (prop) {
+    prop->value = value;
+  } else {
+    node.props.push_back({name, value});
+  }
+}
+
+uint32_t fdt_get_u32(fdt_node& node, const char* name, uint32_t fallback) {
+  fdt_prop* prop = fdt_get_prop(node, name);
+  if (!prop || prop->value.size() < 4) return fallback;
+  return fdt_be32(prop->value.data());
+}
+
+std::vector<uint8_t> fdt_cells(const std::vector<uint32_t>& cells) {
+  std::vector<uint8_t> value;
+  for (uint32_t cell : cells) {
+    fdt_put32(value, cell);
+  }
+  return value;
+}
+
+bool fdt_append_num(std::vector<uint8_t>& value, uint64_t num, uint32_t cells) {
+  if (cells < 2 && num >> (32 * cells)) return false;
+  for (uint32_t i = cells; i > 0; i--) {
+    fdt_put32(value, i > 2 ? 0 : num >> (32 * (i - 1)));
+  }
+  return true;
+}
+
+std::vector<uint8_t> fdt_string(const char* str) {
+  return std::vector<uint8_t>(str, str + strlen(str) + 1);
+}
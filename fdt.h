@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// minimal flattened devicetree reader and writer, enough to rewrite nodes of a loaded DTB
+// the blob is parsed into a tree, edited, and written back out
+
+struct fdt_prop {
+  std::string name;
+  std::vector<uint8_t> value;
+};
+
+struct fdt_node {
+  std::string name;
+  std::vector<fdt_prop> props;
+  std::vector<fdt_node> children;
+};
+
+struct fdt_tree {
+  fdt_node root;
+  std::vector<uint64_t> mem_rsv; // address, size pairs
+  uint32_t boot_cpuid;
+};
+
+bool fdt_parse(const uint8_t* blob, size_t max_len, fdt_tree& tree);
+// returns the size of the written blob, or 0 if it does not fit
+size_t fdt_write(const fdt_tree& tree, uint8_t* blob, size_t max_len);
+
+// nullptr if the node has no such property
+fdt_prop* fdt_get_prop(fdt_node& node, const char* name);
+// adds the property, or replaces its value
+void fdt_set_prop(fdt_node& node, const char* name, const std::vector<uint8_t>& value);
+// the first cell of a property, or fallback if it is missing
+uint32_t fdt_get_u32(fdt_node& node, const char* name, uint32_t fallback);
+
+// property values: big-endian cells, a number as the given count of cells, and a string
+// fdt_append_num fails without appending if the number does not fit in the cells
+std::vector<uint8_t> fdt_cells(const std::vector<uint32_t>& cells);
+bool fdt_append_num(std::vector<uint8_t>& value, uint64_t num, uint32_t cells);
+std::vector<uint8_t> fdt_string(const char* str);
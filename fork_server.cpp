@@ -0,0 +1,116 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <string>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "io.h"
+#include "fork_server.h"
+
+extern bool interrupted;
+
+bool fork_server_enabled = false;
+std::atomic<bool> fork_requested = false;
+
+std::string fork_server_path;
+int fork_listen_fd = -1;
+// in a clone, the connection it was requested on
+int fork_conn_fd = -1;
+
+bool fork_server_set_socket(const char* path) {
+  fork_server_path = path;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (fork_server_path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, fork_server_path.c_str());
+  unlink(addr.sun_path);
+  fork_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fork_listen_fd < 0) return false;
+  if (bind(fork_listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(fork_listen_fd, 64)) {
+    close(fork_listen_fd);
+    fork_listen_fd = -1;
+    return false;
+  }
+  fork_server_enabled = true;
+  return true;
+}
+
+// reads the request byte and the optional stdio fd, returns -2 if the request is broken
+int fork_server_recv(int conn_fd) {
+  char byte;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))];
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  if (recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC) != 1) return -2;
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+bool fork_server_run(bool& use_stdio) {
+  dbg_print("Serving clones at ");
+  dbg_print(fork_server_path.c_str());
+  dbg_endl();
+  while (!interrupted) {
+    // clones that exited are reaped here, the clients see their connection close
+    while (waitpid(-1, nullptr, WNOHANG) > 0);
+    pollfd pfd = {fork_listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) continue;
+    int conn_fd = accept4(fork_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn_fd < 0) continue;
+    int stdio_fd = fork_server_recv(conn_fd);
+    if (stdio_fd == -2) {
+      close(conn_fd);
+      continue;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fork_listen_fd);
+      fork_listen_fd = -1;
+      fork_server_enabled = false; // a clone runs past the marker like any other machine
+      fork_conn_fd = conn_fd;
+      use_stdio = stdio_fd >= 0;
+      if (use_stdio) {
+        dup2(stdio_fd, 0);
+        dup2(stdio_fd, 1);
+        dup2(stdio_fd, 2);
+        close(stdio_fd);
+      }
+      return true;
+    }
+    if (pid < 0) {
+      dbgerr_print("Could not fork a clone");
+      dbgerr_endl();
+    }
+    if (stdio_fd >= 0) close(stdio_fd);
+    close(conn_fd);
+  }
+  return false;
+}
+
+void fork_server_reply(const char* pty_name) {
+  char reply[64 + 4096];
+  int len = snprintf(reply, sizeof(reply), "%d %s\n", getpid(), pty_name ? pty_name : "-");
+  send(fork_conn_fd, reply, len, MSG_NOSIGNAL);
+}
+
+void fork_server_uninit() {
+  if (fork_listen_fd < 0) return;
+  close(fork_listen_fd);
+  unlink(fork_server_path.c_str());
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <atomic>
+
+// fork server: the guest boots once up to a marker instruction, then the emulator stops there
+// and every connection to a UNIX socket gets its own copy of the machine, forked from that point
+// guest RAM is shared copy-on-write between all the clones, so each one only costs the pages it writes
+
+// "sltiu zero, t1, 0xf0c", a HINT in RV64I that does nothing unless a fork server socket is given
+#define FORK_MARKER 0xf0c33013
+
+extern bool fork_server_enabled;
+// set by the hart that ran the marker
+extern std::atomic<bool> fork_requested;
+
+bool fork_server_set_socket(const char* path);
+
+// a client sends one byte, and may attach one fd as SCM_RIGHTS to be the stdin, stdout and stderr of the clone
+// the clone answers with "<pid> <PTY path or ->\n" once it runs, and keeps the connection open until it exits
+// called with every thread but the main one stopped; returns true in a clone, with use_stdio set if it got an fd,
+// and false in the server once it is interrupted
+bool fork_server_run(bool& use_stdio);
+// sends the answer to the client, once the clone has set up its IO
+void fork_server_reply(const char* pty_name);
+void fork_server_uninit();
@@ -0,0 +1,132 @@
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "constants.h"
+#include "cpu.h"
+#include "hartexc.h"
+#include "hart_sched.h"
+#include "sbi.h"
+
+extern bool interrupted;
+extern std::atomic<bool> harts_paused;
+
+struct sched_queue {
+  std::mutex lock;
+  std::deque<uint16_t> harts;
+};
+
+struct sched_hart {
+  std::mutex running;
+  std::atomic<bool> sleeping;
+};
+
+bool sched_enabled = false;
+uint16_t sched_worker_count = 0;
+bool sched_deterministic = false;
+
+std::vector<sched_queue> sched_queues;
+std::vector<sched_hart> sched_harts;
+// bumped for every hart put on a queue, idle workers wait on it
+std::atomic<uint32_t> sched_work = 0;
+
+bool sched_set_workers(const char* spec) {
+  char* end;
+  unsigned long count = strtoul(spec, &end, 10);
+  if (end == spec || *end || count == 0 || count > UINT16_MAX) return false;
+  sched_worker_count = count;
+  return true;
+}
+
+void sched_push(uint16_t worker, uint16_t hartid) {
+  sched_queue& queue = sched_queues[worker];
+  {
+    std::lock_guard<std::mutex> lock(queue.lock);
+    queue.harts.push_back(hartid);
+  }
+  sched_work++;
+  sched_work.notify_one();
+}
+
+void sched_init() {
+  // a fork server clone starts again from here, with every hart runnable
+  sched_queues = std::vector<sched_queue>(sched_worker_count);
+  sched_harts = std::vector<sched_hart>(MACH_HART_COUNT);
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    sched_queues[i % sched_worker_count].harts.push_back(i);
+  }
+}
+
+int32_t sched_next(uint16_t worker) {
+  while (true) {
+    // read before looking at the queues, so a hart queued after that is not missed
+    uint32_t work = sched_work.load();
+    if (harts_paused || interrupted) return -1;
+    for (uint16_t i = 0; i < sched_worker_count; i++) {
+      sched_queue& queue = sched_queues[(worker + i) % sched_worker_count];
+      std::lock_guard<std::mutex> lock(queue.lock);
+      if (queue.harts.empty()) continue;
+      uint16_t hartid;
+      if (i == 0) {
+        hartid = queue.harts.front();
+        queue.harts.pop_front();
+      } else { // stolen from another worker
+        hartid = queue.harts.back();
+        queue.harts.pop_back();
+      }
+      return hartid;
+    }
+    sched_work.wait(work);
+  }
+}
+
+void sched_requeue(uint16_t worker, uint16_t hartid) {
+  sched_push(worker, hartid);
+}
+
+void sched_sleep(uint16_t worker, HartState& hs, bool (*ready)(HartState& hs)) {
+  sched_hart& hart = sched_harts[hs.hartid];
+  hart.sleeping = true;
+  // pairs with the fence in sched_chk: either this sees the doorbell that was rung, or the ringer sees it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // if it got woken up already, whoever did that has queued it
+  if (ready(hs) && hart.sleeping.exchange(false)) sched_push(worker, hs.hartid);
+}
+
+void sched_wake(uint16_t hartid) {
+  if (sched_harts[hartid].sleeping.exchange(false)) sched_push(hartid % sched_worker_count, hartid);
+}
+
+void sched_wake_workers() {
+  sched_work++;
+  sched_work.notify_all();
+}
+
+bool sched_irq_pending(HartState& hs) {
+  // WFI ends on any locally enabled interrupt, whether interrupts are enabled globally or not
+  return hart_pending_int(hs) & (hs.mie | hs.sie);
+}
+
+void sched_chk(HartState& hs) {
+  // harts stopped or suspended through the SBI are woken by it instead
+  // the doorbell was just rung, and that store must not pass the load of sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sched_harts[hs.hartid].sleeping.load(std::memory_order_relaxed) && sched_irq_pending(hs)
+      && std::atomic_ref<uint8_t>(hs.hsm_state).load(std::memory_order_relaxed) == SBI_HSM_STARTED) {
+    sched_wake(hs.hartid);
+  }
+}
+
+bool sched_all_sleeping() {
+  for (sched_hart& hart : sched_harts) {
+    if (!hart.sleeping.load(std::memory_order_relaxed)) return false;
+  }
+  return true;
+}
+
+std::mutex& sched_hart_lock(uint16_t hartid) {
+  return sched_harts[hartid].running;
+}
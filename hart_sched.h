@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+
+#include "cpu.h"
+
+// M:N hart scheduling: with -T, the harts run on fewer host threads than there are harts
+// each worker thread has a run queue of harts, runs the one at its front for a quantum of instructions
+// and puts it at the back, and takes harts from the back of the other queues when its own is empty
+// a hart in WFI, or stopped or suspended through the built-in SBI, is taken off the queues until something wakes it
+
+#define SCHED_QUANTUM 10000
+// in deterministic mode, every instruction takes this long in the virtual time of the ACLINT
+#define SCHED_DET_NS_PER_INST 10
+// "wfi"
+#define WFI_INST 0x10500073
+
+extern bool sched_enabled;
+extern uint16_t sched_worker_count;
+// with -D, every hart runs on one thread instead, taking turns of a quantum each in a fixed order
+// the ACLINT then counts instructions instead of host time, and the interrupts are updated between the rounds,
+// so a run without outside input goes the same way every time
+extern bool sched_deterministic;
+
+bool sched_set_workers(const char* spec);
+
+// puts every hart on a run queue, called before the workers start
+void sched_init();
+// the next hart for a worker to run, sleeping while there is none
+// returns -1 when the harts are paused or interrupted
+int32_t sched_next(uint16_t worker);
+// puts a hart back after its quantum
+void sched_requeue(uint16_t worker, uint16_t hartid);
+// takes a hart off the run queues, unless ready returns true for it
+// ready is checked after the hart is marked as sleeping, so a wake up in between is not lost
+void sched_sleep(uint16_t worker, HartState& hs, bool (*ready)(HartState& hs));
+// puts a sleeping hart back on a run queue
+void sched_wake(uint16_t hartid);
+// wakes the workers waiting for harts, so they see harts_paused or interrupted
+void sched_wake_workers();
+// whether a hart in WFI has an interrupt to wake up for
+bool sched_irq_pending(HartState& hs);
+// wakes a hart in WFI with an interrupt pending, called through hart_notify when its interrupts change
+void sched_chk(HartState& hs);
+// whether every hart is off the run queues, in WFI or stopped or suspended
+bool sched_all_sleeping();
+// held by the worker running a hart, other threads may change a hart that is not running while holding it
+std::mutex& sched_hart_lock(uint16_t hartid);
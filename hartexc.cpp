@@ -1,5 +1,9 @@
+#include <atomic>
+
 #include "hartexc.h"
 #include "cpu.h"
+#include "sbi.h"
+#include "hart_sched.h"
 
 // returns the exception it created, if it's not masked
 // if the exception is masked, returns NOEXC
@@ -7,6 +11,8 @@ HartException create_exception(HartState &hs, HartException he, uint64_t tval){
   // safety precaution: clear instbuf to prevent incorrect caching behaviour at the trap handler
   hs.instbuf = 0;  
   
+  if (he == HartException::HSECALL && sbi_enabled) return sbi_ecall(hs);
+  
   bool interrupt = (uint64_t)he & (0b1LL << 63);
   uint64_t cause = (uint64_t)he & ~(0b1LL << 63);
   uint64_t int_mask = 0b1LL << cause;
@@ -118,3 +124,50 @@ bool setup_pending_int(HartState &hs) {
   
   return false;
 }
+
+std::atomic<uint32_t> harts_waiting = 0;
+
+// a later raise or lower of the same bit replaces an earlier one still in the doorbell
+void hart_ring(HartState &hs, uint32_t raise, uint32_t lower) {
+  std::atomic_ref<uint32_t> doorbell(hs.irq_doorbell);
+  uint32_t old = doorbell.load(std::memory_order_relaxed);
+  uint32_t next;
+  do {
+    next = (old & ~(lower | (raise << DOORBELL_LOWER_SHIFT))) | raise | (lower << DOORBELL_LOWER_SHIFT) | DOORBELL_CHK;
+  } while (!doorbell.compare_exchange_weak(old, next));
+  // a hart in WFI with a thread of its own waits on the doorbell
+  doorbell.notify_one();
+  if (sbi_enabled) sbi_chk(hs);
+  if (sched_enabled) sched_chk(hs);
+}
+
+void hart_raise_int(HartState &hs, uint64_t bits) {
+  hart_ring(hs, bits, 0);
+}
+
+void hart_lower_int(HartState &hs, uint64_t bits) {
+  hart_ring(hs, 0, bits);
+}
+
+void hart_notify(HartState &hs) {
+  hart_ring(hs, 0, 0);
+}
+
+void hart_recheck(HartState &hs) {
+  std::atomic_ref<uint32_t>(hs.irq_doorbell).fetch_or(DOORBELL_CHK, std::memory_order_relaxed);
+}
+
+uint64_t hart_pending_int(HartState &hs) {
+  uint32_t doorbell = std::atomic_ref<uint32_t>(hs.irq_doorbell).load(std::memory_order_relaxed);
+  uint64_t mip = std::atomic_ref<uint64_t>(hs.mip).load(std::memory_order_relaxed);
+  return (mip & ~(uint64_t)(doorbell >> DOORBELL_LOWER_SHIFT)) | (doorbell & ((1u << DOORBELL_LOWER_SHIFT) - 1));
+}
+
+bool hart_take_doorbell(HartState &hs) {
+  std::atomic_ref<uint32_t> doorbell(hs.irq_doorbell);
+  if (!doorbell.load(std::memory_order_relaxed)) [[likely]] return false;
+  uint32_t rung = doorbell.exchange(0, std::memory_order_acquire);
+  uint64_t mip = (hs.mip & ~(uint64_t)((rung & ~DOORBELL_CHK) >> DOORBELL_LOWER_SHIFT)) | (rung & ((1u << DOORBELL_LOWER_SHIFT) - 1));
+  std::atomic_ref<uint64_t>(hs.mip).store(mip, std::memory_order_relaxed); // read by the threads that wake the hart
+  return true;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <atomic>
 #include "cpu.h"
 
 // setup CSRs for the exception
@@ -8,3 +9,24 @@ HartException create_exception(HartState &hs, HartException he, uint64_t tval);
 // check for pending interrupts, and if one exists, sets up the exception
 // returns if there's an exception
 bool setup_pending_int(HartState &hs);
+
+// the doorbell holds mip bits to set in its low half, bits to clear in its high half, and a bit to only look again
+// anyone may ring it, the hart takes it once per instruction with a single exchange, applies it to mip
+// and checks its interrupts; so mip itself is only ever written by the hart
+#define DOORBELL_LOWER_SHIFT 16
+#define DOORBELL_CHK (1u << 31)
+
+// sets or clears mip bits of a hart from any thread, and wakes the hart if it sleeps waiting for an interrupt
+void hart_raise_int(HartState &hs, uint64_t bits);
+void hart_lower_int(HartState &hs, uint64_t bits);
+// makes a hart check its interrupts before its next instruction, and wakes it if it sleeps
+void hart_notify(HartState &hs);
+// the same from the hart itself, which is awake
+void hart_recheck(HartState &hs);
+// mip with the bits raised since the hart last took its doorbell, for deciding whether to wake it
+uint64_t hart_pending_int(HartState &hs);
+// called by the hart itself, returns false if the doorbell was not rung
+bool hart_take_doorbell(HartState &hs);
+
+// how many harts with a thread of their own sleep in WFI, or stopped or suspended through the built-in SBI, for -I
+extern std::atomic<uint32_t> harts_waiting;
@@ -0,0 +1,221 @@
+#include <cstdint>
+#include <atomic>
+#include <bit>
+#include <vector>
+
+#include "imsic.h"
+#include "constants.h"
+#include "hartexc.h"
+
+bool aia_enabled = false;
+
+// eip is set by any thread, everything else only changes through the CSRs of the hart itself
+struct imsic_file {
+  uint64_t eip[IMSIC_ID_WORDS];
+  uint64_t eie[IMSIC_ID_WORDS];
+  uint64_t eidelivery;
+  uint64_t eithreshold;
+  // miselect or siselect, the file of the same level is where mireg or sireg goes
+  uint64_t iselect;
+};
+
+// file 2 * hartid for M-level, 2 * hartid + 1 for S-level, like the PLIC contexts
+std::vector<imsic_file> imsic_files;
+
+#define IMSIC_EIP(level) ((level) ? (1 << 9) : (1 << 11)) // SEIP, MEIP
+
+void imsic_init() {
+  imsic_files = std::vector<imsic_file>(2 * MACH_HART_COUNT, imsic_file{});
+}
+
+imsic_file& imsic_get(uint32_t hartid, bool s_level) {
+  return imsic_files[2 * hartid + s_level];
+}
+
+// the lowest identity that is pending and enabled, which is the highest priority, or 0 if it is at or above the threshold
+uint32_t imsic_top(imsic_file& file) {
+  for (uint16_t word = 0; word < IMSIC_ID_WORDS; word++) {
+    uint64_t bits = std::atomic_ref<uint64_t>(file.eip[word]).load() & std::atomic_ref<uint64_t>(file.eie[word]).load();
+    if (!bits) continue;
+    uint32_t id = word * 64 + std::countr_zero(bits);
+    return (!file.eithreshold || id < file.eithreshold) ? id : 0;
+  }
+  return 0;
+}
+
+bool imsic_asserted(imsic_file& file) {
+  return (file.eidelivery & 1) && imsic_top(file);
+}
+
+void imsic_send(uint32_t hartid, bool s_level, uint32_t id) {
+  if (hartid >= MACH_HART_COUNT || id == 0 || id >= IMSIC_ID_COUNT) return; // lost, as an MSI to nowhere is
+  imsic_file& file = imsic_get(hartid, s_level);
+  std::atomic_ref<uint64_t>(file.eip[id / 64]).fetch_or(1ull << (id % 64));
+  // only the hart lowers it
+  if (imsic_asserted(file)) hart_raise_int(hartlist[hartid], IMSIC_EIP(s_level));
+}
+
+// called by the hart after it changed its own file
+void imsic_update(HartState &hs, bool s_level) {
+  imsic_file& file = imsic_get(hs.hartid, s_level);
+  if (imsic_asserted(file)) {
+    hart_raise_int(hs, IMSIC_EIP(s_level));
+    return;
+  }
+  hart_lower_int(hs, IMSIC_EIP(s_level));
+  // an MSI that came in meanwhile may have raised it just before this lowered it
+  if (imsic_asserted(file)) hart_raise_int(hs, IMSIC_EIP(s_level));
+}
+
+uint64_t aia_rmw(uint64_t old, uint64_t wvalue, uint8_t funct) {
+  switch (funct) {
+    case 0b01:
+      return wvalue;
+    case 0b10:
+      return old | wvalue;
+    case 0b11:
+      return old & ~wvalue;
+  }
+  return old;
+}
+
+// the major interrupt with the highest default priority among the ones pending, or 0
+uint64_t aia_topi(uint64_t pending) {
+  static const uint8_t order[] = {11, 3, 7, 9, 1, 5, 13};
+  for (uint8_t iid : order) {
+    if (pending & (1ull << iid)) return ((uint64_t)iid << 16) | 1; // the priorities are all read-only zero
+  }
+  return 0;
+}
+
+bool aia_csr(uint16_t addr) {
+  if (!aia_enabled) return false;
+  switch (addr) {
+    case 0x308: // mvien
+    case 0x309: // mvip
+    case 0x350: // miselect
+    case 0x351: // mireg
+    case 0x35C: // mtopei
+    case 0xFB0: // mtopi
+    case 0x150: // siselect
+    case 0x151: // sireg
+    case 0x15C: // stopei
+    case 0xDB0: // stopi
+      return true;
+  }
+  return false;
+}
+
+HartException aia_csr_rw(HartState &hs, uint16_t addr, uint64_t* rvalue, uint64_t wvalue, uint8_t funct) {
+  // csrrs and csrrc with x0 do not write
+  bool write = funct == 0b01 || wvalue;
+  bool s_level = (addr & 0xF00) != 0x300 && addr != 0xFB0;
+  imsic_file& file = imsic_get(hs.hartid, s_level);
+  uint64_t value = 0;
+  switch (addr & 0xFF) {
+    case 0x08: // mvien, nothing virtual to enable
+    case 0x09: // mvip
+      break;
+    case 0x50: // xiselect
+      value = file.iselect;
+      if (write) file.iselect = aia_rmw(file.iselect, wvalue, funct) & 0xFFF;
+      break;
+    case 0x51: { // xireg
+      uint64_t* reg = nullptr;
+      if (0x30 <= file.iselect && file.iselect < 0x40) {
+        // iprio, read-only zero
+      } else if (file.iselect == 0x70) {
+        reg = &file.eidelivery;
+      } else if (file.iselect == 0x72) {
+        reg = &file.eithreshold;
+      } else if (0x80 <= file.iselect && file.iselect < 0x100) {
+        if (file.iselect & 0b1) { // odd-numbered, illegal under RV64
+          return create_exception(hs, HartException::ILLINST, hs.inst);
+        }
+        uint16_t word = (file.iselect & 0x3F) / 2;
+        if (word < IMSIC_ID_WORDS) reg = (file.iselect < 0xC0) ? &file.eip[word] : &file.eie[word];
+      } else {
+        return create_exception(hs, HartException::ILLINST, hs.inst);
+      }
+      if (!reg) break;
+      value = std::atomic_ref<uint64_t>(*reg).load();
+      if (!write) break;
+      if (reg == &file.eidelivery) {
+        file.eidelivery = aia_rmw(value, wvalue, funct) & 1; // PLIC delivery through the IMSIC is not implemented
+      } else if (reg == &file.eithreshold) {
+        file.eithreshold = aia_rmw(value, wvalue, funct) & (IMSIC_ID_COUNT - 1);
+      } else {
+        // eip and eie are set and cleared atomically, so MSIs arriving meanwhile are kept
+        uint64_t valid = (reg == &file.eip[0] || reg == &file.eie[0]) ? ~1ull : ~0ull; // identity 0 does not exist
+        if (funct == 0b10) {
+          std::atomic_ref<uint64_t>(*reg).fetch_or(wvalue & valid);
+        } else if (funct == 0b11) {
+          std::atomic_ref<uint64_t>(*reg).fetch_and(~wvalue);
+        } else {
+          std::atomic_ref<uint64_t>(*reg).store(wvalue & valid);
+        }
+      }
+      imsic_update(hs, s_level);
+      break;
+    }
+    case 0x5C: { // xtopei
+      uint32_t id = imsic_top(file);
+      value = ((uint64_t)id << 16) | id;
+      // any write claims the identity that was read
+      if (write && id) {
+        std::atomic_ref<uint64_t>(file.eip[id / 64]).fetch_and(~(1ull << (id % 64)));
+        imsic_update(hs, s_level);
+      }
+      break;
+    }
+    case 0xB0: // xtopi, read-only
+      if (write) return create_exception(hs, HartException::ILLINST, hs.inst);
+      if (s_level) {
+        value = aia_topi(hs.mip & hs.mie & hs.mideleg);
+      } else {
+        value = aia_topi(hs.mip & hs.mie & ~hs.mideleg);
+      }
+      break;
+  }
+  if (rvalue != (uint64_t*)&hs.regs[0]) *rvalue = value;
+  return HartException::NOEXC;
+}
+
+void imsic_w(bool s_level, uint64_t offset, void* dataptr, uint8_t len) {
+  if (len != 4) return;
+  uint32_t hartid = offset / IMSIC_FILE_SIZE;
+  uint32_t id = *(uint32_t*)dataptr;
+  switch (offset % IMSIC_FILE_SIZE) {
+    case 0: // seteipnum_le
+      imsic_send(hartid, s_level, id);
+      break;
+    case 4: // seteipnum_be
+      imsic_send(hartid, s_level, __builtin_bswap32(id));
+      break;
+  }
+}
+
+// the registers of an interrupt file read as zero
+void* imsic_m_r ([[maybe_unused]] uint64_t offset, [[maybe_unused]] uint8_t len) {
+  return &ZERO;
+}
+
+void imsic_m_w (uint64_t offset, void* dataptr, uint8_t len) {
+  imsic_w(false, offset, dataptr, len);
+}
+
+void* imsic_s_r ([[maybe_unused]] uint64_t offset, [[maybe_unused]] uint8_t len) {
+  return &ZERO;
+}
+
+void imsic_s_w (uint64_t offset, void* dataptr, uint8_t len) {
+  imsic_w(true, offset, dataptr, len);
+}
+
+void imsic_save(std::vector<uint8_t>& out) {
+  snap_put(out, imsic_files.data(), imsic_files.size() * sizeof(imsic_file));
+}
+
+bool imsic_restore(snap_reader& in) {
+  return snap_get(in, imsic_files.data(), imsic_files.size() * sizeof(imsic_file));
+}
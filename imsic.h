@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "cpu.h"
+#include "snapshot.h"
+
+// AIA: with -a, every hart has an IMSIC with an M-level and an S-level interrupt file, and the wired sources
+// of the devices go through an APLIC in MSI mode instead of the PLIC, see aplic.h
+// an interrupt file takes MSIs at its seteipnum register, and the hart claims them through mtopei/stopei
+
+// one page per hart and level
+#define IMSIC_M_BASE 0x2400'0000
+#define IMSIC_S_BASE 0x2800'0000
+#define IMSIC_FILE_SIZE 0x1000
+#define IMSIC_REGION_SIZE 0x400'0000
+// identity 0 does not exist, so this is 255 identities
+#define IMSIC_ID_COUNT 256
+#define IMSIC_ID_WORDS (IMSIC_ID_COUNT / 64)
+
+extern bool aia_enabled;
+
+void imsic_init();
+
+// sets an identity pending in an interrupt file of a hart, from any thread, as an MSI to its seteipnum does
+void imsic_send(uint32_t hartid, bool s_level, uint32_t id);
+
+// whether a CSR is one of the AIA ones, only with -a
+bool aia_csr(uint16_t addr);
+// reads and writes an AIA CSR, which the interrupt files are reached through
+HartException aia_csr_rw(HartState &hs, uint16_t addr, uint64_t* rvalue, uint64_t wvalue, uint8_t funct);
+
+void* imsic_m_r (uint64_t offset, uint8_t len);
+void imsic_m_w (uint64_t offset, void* dataptr, uint8_t len);
+void* imsic_s_r (uint64_t offset, uint8_t len);
+void imsic_s_w (uint64_t offset, void* dataptr, uint8_t len);
+
+void imsic_save(std::vector<uint8_t>& out);
+bool imsic_restore(snap_reader& in);
@@ -74,6 +74,13 @@ char dbg_getc() {
 #include <pty.h>
 #include <unistd.h>
 #include <linux/limits.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+
+// how long a write waits for the reader of the PTY before dropping the output
+#define PTY_WRITE_TIMEOUT_MS 1000
 
 int pty_master, pty_slave;
 FILE *pty_master_in, *pty_master_out;
@@ -83,6 +90,7 @@ bool dbg_fallback = false;
 
 void pty_init(bool skip) {
   pty_slave_name = new char[PATH_MAX];
+  dbg_fallback = false;
   if (skip) {
     dbg_print("PTY init skipped, falling back to emulated IO through debug");
     dbg_endl();
@@ -135,6 +143,60 @@ char pty_getc() {
   return getc(pty_master_in);
 }
 void pty_endl() {
+  if (dbg_fallback) {
+    dbg_endl();
+    return;
+  }
   fprintf(pty_master_out, "\n");
   fflush(pty_master_out);
 }
+
+const char* pty_name() {
+  return dbg_fallback ? nullptr : pty_slave_name;
+}
+
+int pty_in_fd() {
+  if (dbg_fallback) {
+    return 0; // stdin, set to non-blocking by io_init
+  }
+  return pty_master;
+}
+ssize_t pty_writev(const struct iovec* iov, int iovcnt) {
+  int fd = pty_master;
+  if (dbg_fallback) {
+    if (sig_mode) return 0;
+    fflush(stdout); // keep ordering with buffered debug output
+    fd = 1;
+  } else {
+    fflush(pty_master_out);
+  }
+  // the fds are non-blocking, so retry until everything is written
+  // a reader that stalls for longer loses the rest, as the callers may hold locks other writers need
+  ssize_t total = 0;
+  struct iovec rest[IOV_MAX];
+  if (iovcnt > IOV_MAX) iovcnt = IOV_MAX;
+  memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+  struct iovec* cur = rest;
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, cur, iovcnt);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if (poll(&pfd, 1, PTY_WRITE_TIMEOUT_MS) == 0) return total;
+        continue;
+      }
+      return total ? total : n;
+    }
+    total += n;
+    while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+      n -= cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (char*)cur->iov_base + n;
+      cur->iov_len -= n;
+    }
+  }
+  return total;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <sys/uio.h>
 
 void io_init(bool skip_pty = false);
 void io_uninit();
@@ -24,3 +25,11 @@ void pty_uninit();
 void pty_print(const char* msg);
 char pty_getc();
 void pty_endl();
+// the path of the PTY slave, or nullptr when using stdio
+const char* pty_name();
+
+// bulk IO for devices that move whole buffers at once
+// the input fd is non-blocking, and can be polled by device threads
+int pty_in_fd();
+// drops what is left when the reader stalls for a second, and returns how much was written
+ssize_t pty_writev(const struct iovec* iov, int iovcnt);
@@ -4,10 +4,12 @@
 #include <fcntl.h>
 #include <cstring>
 #include <thread>
+#include <atomic>
 #include <vector>
 
 #include "cpu.h"
 #include "mem.h"
+#include "mem_dump.h"
 #include "io.h"
 #include "constants.h"
 #include "hartexc.h"
@@ -17,37 +19,92 @@
 #include "plic.h"
 #include "uart.h"
 #include "virtio_mmio_blk.h"
+#include "virtio_console.h"
+#include "virtio_9p.h"
+#include "virtio_pmem.h"
+#include "virtio_vsock.h"
+#include "virtio_balloon.h"
+#include "mem_share.h"
+#include "vhost_user.h"
+#include "placement.h"
+#include "snapshot.h"
+#include "fork_server.h"
+#include "sbi.h"
+#include "hart_sched.h"
+#include "replay.h"
 
 #define HELP_MSG \
 "USAGE: ./main <args>\n\
 Possible arguments:\n\
--f <path to firmware>\n\
+-f <path to firmware>, none to run the kernel alone in M-mode, or sbi to run it in S-mode on the built-in SBI\n\
 -k <path to kernel>\n\
 -i <path to initrd>\n\
--m <memory size, default 512MiB>\n\
+-m <memory size>[,<size>@<base>...], RAM banks, default 512MiB\n\
+-M <option>[,<option>...] guest memory backing: nothp, hugetlb, prefault, mlock\n\
+-R <path> back guest memory with a memfd, and hand it out to every connection on a UNIX socket at <path>\n\
 -c <hart count, default 1>\n\
+-T <thread count> run the harts on this many host threads, taking turns when there are more harts than threads\n\
+-D run every hart on one host thread in a fixed order, with time counted in instructions, so runs are reproducible\n\
+-I when every hart waits for an interrupt, move the timer straight to the next deadline instead of waiting for it\n\
+-a use the AIA, with an IMSIC per hart and the devices on an APLIC in MSI mode, in place of the PLIC\n\
+-r <path> record the input of a run to a file, implies -D\n\
+-y <path> replay a recording made with -r, with the same options\n\
 -d <path to device tree blob>\n\
 -s <path to signature output>\n\
--e dump the whole memory into a file named \"mem_dump\" at exit\n\
+-e[z] dump the whole memory into a file named \"mem_dump\" at exit and on SIGUSR2, or a compressed \"mem_dump.z\" with -ez\n\
 -p disable PTY setup for emulated UART terminal, and use stdio instead\n\
+-v [name=]<path> add a virtio console port exposed as a UNIX socket, can be repeated\n\
+-t [tag=]<path> share a host directory with the guest over virtio 9p, default tag is hostshare\n\
+-P <path>[,ro|,cow] map a host file into the guest as virtio pmem, shared and writable by default\n\
+-V <path>[,cid=<n>] add a virtio vsock device with its host side on UNIX sockets at <path>, default guest CID is 3\n\
+-B <path> add a virtio balloon device with free page reporting, controlled through a UNIX socket at <path>\n\
+-U <type>:<path> add a virtio device served by a vhost-user backend listening at <path>, type is blk, net or a device id, up to 2\n\
+-A <role>:<cpu list> pin threads to host CPUs, role is harts, io or main, can be repeated\n\
+-N <hart list>@<bank list>[=<host node>] add a guest NUMA node, optionally bound to a host NUMA node, can be repeated\n\
+-S <path>[,incremental] write a snapshot of the whole machine to <path> on SIGUSR1\n\
+-L <path> restore the machine from a snapshot instead of loading firmware, kernel, dtb and initrd\n\
+-x <path> expand the compressed memory dump at <path> into a raw one at <path>.raw, and exit\n\
+-F <path> run up to the fork marker instruction, then serve copy-on-write clones of the machine on a UNIX socket at <path>\n\
 -h print this help message and exit\n\
 "
 
 void sigint_handler(int signum);
+void sigusr1_handler(int signum);
+void sigusr2_handler(int signum);
+void harts_ring_all();
+void harts_pause();
+void harts_resume();
+void harts_start();
+bool serve_clones();
 void hart_init(HartState& hs, uint16_t hartid);
 void hw_init();
-void hw_perhart_update(HartState& hs);
 void hw_update();
+// whether a hart waiting for an interrupt has one pending
+bool harts_irq_pending();
 void hw_uninit();
+void hw_stop();
+void hw_start();
 void hart_loop(HartState& hs);
+void hart_worker_loop(uint16_t worker);
+void hart_det_loop();
 
 std::vector<std::thread> hart_threads;
 
 bool hart_start = false;
 bool interrupted = false;
 
+// set by the main thread to stop the harts between instructions, each hart counts itself in harts_parked
+std::atomic<bool> harts_paused = false;
+std::atomic<uint16_t> harts_parked = 0;
+// makes parked harts return from their thread instead of running on
+bool harts_exit = false;
+
+bool snapshot_enabled = false;
+std::atomic<bool> snapshot_requested = false;
+
 int exit_signum = 0;
 bool dump_mem_atexit = false;
+std::atomic<bool> dump_requested = false;
 
 bool skip_pty = false;
 
@@ -58,11 +115,17 @@ int main(int argc, char** argv){
   char* dtbfile = nullptr;
   char* initrdfile = nullptr;
   char* signaturefile = nullptr;
+  char* restorefile = nullptr;
+  char* replayfile = nullptr;
+  bool replay_record = false;
+  // the first option a fork server cannot clone, as the clones would share its host socket or file
+  const char* unclonable = nullptr;
   char copt;
-  while ((copt = getopt(argc, argv, "f:k:i:m::c::d:s:eph")) != -1){
+  while ((copt = getopt(argc, argv, "f:k:i:m::M:R:c::T:DIar:y:d:s:e::pv:t:P:V:B:U:A:N:S:L:F:x:h")) != -1){
     switch (copt){
       case 'f':
         fwfile = optarg;
+        sbi_enabled = strcmp(fwfile, "sbi") == 0;
         dbg_print("fw file:");
         dbg_print(fwfile);
         dbg_endl();
@@ -80,11 +143,59 @@ int main(int argc, char** argv){
         dbg_endl();
         break;
       case 'm':
-        MACH_MEM_SIZE = atol(optarg);
+        if (!optarg || !mem_set_banks(optarg)) {
+          dbgerr_print("Invalid RAM banks, expected <size>[,<size>@<base>...]");
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'M':
+        if (!mem_set_opts(optarg)) {
+          dbgerr_print("Unknown memory option in ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'R':
+        if (!mem_share_set_socket(optarg)) {
+          dbgerr_print("Could not create memory sharing socket ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        unclonable = "-R";
         break;
       case 'c':
         MACH_HART_COUNT = atoi(optarg);
         break;
+      case 'T':
+        if (!sched_set_workers(optarg)) {
+          dbgerr_print("Invalid hart thread count ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'D':
+        sched_deterministic = true;
+        aclint_virtual_time = true;
+        break;
+      case 'I':
+        aclint_idle_skip = true;
+        break;
+      case 'a':
+        aia_enabled = true;
+        break;
+      case 'r':
+      case 'y':
+        // both need the deterministic mode
+        replayfile = optarg;
+        replay_record = copt == 'r';
+        sched_deterministic = true;
+        aclint_virtual_time = true;
+        unclonable = replay_record ? "-r" : "-y";
+        break;
       case 'd':
         dtbfile = optarg;
         dbg_print("dtb file:");
@@ -96,11 +207,117 @@ int main(int argc, char** argv){
         sig_mode = true;
         break;
       case 'e':
+        if (optarg && strcmp(optarg, "z")) {
+          dbgerr_print("Unknown memory dump format ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
         dump_mem_atexit = true;
+        dump_mem_compressed = optarg != nullptr;
         break;
       case 'p':
         skip_pty = true;
         break;
+      case 'v':
+        if (!virtio_console_add_port(optarg)) {
+          dbgerr_print("Could not add virtio console port ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        unclonable = "-v";
+        break;
+      case 't':
+        if (!virtio_9p_set_share(optarg)) {
+          dbgerr_print("Could not share directory ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'P':
+        if (!virtio_pmem_set_file(optarg)) {
+          dbgerr_print("Could not map pmem file ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'V':
+        if (!virtio_vsock_set_socket(optarg)) {
+          dbgerr_print("Could not create vsock socket ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        unclonable = "-V";
+        break;
+      case 'B':
+        if (!virtio_balloon_set_socket(optarg)) {
+          dbgerr_print("Could not create balloon control socket ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        unclonable = "-B";
+        break;
+      case 'U':
+        if (!vhost_user_add_dev(optarg)) {
+          dbgerr_print("Could not connect to vhost-user backend ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        unclonable = "-U";
+        break;
+      case 'A':
+        if (!placement_set_affinity(optarg)) {
+          dbgerr_print("Invalid CPU affinity ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'N':
+        if (!placement_add_numa_node(optarg)) {
+          dbgerr_print("Invalid NUMA node ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'S':
+        if (!snapshot_set_path(optarg)) {
+          dbgerr_print("Invalid snapshot path ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        snapshot_enabled = true;
+        unclonable = "-S";
+        break;
+      case 'L':
+        restorefile = optarg;
+        break;
+      case 'F':
+        if (!fork_server_set_socket(optarg)) {
+          dbgerr_print("Could not create fork server socket ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        break;
+      case 'x': {
+        std::string raw_path = std::string(optarg) + ".raw";
+        if (!dump_mem_expand(optarg, raw_path.c_str())) {
+          dbgerr_print("Could not expand memory dump ");
+          dbgerr_print(optarg);
+          dbgerr_endl();
+          return 1;
+        }
+        return 0;
+      }
       case 'h': // print help and exit
         dbg_print(HELP_MSG);
         dbg_endl();
@@ -116,13 +333,42 @@ int main(int argc, char** argv){
         return 1;
     }
   }
-  if (! (fwfile || kernelfile)) {
-    dbgerr_print("Neither fw or kernel passed in command line!");
+  if (! (fwfile || kernelfile || restorefile)) {
+    dbgerr_print("Neither fw, kernel or snapshot passed in command line!");
     dbgerr_endl();
     return -1;
   }
+  // with as many threads as harts, each hart keeps its own
+  sched_enabled = !sched_deterministic && sched_worker_count && sched_worker_count < MACH_HART_COUNT;
+  if (!placement_check()) {
+    dbgerr_print("NUMA nodes must cover every RAM bank once, and name each hart at most once");
+    dbgerr_endl();
+    return 1;
+  }
+  // a shared pmem file would be written by every clone, only private or read-only mappings work as an overlay
+  if (pmem_mem && !pmem_readonly && !pmem_private) unclonable = "-P without ,ro or ,cow";
+  if (fork_server_enabled && unclonable) {
+    dbgerr_print("The fork server cannot be used with ");
+    dbgerr_print(unclonable);
+    dbgerr_endl();
+    return 1;
+  }
+
+  if (replayfile && restorefile) {
+    dbgerr_print("Record and replay start from boot, not from a snapshot");
+    dbgerr_endl();
+    return 1;
+  }
+  if (replayfile && !replay_open(replayfile, replay_record)) {
+    dbgerr_print(replay_record ? "Could not create recording " : "Not a recording for this hart count: ");
+    dbgerr_print(replayfile);
+    dbgerr_endl();
+    return 1;
+  }
 
   signal(SIGINT,sigint_handler);
+  if (snapshot_enabled) signal(SIGUSR1,sigusr1_handler);
+  if (dump_mem_atexit) signal(SIGUSR2,sigusr2_handler);
   io_init(skip_pty);
 
   hartlist = new HartState[MACH_HART_COUNT];
@@ -133,9 +379,36 @@ int main(int argc, char** argv){
     dump_state(hartlist[i]);
     #endif
   }
+  // the device threads started by hw_init inherit the io CPUs
+  placement_pin_io();
   hw_init();
   
-  if (fwfile == nullptr || strncmp(fwfile,"none",sizeof("none")) == 0){ // no extra firmware (e.g. OpenSBI)
+  if (restorefile) {
+    // everything the guest had loaded is in the snapshot
+    if (!snapshot_restore(restorefile)) {
+      dbgerr_print("Could not restore snapshot ");
+      dbgerr_print(restorefile);
+      dbgerr_endl();
+      hw_uninit();
+      io_uninit();
+      return 5;
+    }
+  } else if (sbi_enabled) {
+    // the kernel goes where it would with a firmware, and the harts are set up once the dtb is loaded
+    int kf = open(kernelfile, O_RDONLY, 0);
+    if (kf < 0) {
+      dbgerr_print("Could not open kernel ");
+      dbgerr_print(kernelfile ? kernelfile : "(none)");
+      dbgerr_endl();
+      hw_uninit();
+      io_uninit();
+      return 2;
+    }
+    dbg_print("kernel size:");
+    dbg_print(load_elf(kf, 0x20'0000));
+    dbg_endl();
+    close(kf);
+  } else if (fwfile == nullptr || strncmp(fwfile,"none",sizeof("none")) == 0){ // no extra firmware (e.g. OpenSBI)
     /*
     addi x8, x0, 1025
     slli x8, x8, 21
@@ -175,49 +448,102 @@ int main(int argc, char** argv){
     */
   }
   
-  if (dtbfile) { // dtb present
+  if (dtbfile && !restorefile) { // dtb present
     FILE* df = fopen(dtbfile,"rb");
     if (!df) return 3;
     dbg_print("dtb size:");
     dbg_print(fread(dtb_buf,1,MAX_DTB_SIZE,df));
     dbg_endl();
     fclose(df);
+    if (!mem_fixup_dtb()) {
+      dbgerr_print("Cannot rewrite the memory nodes of the dtb");
+      dbgerr_endl();
+      return 3;
+    }
   }
   
-  if (initrdfile) { // initrd present
-    FILE* initf = fopen(initrdfile,"rb");
-    if (!initf) return 4;
+  if (initrdfile && !restorefile) { // initrd present
+    int initf = open(initrdfile, O_RDONLY | O_CLOEXEC);
+    if (initf < 0) return 4;
+    // as large as the rest of the RAM bank, mapped from the page cache where possible
+    size_t initrd_size = mem_load_file(initf, 0, 0x8820'0000, UINT64_MAX);
+    close(initf);
+    if (!initrd_size) {
+      dbgerr_print("The initrd does not fit in RAM");
+      dbgerr_endl();
+      return 4;
+    }
     dbg_print("initrd size:");
-    dbg_print(fread(main_mem+0x820'0000,1,0x800'0000,initf));
+    dbg_print(initrd_size);
     dbg_endl();
-    fclose(initf);
   }
   
-  hart_start = false; // don't start execution until all threads have been created
-  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
-    hart_threads.emplace_back(std::thread(hart_loop,std::ref(hartlist[i])) );
+  if (sbi_enabled && !restorefile && !sbi_boot()) {
+    dbgerr_print("The dtb does not fit in RAM for the built-in SBI");
+    dbgerr_endl();
+    return 3;
   }
   
+  harts_start();
+  
   dbg_print("threads created, starting");
   dbg_endl();
-  aclint_mtimer_reset();
+  if (!restorefile) aclint_mtimer_reset(); // a restored mtime keeps counting from its saved value
   hart_start = true;
   
   while (!interrupted) {
-    for (size_t i = 0; i < MACH_HART_COUNT; i++) {
-      hw_perhart_update(hartlist[i]);
-      //setup_pending_int(hartlist[i]);
-      hartlist[i].chk_int = true;
+    // in deterministic mode the hart thread does this between its rounds
+    if (!sched_deterministic) {
+      hw_update();
+      // with a thread per hart, the waiting harts are the ones asleep on their doorbell or in the SBI
+      bool all_waiting = sched_enabled ? sched_all_sleeping() : harts_waiting.load() == MACH_HART_COUNT;
+      if (aclint_idle_skip && all_waiting && !harts_irq_pending() && aclint_skip_to_deadline()) {
+        aclint_mtimer_tick();
+      }
+    }
+    if (snapshot_requested) {
+      snapshot_requested = false;
+      harts_pause();
+      std::string saved = snapshot_take();
+      harts_resume();
+      if (saved.empty()) {
+        dbgerr_print("Could not write snapshot");
+      } else {
+        dbgerr_print("Snapshot written to ");
+        dbgerr_print(saved.c_str());
+      }
+      dbgerr_endl();
+    }
+    if (dump_requested) {
+      dump_requested = false;
+      // the harts only stop for the fork, or for the whole dump with shared RAM, so the dump holds the RAM of a single instant
+      harts_pause();
+      bool started = dump_mem_live();
+      harts_resume();
+      if (!started) {
+        dbgerr_print("Could not start a memory dump");
+        dbgerr_endl();
+      }
+    }
+    dump_mem_reap();
+    if (fork_requested) {
+      fork_requested = false;
+      harts_pause();
+      // the server only gets past this when interrupted, the clones carry on from here
+      if (!serve_clones()) break;
     }
-    hw_update();
     //std::this_thread::yield();
     std::this_thread::sleep_for(std::chrono::microseconds(5000)); // update the emulated hardware once per 5000 us at most
   }
   
   // wait for threads to exit
+  harts_ring_all();
+  if (sbi_enabled) sbi_wake_all();
+  if (sched_enabled) sched_wake_workers();
   for (auto& t : hart_threads) {
     t.join();
   }
+  replay_close();
   
   if (sig_mode) {
     FILE* sf = fopen(signaturefile,"w");
@@ -257,27 +583,66 @@ void hart_init(HartState& hs, uint16_t hartid) {
 
 void hw_init() {  
   mem_init();
+  mem_share_init();
   aclint_mtimer_init();
   aclint_mswi_init();
+  sbi_init();
   plic_init();
+  imsic_init();
+  aplic_init();
   uart_init();
   virtio_mmio_blk_init();
+  virtio_console_init();
+  virtio_9p_init();
+  virtio_pmem_init();
+  virtio_vsock_init();
+  virtio_balloon_init();
+  vhost_user_init();
+}
+
+// stops the device threads, for a fork server, only the devices it allows have any
+void hw_stop() {
+  uart_stop();
+  virtio_console_stop();
+  virtio_9p_stop();
+  virtio_pmem_stop();
 }
 
-void hw_perhart_update(HartState& hs) {
-  aclint_mtimer_chk(hs);
-  aclint_mswi_chk(hs);
+void hw_start() {
+  uart_start();
+  virtio_console_start();
+  virtio_9p_start();
+  virtio_pmem_start();
 }
 
+// the harts are only gone through when a timer fires, everything else notifies the hart it concerns
 void hw_update() {
+  aclint_mtimer_tick();
   uart_chk();
-  plic_chk();
+}
+
+bool harts_irq_pending() {
+  for (size_t i = 0; i < MACH_HART_COUNT; i++) {
+    // a hart stopped through the SBI only waits for an HSM start
+    if (std::atomic_ref<uint8_t>(hartlist[i].hsm_state).load(std::memory_order_relaxed) != SBI_HSM_STOPPED
+        && sched_irq_pending(hartlist[i])) return true;
+  }
+  return false;
 }
 
 void hw_uninit() {
-  mem_free();
+  // stop the devices first, as their threads may still access guest memory
   virtio_mmio_blk_uninit();
+  virtio_console_uninit();
+  virtio_9p_uninit();
+  virtio_pmem_uninit();
+  virtio_vsock_uninit();
+  virtio_balloon_uninit();
+  vhost_user_uninit();
   uart_uninit();
+  mem_share_uninit();
+  fork_server_uninit();
+  mem_free();
 }
 
 void sigint_handler(int signum){
@@ -299,10 +664,205 @@ void sigint_handler(int signum){
   */
 }
 
+void sigusr1_handler([[maybe_unused]] int signum){
+  snapshot_requested = true; // the main thread takes the snapshot
+}
+
+void sigusr2_handler([[maybe_unused]] int signum){
+  dump_requested = true; // the main thread forks the dump
+}
+
+// wakes the harts waiting in WFI on their own threads, so they see harts_paused or interrupted
+void harts_ring_all() {
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) hart_notify(hartlist[i]);
+}
+
+void harts_pause() {
+  harts_paused = true;
+  harts_ring_all();
+  if (sbi_enabled) sbi_wake_all(); // harts stopped through the SBI sleep until woken
+  if (sched_enabled) sched_wake_workers();
+  // harts that already stopped for good never park
+  while (harts_parked < hart_threads.size() && !interrupted) std::this_thread::yield();
+}
+
+void harts_resume() {
+  harts_paused = false;
+  harts_paused.notify_all();
+  while (harts_parked > 0) std::this_thread::yield();
+}
+
+// creates the hart threads, or the workers running the harts, they run once hart_start is set
+void harts_start() {
+  hart_start = false;
+  if (sched_deterministic) {
+    hart_threads.emplace_back(std::thread(hart_det_loop));
+    placement_pin_hart(hart_threads.back(), 0);
+  } else if (sched_enabled) {
+    sched_init();
+    for (uint16_t i = 0; i < sched_worker_count; i++) {
+      hart_threads.emplace_back(std::thread(hart_worker_loop, i));
+      placement_pin_hart(hart_threads.back(), i);
+    }
+  } else {
+    for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+      hart_threads.emplace_back(std::thread(hart_loop,std::ref(hartlist[i])) );
+      placement_pin_hart(hart_threads.back(), i);
+    }
+  }
+  placement_pin_main();
+}
+
+// called with the harts paused at the fork marker
+// only the main thread may be left when forking, so the harts and devices are stopped for good in the server
+// and started again in each clone, with mtime continuing from the marker
+bool serve_clones() {
+  std::vector<uint8_t> timer;
+  aclint_save(timer);
+  harts_exit = true;
+  harts_resume();
+  for (auto& t : hart_threads) {
+    t.join();
+  }
+  hart_threads.clear();
+  harts_exit = false;
+  fork_requested = false; // other harts may have reached the marker too
+  hw_stop();
+  
+  bool use_stdio = false;
+  if (!fork_server_run(use_stdio)) return false;
+  io_uninit();
+  io_init(skip_pty || use_stdio);
+  fork_server_reply(pty_name());
+  hw_start();
+  snap_reader in = {timer.data(), timer.data() + timer.size()};
+  aclint_restore(in);
+  harts_start();
+  hart_start = true;
+  return true;
+}
+
+void hart_park() {
+  harts_parked++;
+  harts_paused.wait(true);
+  harts_parked--;
+}
+
+// runs a hart on a worker for up to a quantum, returns false once the hart halts
+bool hart_quantum(uint16_t worker, HartState& hs) {
+  std::lock_guard<std::mutex> running(sched_hart_lock(hs.hartid));
+  for (uint32_t i = 0; i < SCHED_QUANTUM; i++) {
+    if (std::atomic_ref<uint8_t>(hs.hsm_state).load(std::memory_order_acquire) != SBI_HSM_STARTED) [[unlikely]] {
+      // stopped or suspended through the built-in SBI, it is queued again when started or woken up
+      sched_sleep(worker, hs, sbi_hart_wakeup);
+      return true;
+    }
+    if (!cycle(hs)) return false;
+    if (fork_server_enabled && (uint32_t)hs.inst == FORK_MARKER) [[unlikely]] {
+      fork_requested = true;
+      harts_paused = true;
+    }
+    if ((uint32_t)hs.inst == WFI_INST) [[unlikely]] {
+      // the main thread queues it again once an interrupt is pending
+      sched_sleep(worker, hs, sched_irq_pending);
+      return true;
+    }
+    if (harts_paused.load(std::memory_order_relaxed) || interrupted) [[unlikely]] break;
+  }
+  sched_requeue(worker, hs.hartid);
+  return true;
+}
+
+void hart_worker_loop(uint16_t worker) {
+  while (!hart_start) std::this_thread::yield(); // wait for hart_start signal
+  
+  while (!interrupted) {
+    int32_t hartid = sched_next(worker);
+    if (hartid >= 0) {
+      if (!hart_quantum(worker, hartlist[hartid])) break;
+    } else if (harts_paused) {
+      // no hart is on a worker while they are paused
+      hart_park();
+      if (harts_exit) return;
+    }
+  }
+  interrupted = true;
+}
+
+// runs a hart for up to a quantum in deterministic mode, starting at the virtual time of the round
+// returns false once the hart halts, idle is set if the hart ends up waiting for an interrupt or an HSM start
+bool hart_det_quantum(HartState& hs, uint64_t round_ns, bool& idle) {
+  idle = false;
+  for (uint32_t i = 0; i < SCHED_QUANTUM; i++) {
+    aclint_virtual_ns = round_ns + i * SCHED_DET_NS_PER_INST;
+    if (std::atomic_ref<uint8_t>(hs.hsm_state).load(std::memory_order_relaxed) != SBI_HSM_STARTED) [[unlikely]] {
+      if (!sbi_hart_wakeup(hs)) {
+        idle = true;
+        return true;
+      }
+    }
+    if (!cycle(hs)) return false;
+    if (fork_server_enabled && (uint32_t)hs.inst == FORK_MARKER) [[unlikely]] {
+      // the other harts finish the round first
+      fork_requested = true;
+      harts_paused = true;
+      return true;
+    }
+    // idle for the rest of the quantum
+    if ((uint32_t)hs.inst == WFI_INST) [[unlikely]] {
+      idle = true;
+      return true;
+    }
+  }
+  return true;
+}
+
+void hart_det_loop() {
+  while (!hart_start) std::this_thread::yield(); // wait for hart_start signal
+  
+  while (!interrupted) {
+    // the harts run side by side in virtual time, each round takes one quantum
+    uint64_t round_ns = aclint_virtual_ns;
+    bool idle = true;
+    for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+      bool hart_idle;
+      if (!hart_det_quantum(hartlist[i], round_ns, hart_idle)) {
+        interrupted = true;
+        return;
+      }
+      idle = idle && hart_idle;
+    }
+    aclint_virtual_ns = round_ns + SCHED_QUANTUM * SCHED_DET_NS_PER_INST;
+    if (replay_recording || replay_replaying) replay_round();
+    hw_update();
+    if (idle && aclint_idle_skip && !harts_irq_pending() && aclint_skip_to_deadline()) {
+      aclint_mtimer_tick();
+    }
+    if (harts_paused.load(std::memory_order_relaxed)) [[unlikely]] {
+      hart_park();
+      if (harts_exit) return;
+    }
+  }
+}
+
 void hart_loop(HartState& hs) {
   while (!hart_start) std::this_thread::yield(); // wait for hart_start signal
   
-  while (cycle(hs) && !interrupted) {
+  while (!interrupted) {
+    if (std::atomic_ref<uint8_t>(hs.hsm_state).load(std::memory_order_acquire) != SBI_HSM_STARTED) [[unlikely]] {
+      // stopped or suspended through the built-in SBI
+      sbi_hart_idle(hs);
+    } else if (!cycle(hs)) {
+      break;
+    } else if (fork_server_enabled && (uint32_t)hs.inst == FORK_MARKER) [[unlikely]] {
+      // stop right after the marker, every other hart is paused once the main thread sees the request
+      fork_requested = true;
+      harts_paused = true;
+    }
+    if (harts_paused.load(std::memory_order_relaxed)) [[unlikely]] {
+      hart_park();
+      if (harts_exit) return;
+    }
     //hw_update(hs);
     
     /*
@@ -1,27 +1,289 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cpu.h"
 #include "mem.h"
 #include "io.h"
 #include "constants.h"
+#include "fdt.h"
+#include "placement.h"
+#include "aplic.h"
 
 uint8_t *main_mem = nullptr;
 // variable length based on the number of harts
 uint64_t *reservations;
+uint16_t *reservation_owners;
 uint8_t dtb_buf[MAX_DTB_SIZE];
 
 std::mutex atomic_op_mtx;
 
+Ram_Bank ram_banks[MAX_RAM_BANKS];
+uint8_t ram_bank_count = 1;
+
+uint8_t mem_opts = 0;
+int main_mem_fd = -1;
+// size of the host pages backing RAM, and the length of the mapping of all banks, each rounded up to them
+uint64_t mem_page_size;
+uint64_t mem_map_len;
+
+// a size with an optional K, M or G suffix
+bool parse_mem_size(const char* str, char** end, uint64_t& size) {
+  size = strtoull(str, end, 0);
+  if (*end == str) return false;
+  switch (**end) {
+    case 'G': size <<= 10; [[fallthrough]];
+    case 'M': size <<= 10; [[fallthrough]];
+    case 'K': size <<= 10; (*end)++;
+  }
+  return size > 0;
+}
+
+bool mem_set_banks(const char* spec) {
+  char* pos;
+  uint64_t size;
+  if (!parse_mem_size(spec, &pos, size)) return false;
+  MACH_MEM_SIZE = size;
+  ram_banks[0] = {0x8000'0000, size, nullptr, 0, nullptr};
+  ram_bank_count = 1;
+  while (*pos == ',') {
+    if (ram_bank_count >= MAX_RAM_BANKS) return false;
+    if (!parse_mem_size(pos + 1, &pos, size) || *pos != '@') return false;
+    uint64_t base = strtoull(pos + 1, &pos, 0);
+    // banks sit between the devices and the pmem window, at page granularity
+    if (base < 0x8000'0000 || base % 4096 || size % 4096 || base + size > PMEM_BASE || base + size < base) return false;
+    for (uint8_t i = 0; i < ram_bank_count; i++) {
+      if (base < ram_banks[i].base + ram_banks[i].size && ram_banks[i].base < base + size) return false;
+    }
+    ram_banks[ram_bank_count++] = {base, size, nullptr, 0, nullptr};
+  }
+  return *pos == 0;
+}
+
+void mem_dirty_reset() {
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    uint64_t words = ((ram_banks[i].size >> DIRTY_PAGE_SHIFT) + 64) / 64;
+    if (!ram_banks[i].dirty) ram_banks[i].dirty = new uint64_t[words];
+    memset(ram_banks[i].dirty, 0, words * sizeof(uint64_t));
+  }
+}
+
+void mem_dirty_mark(uint64_t addr, uint64_t len) {
+  if (!len) return;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    uint64_t offset = addr - ram_banks[i].base;
+    if (!ram_banks[i].dirty || offset >= ram_banks[i].size) continue;
+    uint64_t last = std::min(offset + len, ram_banks[i].size) - 1;
+    for (uint64_t page = offset >> DIRTY_PAGE_SHIFT; page <= last >> DIRTY_PAGE_SHIFT; page++) {
+      mem_dirty_set(ram_banks[i].dirty, page);
+    }
+    return;
+  }
+}
+
+uint64_t mem_total_size() {
+  uint64_t total = 0;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    total += ram_banks[i].size;
+  }
+  return total;
+}
+
+bool mem_set_opts(const char* spec) {
+  std::string opts = spec;
+  size_t pos = 0;
+  while (pos <= opts.size()) {
+    size_t end = opts.find(',', pos);
+    if (end == std::string::npos) end = opts.size();
+    std::string opt = opts.substr(pos, end - pos);
+    if (opt == "nothp") mem_opts |= MEM_OPT_NOTHP;
+    else if (opt == "hugetlb") mem_opts |= MEM_OPT_HUGETLB;
+    else if (opt == "prefault") mem_opts |= MEM_OPT_PREFAULT;
+    else if (opt == "mlock") mem_opts |= MEM_OPT_MLOCK;
+    else return false;
+    pos = end + 1;
+  }
+  return true;
+}
+
+// default size of the hugetlbfs pool pages, from /proc/meminfo
+uint64_t hugetlb_page_size() {
+  FILE* meminfo = fopen("/proc/meminfo", "r");
+  if (!meminfo) return 2 << 20;
+  char line[128];
+  uint64_t size_kb = 2048;
+  while (fgets(line, sizeof(line), meminfo)) {
+    if (sscanf(line, "Hugepagesize: %lu kB", &size_kb) == 1) break;
+  }
+  fclose(meminfo);
+  return size_kb << 10;
+}
+
 void mem_init(){
-  main_mem = new uint8_t[MACH_MEM_SIZE] {0};
+  // anonymous pages are zero on first touch, so only RAM the guest uses costs host memory
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  mem_page_size = sysconf(_SC_PAGESIZE);
+  if (mem_opts & MEM_OPT_HUGETLB) {
+    // reserve the huge pages up front, so a short pool fails here instead of as a SIGBUS later
+    flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    mem_page_size = hugetlb_page_size();
+  }
+  // all banks live in one mapping, back to back
+  ram_banks[0] = {0x8000'0000, MACH_MEM_SIZE, nullptr, 0, nullptr};
+  mem_map_len = 0;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    ram_banks[i].offset = mem_map_len;
+    mem_map_len += (ram_banks[i].size + mem_page_size - 1) & ~(mem_page_size - 1);
+  }
+  if (mem_opts & MEM_OPT_MEMFD) {
+    // a shared file mapping, so processes mapping the same memfd see guest stores immediately
+    main_mem_fd = memfd_create("guest-ram", MFD_CLOEXEC | (mem_opts & MEM_OPT_HUGETLB ? MFD_HUGETLB : 0));
+    if (main_mem_fd < 0 || ftruncate(main_mem_fd, mem_map_len)) {
+      dbgerr_print("Could not create guest memory file");
+      dbgerr_endl();
+      exit(1);
+    }
+    flags = (flags & ~(MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB)) | MAP_SHARED;
+  }
+  main_mem = (uint8_t*)mmap(nullptr, mem_map_len, PROT_READ | PROT_WRITE, flags, main_mem_fd, 0);
+  if (main_mem == MAP_FAILED) {
+    dbgerr_print(mem_opts & MEM_OPT_HUGETLB ? "Could not allocate guest memory from huge pages" : "Could not allocate guest memory");
+    dbgerr_endl();
+    exit(1);
+  }
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    ram_banks[i].host = main_mem + ram_banks[i].offset;
+  }
+  // the memory policy only affects pages faulted in after it is set
+  if (!placement_bind_banks()) {
+    dbgerr_print("Could not bind guest memory to its host NUMA nodes");
+    dbgerr_endl();
+    exit(1);
+  }
+  // transparent huge pages cut host TLB misses, and must be asked for before RAM is populated
+  if (!(mem_opts & (MEM_OPT_NOTHP | MEM_OPT_HUGETLB))) madvise(main_mem, mem_map_len, MADV_HUGEPAGE);
+  if (mem_opts & (MEM_OPT_PREFAULT | MEM_OPT_MLOCK)) {
+    // fall back to touching every page on kernels without MADV_POPULATE_WRITE
+    if (madvise(main_mem, mem_map_len, MADV_POPULATE_WRITE)) {
+      for (uint64_t offset = 0; offset < mem_map_len; offset += mem_page_size) {
+        *(volatile uint8_t*)(main_mem + offset) = 0;
+      }
+    }
+  }
+  if ((mem_opts & MEM_OPT_MLOCK) && mlock(main_mem, mem_map_len)) {
+    dbgerr_print("Could not lock guest memory, check RLIMIT_MEMLOCK");
+    dbgerr_endl();
+    exit(1);
+  }
   reservations = new uint64_t[MACH_HART_COUNT] {0};
+  reservation_owners = new uint16_t[RESERVATION_BUCKETS] {0};
+}
+
+void mem_reserve(uint16_t hartid, uint64_t addr) {
+  uint64_t bucket = (addr >> 3) % RESERVATION_BUCKETS;
+  uint16_t& owner = reservation_owners[bucket];
+  if (owner != hartid && (reservations[owner] >> 3) % RESERVATION_BUCKETS == bucket) {
+    reservations[owner] = 0;
+  }
+  owner = hartid;
+  reservations[hartid] = addr;
 }
 
 void mem_free(){
-  delete[] main_mem;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    delete[] ram_banks[i].dirty;
+  }
+  munmap(main_mem, mem_map_len);
+  if (main_mem_fd >= 0) close(main_mem_fd);
   delete[] reservations;
+  delete[] reservation_owners;
+}
+
+void phy_mem_discard(uint64_t addr, uint64_t len) {
+  // locked RAM stays resident
+  if (mem_opts & MEM_OPT_MLOCK) return;
+  uint8_t* ptr = phy_mem_ptr(addr, len);
+  if (!ptr) return;
+  mem_dirty_mark(addr, len);
+  // only whole host pages inside the range can be dropped
+  uint64_t page = mem_page_size;
+  uint64_t start = ((uint64_t)ptr + page - 1) & ~(page - 1);
+  uint64_t end = ((uint64_t)ptr + len) & ~(page - 1);
+  if (end <= start) return;
+  if (mem_file_mapped) {
+    // dropping pages mapped from a file would bring back its contents, fresh anonymous ones read as zero
+    mmap((void*)start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return;
+  }
+  // dropping a shared mapping would leave the pages in the memfd, so punch them out of the file instead
+  madvise((void*)start, end - start, main_mem_fd >= 0 ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+bool mem_file_mapped = false;
+
+bool mem_can_map_files() {
+  return main_mem_fd < 0 && !(mem_opts & (MEM_OPT_HUGETLB | MEM_OPT_MLOCK | MEM_OPT_PREFAULT));
+}
+
+bool mem_pread(int fd, uint8_t* data, size_t len, uint64_t offset) {
+  while (len) {
+    ssize_t n_read = pread(fd, data, len, offset);
+    if (n_read <= 0) return false;
+    data += n_read;
+    len -= n_read;
+    offset += n_read;
+  }
+  return true;
+}
+
+size_t mem_load_file(int fd, uint64_t file_offset, uint64_t addr, uint64_t len) {
+  struct stat st;
+  if (fstat(fd, &st) || (uint64_t)st.st_size < file_offset) return 0;
+  len = std::min<uint64_t>(len, st.st_size - file_offset);
+  uint8_t* ptr = phy_mem_ptr(addr, len);
+  if (!ptr || !len) return 0;
+  // the part that is mapped, as offsets into the range, needs the file offset and the host address at the same offset in a page
+  uint64_t page = mem_page_size;
+  uint64_t start = 0, end = 0;
+  if (S_ISREG(st.st_mode) && mem_can_map_files() && ((uint64_t)ptr - file_offset) % page == 0) {
+    start = (page - (uint64_t)ptr % page) % page;
+    end = (((uint64_t)ptr + len) & ~(page - 1)) - (uint64_t)ptr;
+    if (end <= start) start = end = 0;
+  }
+  if (end > start) {
+    if (mmap(ptr + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_offset + start) != ptr + start) return 0;
+    mem_file_mapped = true;
+    // the new mapping does not have the NUMA policy of the bank
+    if (!placement_bind_banks()) return 0;
+  }
+  if (!mem_pread(fd, ptr, start, file_offset) || !mem_pread(fd, ptr + end, len - end, file_offset + end)) return 0;
+  return len;
+}
+
+uint8_t* phy_mem_ptr(uint64_t addr, uint64_t len) {
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    uint64_t offset = addr - ram_banks[i].base;
+    if (offset < ram_banks[i].size) {
+      if (len > ram_banks[i].size - offset) return nullptr;
+      return ram_banks[i].host + offset;
+    }
+  }
+  return nullptr;
+}
+
+uint64_t phy_mem_addr(const void* host) {
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    uint64_t offset = (const uint8_t*)host - ram_banks[i].host;
+    if (offset < ram_banks[i].size) return ram_banks[i].base + offset;
+  }
+  return 0;
 }
 
 // output format:
@@ -339,14 +601,43 @@ void dtb_w (uint64_t offset, void* dataptr, uint8_t len) {
 void* null_r ([[maybe_unused]] uint64_t offset, [[maybe_unused]] uint8_t len) { return &ZERO;}
 void null_w ([[maybe_unused]] uint64_t offset, [[maybe_unused]] void* dataptr, [[maybe_unused]] uint8_t len) {return;}
 
-void dump_mem(){
-  FILE* f = fopen("mem_dump","wb");
-  if (!fwrite(main_mem,1,MACH_MEM_SIZE,f)){
-     perror("ERRNO");
-     dbg_print("Error dumping memory");
-     dbg_endl();
+// banks are written back to back, in the order they were given
+bool mem_fixup_dtb() {
+  fdt_tree tree;
+  if (!fdt_parse(dtb_buf, MAX_DTB_SIZE, tree)) return false;
+  uint32_t addr_cells = fdt_get_u32(tree.root, "#address-cells", 2);
+  uint32_t size_cells = fdt_get_u32(tree.root, "#size-cells", 1);
+  // the new nodes go where the first old memory node was
+  std::vector<fdt_node>& nodes = tree.root.children;
+  size_t insert_at = nodes.size();
+  for (size_t i = nodes.size(); i-- > 0;) {
+    fdt_prop* type = fdt_get_prop(nodes[i], "device_type");
+    if (nodes[i].name == "memory" || nodes[i].name.starts_with("memory@") || (type && type->value == fdt_string("memory"))) {
+      nodes.erase(nodes.begin() + i);
+      insert_at = i;
+    }
+  }
+  std::vector<fdt_node> memory_nodes;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "memory@%lx", ram_banks[i].base);
+    fdt_node node;
+    node.name = name;
+    fdt_set_prop(node, "device_type", fdt_string("memory"));
+    std::vector<uint8_t> reg;
+    if (!fdt_append_num(reg, ram_banks[i].base, addr_cells) || !fdt_append_num(reg, ram_banks[i].size, size_cells)) {
+      dbgerr_print("RAM bank does not fit in the cells of the dtb:");
+      dbgerr_print(name);
+      dbgerr_endl();
+      return false;
+    }
+    fdt_set_prop(node, "reg", reg);
+    memory_nodes.push_back(std::move(node));
   }
-  fclose(f);
+  nodes.insert(nodes.begin() + insert_at, memory_nodes.begin(), memory_nodes.end());
+  placement_fixup_dtb(tree.root);
+  if (!aia_fixup_dtb(tree.root)) return false;
+  return fdt_write(tree, dtb_buf, MAX_DTB_SIZE) != 0;
 }
 
 void tlb_clear(TLBStruct *tlb) {
@@ -412,7 +703,7 @@ void tlb_add(TLBStruct &tlb, TLBEntry tlb_entry) {
 }
 
 template <> uint8_t mem_fetch<uint8_t>(HartState& hs, uint64_t addr){
-  if (addr < 0x1000 || addr >= (0x8000'0000 + MACH_MEM_SIZE)) {
+  if (!phy_mem_valid(addr)) {
     hs.mem_status = true;
     return 0x0;
   }
@@ -436,7 +727,7 @@ template <> uint8_t mem_fetch<uint8_t>(HartState& hs, uint64_t addr){
 }
 
 template <> void mem_store<uint8_t>(HartState& hs, uint64_t addr, uint8_t data){
-  if (addr < 0x1000 || addr >= (0x8000'0000 + MACH_MEM_SIZE)) {
+  if (!phy_mem_valid(addr)) {
     hs.mem_status = true;
     return;
   }
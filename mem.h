@@ -1,16 +1,89 @@
 #pragma once
 #include <cstdint>
 #include <mutex>
+#include <atomic>
 
 #include "cpu.h"
 #include "constants.h"
 
+// guest RAM is made of banks, each one contiguous range of guest physical memory
+// bank 0 is MACH_MEM_SIZE bytes at 0x8000'0000, and main_mem points at its host memory
+#define MAX_RAM_BANKS 8
+struct Ram_Bank {
+  uint64_t base; // guest physical address
+  uint64_t size;
+  uint8_t* host; // host memory backing the bank
+  uint64_t offset; // offset of the bank in the host mapping, and in the memfd with MEM_OPT_MEMFD
+  uint64_t* dirty; // one bit per DIRTY_PAGE_SIZE page written since the last mem_dirty_reset, null when not tracking
+};
+extern Ram_Bank ram_banks[MAX_RAM_BANKS];
+extern uint8_t ram_bank_count;
+// spec is "<size>[,<size>@<base>...]", sizes take a K, M or G suffix
+// the first size is bank 0, the others add banks at the given guest physical addresses
+bool mem_set_banks(const char* spec);
+// sum of all bank sizes
+uint64_t mem_total_size();
+
+// dirty page tracking, for incremental snapshots
+// hart stores mark pages in phy_mem_store, other writers to guest RAM call mem_dirty_mark
+#define DIRTY_PAGE_SHIFT 12
+#define DIRTY_PAGE_SIZE (1ULL << DIRTY_PAGE_SHIFT)
+// starts tracking, or clears the dirty bits if it is already on
+void mem_dirty_reset();
+// marks guest physical [addr, addr+len) dirty, addresses outside RAM are ignored
+void mem_dirty_mark(uint64_t addr, uint64_t len);
+inline bool mem_dirty_tracking() {
+  return ram_banks[0].dirty;
+}
+inline void mem_dirty_set(uint64_t* dirty, uint64_t page) {
+  // most stores hit pages that are already dirty, so the atomic update is skipped for them
+  uint64_t bit = 1ULL << (page % 64);
+  std::atomic_ref<uint64_t> word(dirty[page / 64]);
+  if (!(word.load(std::memory_order_relaxed) & bit)) word.fetch_or(bit, std::memory_order_relaxed);
+}
+
 extern uint8_t *main_mem;
 extern uint64_t *reservations;
+// LR reservations are looked up by address through buckets, each held by the hart that made the last LR into it
+#define RESERVATION_BUCKETS 4096
 extern uint8_t dtb_buf[MAX_DTB_SIZE];
 extern std::mutex atomic_op_mtx;
 void mem_init();
 void mem_free();
+// makes the reservation of an LR, taking away any other reservation in its bucket
+// those belong to the same address, or fail spuriously on their SC; called with atomic_op_mtx held
+void mem_reserve(uint16_t hartid, uint64_t addr);
+
+// guest RAM backing options, set from the command line before mem_init
+// by default RAM is populated on first touch, and uses transparent huge pages when the host allows them
+#define MEM_OPT_NOTHP 0b0001 // do not ask for transparent huge pages
+#define MEM_OPT_HUGETLB 0b0010 // use explicit huge pages from the hugetlbfs pool
+#define MEM_OPT_PREFAULT 0b0100 // populate all of RAM at startup
+#define MEM_OPT_MLOCK 0b1000 // populate and lock all of RAM in host memory
+#define MEM_OPT_MEMFD 0b10000 // back RAM with a memfd that other processes can map
+extern uint8_t mem_opts;
+// the memfd backing RAM with MEM_OPT_MEMFD, otherwise -1
+extern int main_mem_fd;
+// size of the host pages backing RAM, each bank starts on one
+extern uint64_t mem_page_size;
+// spec is a comma separated list of nothp, hugetlb, prefault and mlock
+bool mem_set_opts(const char* spec);
+// set once part of RAM is a private mapping of a file, where dropping a page brings back the file contents
+extern bool mem_file_mapped;
+// whether RAM can take private file mappings in place of its pages:
+// it has to be anonymous and in normal pages, and locked or prefaulted RAM stays as it is
+bool mem_can_map_files();
+// loads up to len bytes of a file into RAM at addr, returns the number of bytes loaded, 0 if they do not fit in RAM
+// whole pages are mapped copy-on-write from the file where possible, so they share the host page cache, the rest is copied
+size_t mem_load_file(int fd, uint64_t file_offset, uint64_t addr, uint64_t len);
+
+// host pointer to guest RAM [addr, addr+len), or nullptr if the range is not entirely in RAM
+// used by devices doing DMA
+uint8_t* phy_mem_ptr(uint64_t addr, uint64_t len);
+// guest physical address of a host pointer into RAM, or 0 if it does not point into RAM
+uint64_t phy_mem_addr(const void* host);
+// give the host memory backing guest RAM [addr, addr+len) back, the guest reads zeros from it afterwards
+void phy_mem_discard(uint64_t addr, uint64_t len);
 
 // direcly check PMP accesses from raw PMP registers
 uint16_t chk_pmp(HartState& hs, uint64_t addr);
@@ -39,11 +112,30 @@ struct Memmap_Entry {
 #include "uart.h"
 #include "plic.h"
 #include "virtio_mmio_blk.h"
+#include "virtio_console.h"
+#include "virtio_9p.h"
+#include "virtio_pmem.h"
+#include "virtio_vsock.h"
+#include "virtio_balloon.h"
+#include "vhost_user.h"
+#include "imsic.h"
+#include "aplic.h"
 
 // physical memory map:
+// 0x40'0000'0000: virtio pmem window
 // 0x8000'0000: RAM
+// 0x2800'0000: IMSIC S-level interrupt files
+// 0x2400'0000: IMSIC M-level interrupt files
+// 0x1000'8000: vhost-user device 1
+// 0x1000'7000: vhost-user device 0
+// 0x1000'6000: virtio mmio balloon
+// 0x1000'5000: virtio mmio vsock
+// 0x1000'4000: virtio mmio pmem
+// 0x1000'3000: virtio mmio 9p host directory share
+// 0x1000'2000: virtio mmio console
 // 0x1000'1000: virtio mmio disk
 // 0x1000'0000: NS16550A UART
+// 0xD00'0000: APLIC
 // 0xC00'0000: PLIC
 // 0x200'4000: ACLINT MTIMER
 // 0x200'0000: ACLINT MSWI
@@ -57,9 +149,20 @@ void dtb_w (uint64_t offset, void* dataptr, uint8_t len);
 void* null_r ([[maybe_unused]] uint64_t offset, [[maybe_unused]] uint8_t len);
 void null_w ([[maybe_unused]] uint64_t offset, [[maybe_unused]] void* dataptr, [[maybe_unused]] uint8_t len);
 static const Memmap_Entry mem_map[] = {
+  {PMEM_BASE,PMEM_MAX_SIZE,pmem_window_r,pmem_window_w},
+  {IMSIC_S_BASE,IMSIC_REGION_SIZE,imsic_s_r,imsic_s_w},
+  {IMSIC_M_BASE,IMSIC_REGION_SIZE,imsic_m_r,imsic_m_w},
+  {0x1000'8000,0x1000,vhost_user1_r,vhost_user1_w},
+  {0x1000'7000,0x1000,vhost_user0_r,vhost_user0_w},
+  {0x1000'6000,0x1000,virtio_balloon_r,virtio_balloon_w},
+  {0x1000'5000,0x1000,virtio_vsock_r,virtio_vsock_w},
+  {0x1000'4000,0x1000,virtio_pmem_r,virtio_pmem_w},
+  {0x1000'3000,0x1000,virtio_9p_r,virtio_9p_w},
+  {0x1000'2000,0x1000,virtio_console_r,virtio_console_w},
   {0x1000'1000,0x1000,virtio_mmio_blk_r,virtio_mmio_blk_w}, // TODO: virtio mmio disk
   {0x1000'0000,16,uart_r,uart_w},
-  {0xC00'0000,0x400'0000,plic_r,plic_w},
+  {APLIC_BASE,APLIC_SIZE,aplic_r,aplic_w},
+  {0xC00'0000,0x100'0000,plic_r,plic_w},
   {0x200'4000,0x8000,aclint_mtimer_r,aclint_mtimer_w},
   {0x200'0000,0x4000,aclint_mswi_r,aclint_mswi_w},
   {0x1100,MAX_DTB_SIZE,dtb_r,dtb_w}
@@ -74,7 +177,8 @@ static const uint8_t boot_rom_content[BOOT_ROM_LEN] = {
   0x67, 0x00, 0x04, 0x00  // jalr x0, x8, 0x0
 };
 
-void dump_mem();
+// replaces the memory nodes of the DTB in dtb_buf with the RAM banks, returns false if it is not a valid DTB
+bool mem_fixup_dtb();
 
 // TLB handling functions
 void tlb_clear(TLBStruct *tlb);
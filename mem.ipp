@@ -10,15 +10,29 @@
 // when mem functions return, mem_status indicates if an access fault has occured
 
 
+// true if addr is RAM, the pmem window, or in the device region below RAM
+inline bool phy_mem_valid(uint64_t addr) {
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    if (addr - ram_banks[i].base < ram_banks[i].size) return true;
+  }
+  return (0x1000 <= addr && addr < 0x8000'0000) || (addr - PMEM_BASE < pmem_size);
+}
+
+// each RAM bank and the pmem window are checked with a single unsigned compare before falling back to the memory map
 template <typename T> T phy_mem_fetch(uint64_t addr){
-  if (addr >= 0x8000'0000) [[likely]] {
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    if (addr - ram_banks[i].base < ram_banks[i].size) [[likely]] {
 #ifdef MEM_TRACE
-    dbg_print("phy_mem_fetch accessed ");
-    dbg_print(addr);
-    dbg_endl();
+      dbg_print("phy_mem_fetch accessed ");
+      dbg_print(addr);
+      dbg_endl();
 #endif // MEM_TRACE
-    void* dptr = main_mem + addr - 0x8000'0000;
-    return *reinterpret_cast<T*>(dptr);
+      void* dptr = ram_banks[i].host + addr - ram_banks[i].base;
+      return *reinterpret_cast<T*>(dptr);
+    }
+  }
+  if (addr - PMEM_BASE < pmem_size) {
+    return *reinterpret_cast<T*>(pmem_mem + addr - PMEM_BASE);
   }
   for (int8_t i = mem_entries - 1; i >= 0; i--) {
     int64_t offset = addr - mem_map[i].base;
@@ -34,9 +48,16 @@ template <typename T> T phy_mem_fetch(uint64_t addr){
 }
 
 template <typename T> void phy_mem_store(uint64_t addr, T data){
-  if (addr >= 0x8000'0000) [[likely]] {
-    void* dptr = main_mem + addr - 0x8000'0000;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    uint64_t offset = addr - ram_banks[i].base;
+    if (offset >= ram_banks[i].size) continue;
+    void* dptr = ram_banks[i].host + offset;
     *reinterpret_cast<T*>(dptr) = data;
+    if (ram_banks[i].dirty) [[unlikely]] {
+      // a misaligned store may spill into the next page
+      mem_dirty_set(ram_banks[i].dirty, offset >> DIRTY_PAGE_SHIFT);
+      mem_dirty_set(ram_banks[i].dirty, (offset + sizeof(T) - 1) >> DIRTY_PAGE_SHIFT);
+    }
 #ifdef MEM_TRACE
     dbg_print("phy_mem_store accessed ");
     dbg_print(addr);
@@ -44,6 +65,10 @@ template <typename T> void phy_mem_store(uint64_t addr, T data){
 #endif // MEM_TRACE
     return;
   }
+  if (addr - PMEM_BASE < pmem_size) {
+    if (!pmem_readonly) *reinterpret_cast<T*>(pmem_mem + addr - PMEM_BASE) = data;
+    return;
+  }
   for (int8_t i = 0; i < mem_entries; i++) {
     int64_t offset = addr - mem_map[i].base;
     if (0 <= offset && offset < mem_map[i].size) {
@@ -58,7 +83,7 @@ template <typename T> void phy_mem_store(uint64_t addr, T data){
 }
 
 template <typename T> T mem_fetch(HartState& hs, uint64_t addr){
-  if (addr < 0x1000 || addr >= (0x8000'0000 + MACH_MEM_SIZE)) {
+  if (!phy_mem_valid(addr)) {
     hs.mem_status = true;
     return 0;
   }
@@ -85,7 +110,7 @@ template <typename T> T mem_fetch(HartState& hs, uint64_t addr){
   return phy_mem_fetch<T>(addr);
 }
 template <typename T> void mem_store(HartState& hs, uint64_t addr, T data){
-  if (addr < 0x1000 || addr >= (0x8000'0000 + MACH_MEM_SIZE)) {
+  if (!phy_mem_valid(addr)) {
     hs.mem_status = true;
     return;
   }
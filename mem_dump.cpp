@@ -0,0 +1,292 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "constants.h"
+#include "mem.h"
+#include "io.h"
+#include "mem_dump.h"
+
+#define DUMP_MAGIC "RVEMUDMP"
+#define DUMP_VERSION 1
+// the unit of work of the dump threads, and of compression
+#define DUMP_CHUNK (1ULL << 20)
+// the granularity of holes in a raw dump
+#define DUMP_PAGE 4096
+
+struct dump_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t bank_count;
+  uint64_t chunk_size;
+  uint64_t bank_base[MAX_RAM_BANKS];
+  uint64_t bank_size[MAX_RAM_BANKS];
+};
+
+// the table after the header has one entry per chunk, in the order of the banks
+// a chunk that is all zero has a length of 0
+struct dump_chunk {
+  uint64_t offset;
+  uint64_t len;
+};
+
+bool dump_mem_compressed = false;
+pid_t dump_pid = -1;
+
+bool mem_is_zero(const uint8_t* ptr, size_t len) {
+  const uint64_t* words = (const uint64_t*)ptr;
+  size_t count = len / sizeof(uint64_t);
+  size_t i = 0;
+  // no early exit within a line, so each one is a few vector ORs
+  for (; i + 8 <= count; i += 8) {
+    uint64_t any = 0;
+    for (size_t j = 0; j < 8; j++) {
+      any |= words[i + j];
+    }
+    if (any) return false;
+  }
+  for (; i < count; i++) {
+    if (words[i]) return false;
+  }
+  for (size_t k = count * sizeof(uint64_t); k < len; k++) {
+    if (ptr[k]) return false;
+  }
+  return true;
+}
+
+// a chunk of RAM and where it goes in a raw dump
+struct dump_job {
+  const uint8_t* host; // nullptr when expanding a dump
+  uint64_t len;
+  uint64_t raw_offset;
+};
+
+std::vector<dump_job> dump_jobs(uint32_t bank_count, const uint64_t* bank_size, const Ram_Bank* banks) {
+  std::vector<dump_job> jobs;
+  uint64_t raw_offset = 0;
+  for (uint32_t i = 0; i < bank_count; i++) {
+    for (uint64_t offset = 0; offset < bank_size[i]; offset += DUMP_CHUNK) {
+      jobs.push_back({banks ? banks[i].host + offset : nullptr, std::min<uint64_t>(DUMP_CHUNK, bank_size[i] - offset), raw_offset + offset});
+    }
+    raw_offset += bank_size[i];
+  }
+  return jobs;
+}
+
+// runs work(job index, thread index) for every job, on as many threads as the host has CPUs
+template <typename F>
+bool dump_parallel(size_t job_count, size_t thread_count, F work) {
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> ok = true;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_count; t++) {
+    threads.emplace_back([&, t] {
+      for (size_t i = next++; i < job_count && ok; i = next++) {
+        if (!work(i, t)) ok = false;
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return ok;
+}
+
+size_t dump_thread_count(size_t job_count) {
+  return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(job_count, 1));
+}
+
+bool dump_pwrite(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+  while (len) {
+    ssize_t written = pwrite(fd, data, len, offset);
+    if (written <= 0) return false;
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool dump_pread(int fd, uint8_t* data, size_t len, uint64_t offset) {
+  while (len) {
+    ssize_t n_read = pread(fd, data, len, offset);
+    if (n_read <= 0) return false;
+    data += n_read;
+    len -= n_read;
+    offset += n_read;
+  }
+  return true;
+}
+
+// writes the runs of non-zero pages of a chunk
+bool dump_raw_chunk(int fd, const dump_job& job) {
+  uint64_t run_start = 0;
+  bool in_run = false;
+  for (uint64_t offset = 0; offset <= job.len; offset += DUMP_PAGE) {
+    bool skip = offset >= job.len || mem_is_zero(job.host + offset, std::min<uint64_t>(DUMP_PAGE, job.len - offset));
+    if (!skip && !in_run) {
+      run_start = offset;
+      in_run = true;
+    } else if (skip && in_run) {
+      uint64_t end = std::min(offset, job.len);
+      if (!dump_pwrite(fd, job.host + run_start, end - run_start, job.raw_offset + run_start)) return false;
+      in_run = false;
+    }
+  }
+  return true;
+}
+
+bool dump_compressed(int fd, std::vector<dump_job>& jobs) {
+  dump_header header = {};
+  memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+  header.version = DUMP_VERSION;
+  header.bank_count = ram_bank_count;
+  header.chunk_size = DUMP_CHUNK;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    header.bank_base[i] = ram_banks[i].base;
+    header.bank_size[i] = ram_banks[i].size;
+  }
+  std::vector<dump_chunk> table(jobs.size());
+  // chunks are appended in whatever order the threads finish them
+  std::atomic<uint64_t> data_end = sizeof(header) + table.size() * sizeof(dump_chunk);
+  size_t thread_count = dump_thread_count(jobs.size());
+  std::vector<std::vector<uint8_t>> buffers(thread_count, std::vector<uint8_t>(compressBound(DUMP_CHUNK)));
+  bool ok = dump_parallel(jobs.size(), thread_count, [&](size_t i, size_t t) {
+    const dump_job& job = jobs[i];
+    if (mem_is_zero(job.host, job.len)) {
+      table[i] = {0, 0};
+      return true;
+    }
+    uLongf len = buffers[t].size();
+    if (compress2(buffers[t].data(), &len, job.host, job.len, Z_BEST_SPEED) != Z_OK) return false;
+    table[i] = {data_end.fetch_add(len), len};
+    return dump_pwrite(fd, buffers[t].data(), len, table[i].offset);
+  });
+  ok = ok && dump_pwrite(fd, (const uint8_t*)&header, sizeof(header), 0);
+  ok = ok && dump_pwrite(fd, (const uint8_t*)table.data(), table.size() * sizeof(dump_chunk), sizeof(header));
+  return ok;
+}
+
+bool dump_mem_to(const char* path, bool compressed) {
+  // an older dump at the same path is only replaced by a complete one
+  std::string tmp_path = std::string(path) + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  uint64_t bank_size[MAX_RAM_BANKS];
+  uint64_t raw_len = 0;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    bank_size[i] = ram_banks[i].size;
+    raw_len += ram_banks[i].size;
+  }
+  std::vector<dump_job> jobs = dump_jobs(ram_bank_count, bank_size, ram_banks);
+  bool ok;
+  if (compressed) {
+    ok = dump_compressed(fd, jobs);
+  } else {
+    ok = dump_parallel(jobs.size(), dump_thread_count(jobs.size()), [&](size_t i, size_t) {
+      return dump_raw_chunk(fd, jobs[i]);
+    });
+    ok = ok && !ftruncate(fd, raw_len);
+  }
+  close(fd);
+  ok = ok && !rename(tmp_path.c_str(), path);
+  if (!ok) unlink(tmp_path.c_str());
+  return ok;
+}
+
+void dump_mem() {
+  const char* path = dump_mem_compressed ? "mem_dump.z" : "mem_dump";
+  if (!dump_mem_to(path, dump_mem_compressed)) {
+    perror("ERRNO");
+    dbg_print("Error dumping memory");
+    dbg_endl();
+  }
+}
+
+bool dump_mem_live() {
+  if (dump_pid > 0) return false; // one at a time
+  if (main_mem_fd >= 0) {
+    // RAM in a memfd is shared with the child instead of copied on write, so it is written here while the harts stay paused
+    bool ok = dump_mem_to(dump_mem_compressed ? "mem_dump.z" : "mem_dump", dump_mem_compressed);
+    dbgerr_print(ok ? "Memory dump written" : "Could not write memory dump");
+    dbgerr_endl();
+    return true;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // only this thread exists in the child, and the copy-on-write RAM stays as it was at the fork
+    _exit(dump_mem_to(dump_mem_compressed ? "mem_dump.z" : "mem_dump", dump_mem_compressed) ? 0 : 1);
+  }
+  if (pid < 0) return false;
+  dump_pid = pid;
+  return true;
+}
+
+void dump_mem_reap() {
+  if (dump_pid < 0) return;
+  int status;
+  pid_t ret = waitpid(dump_pid, &status, WNOHANG);
+  if (ret == 0) return;
+  dump_pid = -1;
+  if (ret < 0) return; // a fork server clone inherits the pid of a child that is not its own
+  dbgerr_print(WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "Memory dump written" : "Could not write memory dump");
+  dbgerr_endl();
+}
+
+bool dump_mem_expand(const char* in_path, const char* out_path) {
+  int in_fd = open(in_path, O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) return false;
+  dump_header header;
+  struct stat st;
+  bool ok = !fstat(in_fd, &st) && dump_pread(in_fd, (uint8_t*)&header, sizeof(header), 0);
+  ok = ok && !memcmp(header.magic, DUMP_MAGIC, sizeof(header.magic)) && header.version == DUMP_VERSION;
+  ok = ok && header.bank_count <= MAX_RAM_BANKS && header.chunk_size == DUMP_CHUNK;
+  // every chunk of the banks has an entry in the table, so the bank sizes cannot claim more than the file holds
+  uint64_t table_len = 0;
+  for (uint32_t i = 0; ok && i < header.bank_count; i++) {
+    table_len += (header.bank_size[i] / DUMP_CHUNK + (header.bank_size[i] % DUMP_CHUNK != 0)) * sizeof(dump_chunk);
+    ok = table_len <= (uint64_t)st.st_size - sizeof(header);
+  }
+  int out_fd = ok ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+  ok = out_fd >= 0;
+  std::vector<dump_job> jobs;
+  std::vector<dump_chunk> table;
+  uint64_t raw_len = 0;
+  if (ok) {
+    jobs = dump_jobs(header.bank_count, header.bank_size, nullptr);
+    table.resize(jobs.size());
+    ok = dump_pread(in_fd, (uint8_t*)table.data(), table.size() * sizeof(dump_chunk), sizeof(header));
+    for (uint32_t i = 0; i < header.bank_count; i++) {
+      raw_len += header.bank_size[i];
+    }
+  }
+  size_t thread_count = dump_thread_count(jobs.size());
+  std::vector<std::vector<uint8_t>> in_buffers(thread_count), out_buffers(thread_count, std::vector<uint8_t>(DUMP_CHUNK));
+  ok = ok && dump_parallel(jobs.size(), thread_count, [&](size_t i, size_t t) {
+    if (!table[i].len) return true; // left as a hole
+    if (table[i].len > compressBound(DUMP_CHUNK)) return false;
+    in_buffers[t].resize(table[i].len);
+    if (!dump_pread(in_fd, in_buffers[t].data(), table[i].len, table[i].offset)) return false;
+    uLongf len = jobs[i].len;
+    if (uncompress(out_buffers[t].data(), &len, in_buffers[t].data(), table[i].len) != Z_OK || len != jobs[i].len) return false;
+    // the zero pages within a chunk become holes too
+    return dump_raw_chunk(out_fd, {out_buffers[t].data(), len, jobs[i].raw_offset});
+  });
+  ok = ok && !ftruncate(out_fd, raw_len);
+  if (out_fd >= 0) close(out_fd);
+  close(in_fd);
+  return ok;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// memory dumps, written by several threads at once
+// a raw dump is the RAM banks back to back, with pages that are all zero left as holes in the file
+// a compressed dump is a header, a table with one entry per chunk of RAM and the deflated chunks,
+// with chunks that are all zero left out
+
+// true if the bytes are all zero, checked a cache line at a time so the compiler can vectorise it
+bool mem_is_zero(const uint8_t* ptr, size_t len);
+
+extern bool dump_mem_compressed;
+
+// writes "mem_dump", or "mem_dump.z" if dump_mem_compressed is set
+void dump_mem();
+bool dump_mem_to(const char* path, bool compressed);
+// forks and writes the dump from the child, so the guest only stops for the fork
+// the child is reaped by dump_mem_reap; returns false if the fork failed
+// RAM in a memfd (-R, -U) is not copied by the fork, so then the dump is written before returning
+bool dump_mem_live();
+void dump_mem_reap();
+// turns a compressed dump into a raw one
+bool dump_mem_expand(const char* in_path, const char* out_path);
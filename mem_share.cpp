@@ -0,0 +1,85 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <thread>
+#include <string>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "mem.h"
+#include "mem_share.h"
+
+std::string mem_share_path;
+int mem_share_listen_fd = -1;
+std::thread mem_share_thread;
+
+bool mem_share_set_socket(const char* path) {
+  mem_share_path = path;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (mem_share_path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, mem_share_path.c_str());
+  unlink(addr.sun_path);
+  mem_share_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (mem_share_listen_fd < 0) return false;
+  if (bind(mem_share_listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(mem_share_listen_fd, 4)) {
+    close(mem_share_listen_fd);
+    mem_share_listen_fd = -1;
+    return false;
+  }
+  mem_opts |= MEM_OPT_MEMFD;
+  return true;
+}
+
+void mem_share_init() {
+  if (mem_share_listen_fd < 0) return;
+  mem_share_thread = std::thread(mem_share_loop);
+}
+
+void mem_share_uninit() {
+  if (mem_share_listen_fd < 0) return;
+  // wakes up the blocked accept
+  shutdown(mem_share_listen_fd, SHUT_RDWR);
+  mem_share_thread.join();
+  close(mem_share_listen_fd);
+  unlink(mem_share_path.c_str());
+}
+
+void mem_share_send(int conn_fd) {
+  // one line per RAM bank
+  char desc[64 * MAX_RAM_BANKS];
+  size_t desc_len = 0;
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    desc_len += snprintf(desc + desc_len, sizeof(desc) - desc_len, "ram 0x%lx 0x%lx 0x%lx\n",
+                         ram_banks[i].base, ram_banks[i].size, ram_banks[i].offset);
+  }
+  iovec iov = {desc, desc_len};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &main_mem_fd, sizeof(int));
+  sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+}
+
+void mem_share_loop() {
+  while (true) {
+    int conn_fd = accept4(mem_share_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break; // the listening socket was shut down
+    }
+    mem_share_send(conn_fd);
+    close(conn_fd);
+  }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// hands the memfd backing guest RAM to other processes over a UNIX socket
+// every connection gets one message carrying the fd as SCM_RIGHTS, and a text description of it,
+// one line per RAM range: "ram <guest physical base> <size> <file offset>\n", numbers in hex
+// the socket is closed after that, and the receiver maps the fd with MAP_SHARED
+
+// enables memfd backed RAM, must be called before mem_init
+bool mem_share_set_socket(const char* path);
+
+void mem_share_init();
+void mem_share_uninit();
+
+void mem_share_loop();
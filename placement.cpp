@@ -0,0 +1,174 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "constants.h"
+#include "mem.h"
+#include "fdt.h"
+#include "placement.h"
+
+// from linux/mempolicy.h, which is not always installed
+#define MPOL_BIND 2
+
+struct numa_node {
+  std::vector<uint32_t> harts;
+  std::vector<uint32_t> banks;
+  int32_t host_node; // -1 if the banks are not bound
+};
+
+std::vector<uint32_t> hart_cpus, io_cpus, main_cpus;
+std::vector<numa_node> numa_nodes;
+cpu_set_t startup_cpus;
+
+// parses "0-3,8" up to the end of the string or the first character in stops, and returns where it stopped
+const char* parse_id_list(const char* str, const char* stops, uint32_t limit, std::vector<uint32_t>& ids) {
+  ids.clear();
+  while (true) {
+    char* end;
+    uint32_t first = strtoul(str, &end, 10);
+    if (end == str) return nullptr;
+    uint32_t last = first;
+    if (*end == '-') {
+      str = end + 1;
+      last = strtoul(str, &end, 10);
+      if (end == str) return nullptr;
+    }
+    if (first > last || last >= limit) return nullptr;
+    for (uint32_t id = first; id <= last; id++) {
+      ids.push_back(id);
+    }
+    if (*end != ',') return (*end == 0 || strchr(stops, *end)) ? end : nullptr;
+    str = end + 1;
+  }
+}
+
+cpu_set_t make_cpu_set(const std::vector<uint32_t>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (uint32_t cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return set;
+}
+
+bool placement_set_affinity(const char* spec) {
+  const char* list = strchr(spec, ':');
+  if (!list) return false;
+  std::vector<uint32_t>* cpus;
+  std::string role(spec, list);
+  if (role == "harts") {
+    cpus = &hart_cpus;
+  } else if (role == "io") {
+    cpus = &io_cpus;
+  } else if (role == "main") {
+    cpus = &main_cpus;
+  } else {
+    return false;
+  }
+  const char* end = parse_id_list(list + 1, "", CPU_SETSIZE, *cpus);
+  return end && *end == 0;
+}
+
+bool placement_add_numa_node(const char* spec) {
+  if (numa_nodes.size() >= MAX_NUMA_NODES) return false;
+  numa_node node = {{}, {}, -1};
+  // the hart and bank counts are not known yet, they are checked later
+  const char* pos = parse_id_list(spec, "@", UINT16_MAX, node.harts);
+  if (!pos || *pos != '@') return false;
+  pos = parse_id_list(pos + 1, "=", MAX_RAM_BANKS, node.banks);
+  if (!pos) return false;
+  if (*pos == '=') {
+    char* end;
+    node.host_node = strtol(pos + 1, &end, 10);
+    if (end == pos + 1 || *end || node.host_node < 0 || node.host_node >= 1024) return false;
+  }
+  numa_nodes.push_back(std::move(node));
+  return true;
+}
+
+bool placement_check() {
+  if (numa_nodes.empty()) return true;
+  // every bank has to belong to exactly one node, or the guest kernel gives up on NUMA
+  std::vector<int> bank_nodes(ram_bank_count, -1);
+  std::vector<int> hart_nodes(MACH_HART_COUNT, -1);
+  for (size_t i = 0; i < numa_nodes.size(); i++) {
+    for (uint32_t bank : numa_nodes[i].banks) {
+      if (bank >= ram_bank_count || bank_nodes[bank] >= 0) return false;
+      bank_nodes[bank] = i;
+    }
+    for (uint32_t hart : numa_nodes[i].harts) {
+      if (hart >= MACH_HART_COUNT || hart_nodes[hart] >= 0) return false;
+      hart_nodes[hart] = i;
+    }
+  }
+  for (int node : bank_nodes) {
+    if (node < 0) return false;
+  }
+  return true;
+}
+
+void placement_pin_io() {
+  sched_getaffinity(0, sizeof(startup_cpus), &startup_cpus);
+  if (io_cpus.empty()) return;
+  cpu_set_t set = make_cpu_set(io_cpus);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+void placement_pin_main() {
+  if (main_cpus.empty() && io_cpus.empty()) return;
+  // without a main list, go back to the CPUs the emulator was started on
+  cpu_set_t set = main_cpus.empty() ? startup_cpus : make_cpu_set(main_cpus);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+void placement_pin_hart(std::thread& thread, uint16_t hartid) {
+  if (hart_cpus.empty() && io_cpus.empty()) return;
+  // without a harts list, the thread would otherwise inherit the io CPUs the main thread is still pinned to
+  cpu_set_t set = hart_cpus.empty() ? startup_cpus : make_cpu_set({hart_cpus[hartid % hart_cpus.size()]});
+  pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+bool placement_bind_banks() {
+  for (numa_node& node : numa_nodes) {
+    if (node.host_node < 0) continue;
+    uint64_t nodemask[1024 / 64] = {};
+    nodemask[node.host_node / 64] = 1ULL << (node.host_node % 64);
+    for (uint32_t bank : node.banks) {
+      // the bank offsets are page aligned, and the size is rounded up to the page just like the mapping
+      uint64_t len = (ram_banks[bank].size + mem_page_size - 1) & ~(mem_page_size - 1);
+      if (syscall(SYS_mbind, ram_banks[bank].host, len, MPOL_BIND, nodemask, 1024 + 1, 0)) return false;
+    }
+  }
+  return true;
+}
+
+void placement_fixup_dtb(fdt_node& root) {
+  for (size_t i = 0; i < numa_nodes.size(); i++) {
+    std::vector<uint8_t> node_id = fdt_cells({(uint32_t)i});
+    for (uint32_t bank : numa_nodes[i].banks) {
+      char name[32];
+      snprintf(name, sizeof(name), "memory@%lx", ram_banks[bank].base);
+      for (fdt_node& child : root.children) {
+        if (child.name == name) fdt_set_prop(child, "numa-node-id", node_id);
+      }
+    }
+    for (fdt_node& cpus : root.children) {
+      if (cpus.name != "cpus") continue;
+      for (fdt_node& cpu : cpus.children) {
+        if (!cpu.name.starts_with("cpu@")) continue;
+        uint32_t hartid = fdt_get_u32(cpu, "reg", UINT32_MAX);
+        for (uint32_t hart : numa_nodes[i].harts) {
+          if (hart == hartid) fdt_set_prop(cpu, "numa-node-id", node_id);
+        }
+      }
+    }
+  }
+}
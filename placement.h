@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include <thread>
+
+#include "fdt.h"
+
+// placement of the emulator on the host: which host CPUs its threads run on,
+// and which host NUMA nodes back the RAM banks, so the guest sees a matching NUMA layout
+
+#define MAX_NUMA_NODES 8
+
+// spec is "<role>:<cpu list>", role is harts, io or main, and the cpu list is like "0-3,8"
+// hart n, or hart thread n with -T, runs on the n-th CPU of the harts list, wrapping around; io and main threads may use any CPU of their list
+bool placement_set_affinity(const char* spec);
+// spec is "<hart list>@<bank list>[=<host node>]", each call adds the next guest NUMA node
+// the banks of the node are bound to the host node if one is given
+bool placement_add_numa_node(const char* spec);
+// checks the NUMA nodes against the hart and bank counts, call after all options are parsed
+bool placement_check();
+
+// device worker threads inherit the affinity of the thread creating them,
+// so this is called before the devices are initialised, and placement_pin_main after
+void placement_pin_io();
+void placement_pin_main();
+void placement_pin_hart(std::thread& thread, uint16_t hartid);
+
+// binds the host memory of the banks to their host nodes, called by mem_init before RAM is populated
+bool placement_bind_banks();
+// adds numa-node-id to the memory nodes and the cpu nodes of a DTB
+void placement_fixup_dtb(fdt_node& root);
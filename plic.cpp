@@ -1,8 +1,13 @@
 #include <cstdint>
+#include <algorithm>
+#include <bit>
+#include <mutex>
 
 #include "plic.h"
 #include "constants.h"
 #include "hartexc.h"
+#include "imsic.h"
+#include "aplic.h"
 
 // context assignment:
 // even contexts for M mode, odd contexts for S mode
@@ -14,79 +19,176 @@ uint32_t* int_en_regs;
 uint32_t* int_prio_thres;
 
 bool* int_handling;
+// the source each context claimed last, read back through the pointer plic_r returns
+uint32_t* int_claimed;
 
 #define PLIC_CTX_COUNT (2 * MACH_HART_COUNT)
+// each context has 0x80 bytes of enable bits, whether the sources exist or not
+#define PLIC_EN_STRIDE 0x20
+#define PLIC_EN_WORDS (PLIC_EN_STRIDE * PLIC_CTX_COUNT)
+#define PLIC_CTX_WORDS ((PLIC_CTX_COUNT + 63) / 64)
+#define PLIC_SRC_WORDS ((PLIC_SOURCE_COUNT + 63) / 64)
+static_assert(PLIC_SRC_WORDS <= 16, "ctx_ready_words has a bit per word of sources");
+
+// the enable bits again, by source instead of by context, so a source only visits the contexts that enabled it
+uint64_t* src_ctx_en;
+
+// for each context and priority level, the pending sources it enabled, with a bit per non-empty word of them
+// and a bit per non-empty level on top, so the highest one is found with a few bit scans instead of a loop over the sources
+// priority 0 never interrupts, so it has no level
+uint64_t* ctx_ready;
+uint16_t* ctx_ready_words;
+uint8_t* ctx_ready_levels;
+
+// the registers are written by the harts and the device threads
+std::mutex plic_mtx;
+
+void plic_ready_set(uint16_t ctx, uint16_t source) {
+  uint32_t prio = int_prio_regs[source];
+  if (!prio) return;
+  uint32_t level = ctx * PLIC_PRIO_MAX + prio - 1;
+  ctx_ready[level * PLIC_SRC_WORDS + source / 64] |= 1ull << (source % 64);
+  ctx_ready_words[level] |= 1 << (source / 64);
+  ctx_ready_levels[ctx] |= 1 << (prio - 1);
+}
+
+void plic_ready_clear(uint16_t ctx, uint16_t source) {
+  uint32_t prio = int_prio_regs[source];
+  if (!prio) return;
+  uint32_t level = ctx * PLIC_PRIO_MAX + prio - 1;
+  uint64_t& word = ctx_ready[level * PLIC_SRC_WORDS + source / 64];
+  word &= ~(1ull << (source % 64));
+  if (word) return;
+  ctx_ready_words[level] &= ~(1 << (source / 64));
+  if (ctx_ready_words[level]) return;
+  ctx_ready_levels[ctx] &= ~(1 << (prio - 1));
+}
+
+// the highest priority pending source a context enabled, the lowest numbered one among equals, or 0 if there is none
+uint16_t plic_ready_best(uint16_t ctx) {
+  if (!ctx_ready_levels[ctx]) return 0;
+  uint32_t level = ctx * PLIC_PRIO_MAX + 31 - std::countl_zero<uint32_t>(ctx_ready_levels[ctx]);
+  uint16_t word = std::countr_zero(ctx_ready_words[level]);
+  return word * 64 + std::countr_zero(ctx_ready[level * PLIC_SRC_WORDS + word]);
+}
+
+bool plic_pending(uint16_t source) {
+  return int_pend_regs[source / 32] & (1u << (source % 32));
+}
+
+// adds a pending source to, or removes it from, the contexts that enabled it
+void plic_src_sync(uint16_t source, bool ready) {
+  const uint64_t* en = &src_ctx_en[source * PLIC_CTX_WORDS];
+  for (uint16_t word = 0; word < PLIC_CTX_WORDS; word++) {
+    for (uint64_t bits = en[word]; bits; bits &= bits - 1) {
+      uint16_t ctx = word * 64 + std::countr_zero(bits);
+      if (ready) {
+        plic_ready_set(ctx, source);
+      } else {
+        plic_ready_clear(ctx, source);
+      }
+    }
+  }
+}
+
+void plic_src_update(uint16_t source) {
+  const uint64_t* en = &src_ctx_en[source * PLIC_CTX_WORDS];
+  for (uint16_t word = 0; word < PLIC_CTX_WORDS; word++) {
+    for (uint64_t bits = en[word]; bits; bits &= bits - 1) plic_update_ctx(word * 64 + std::countr_zero(bits));
+  }
+}
+
+void plic_en_sync(uint16_t ctx, uint16_t regnum) {
+  for (uint16_t regbit = 0; regbit < 32 && regnum * 32 + regbit < PLIC_SOURCE_COUNT; regbit++) {
+    uint16_t source = regnum * 32 + regbit;
+    uint64_t* word = &src_ctx_en[source * PLIC_CTX_WORDS + ctx / 64];
+    bool enabled = int_en_regs[PLIC_EN_STRIDE * ctx + regnum] & (1u << regbit);
+    if (enabled == bool(*word & (1ull << (ctx % 64)))) continue;
+    if (enabled) {
+      *word |= 1ull << (ctx % 64);
+      if (plic_pending(source)) plic_ready_set(ctx, source);
+    } else {
+      *word &= ~(1ull << (ctx % 64));
+      if (plic_pending(source)) plic_ready_clear(ctx, source);
+    }
+  }
+}
+
+void plic_en_sync_all() {
+  std::fill_n(src_ctx_en, PLIC_SOURCE_COUNT * PLIC_CTX_WORDS, 0);
+  std::fill_n(ctx_ready, PLIC_CTX_COUNT * PLIC_PRIO_MAX * PLIC_SRC_WORDS, 0);
+  std::fill_n(ctx_ready_words, PLIC_CTX_COUNT * PLIC_PRIO_MAX, 0);
+  std::fill_n(ctx_ready_levels, PLIC_CTX_COUNT, 0);
+  for (uint16_t ctx = 0; ctx < PLIC_CTX_COUNT; ctx++) {
+    for (uint16_t regnum = 0; regnum < (PLIC_SOURCE_COUNT + 31) / 32; regnum++) plic_en_sync(ctx, regnum);
+  }
+}
 
 void plic_init() {
-  int_prio_regs = new uint32_t[PLIC_SOURCE_COUNT];
-  int_pend_regs = new uint32_t[(PLIC_SOURCE_COUNT + 31) / 32]; // default behaviour is to round to zero; this forces it to round up for positive numbers
-  int_en_regs = new uint32_t[(PLIC_SOURCE_COUNT + 31) / 32 * PLIC_CTX_COUNT] {0xFFFFFFFF};
-  int_prio_thres = new uint32_t[PLIC_CTX_COUNT];
+  int_prio_regs = new uint32_t[PLIC_SOURCE_COUNT] {0};
+  int_pend_regs = new uint32_t[(PLIC_SOURCE_COUNT + 31) / 32] {0}; // default behaviour is to round to zero; this forces it to round up for positive numbers
+  int_en_regs = new uint32_t[PLIC_EN_WORDS] {0xFFFFFFFF};
+  int_prio_thres = new uint32_t[PLIC_CTX_COUNT] {0};
   
   int_handling = new bool[PLIC_CTX_COUNT] {false};
+  int_claimed = new uint32_t[PLIC_CTX_COUNT] {0};
+  src_ctx_en = new uint64_t[PLIC_SOURCE_COUNT * PLIC_CTX_WORDS];
+  ctx_ready = new uint64_t[PLIC_CTX_COUNT * PLIC_PRIO_MAX * PLIC_SRC_WORDS];
+  ctx_ready_words = new uint16_t[PLIC_CTX_COUNT * PLIC_PRIO_MAX];
+  ctx_ready_levels = new uint8_t[PLIC_CTX_COUNT];
+  plic_en_sync_all();
 }
 
 void plic_send_int(uint16_t source) {
-  uint16_t regnum = source / 32;
-  uint16_t regbit = source % 32;
-  
-  if (int_pend_regs[regnum] & (1 << regbit)) { // previous interrupt is pending!
+  if (aia_enabled) { // the devices are wired to the APLIC instead
+    aplic_send_int(source);
     return;
   }
-  int_pend_regs[regnum] |= 1 << regbit;
-  
-  plic_try_int(source);
-}
-
-void plic_try_int(uint16_t source) {
+  std::lock_guard<std::mutex> lock(plic_mtx);
   uint16_t regnum = source / 32;
   uint16_t regbit = source % 32;
-  if (!(int_pend_regs[regnum] & (1 << regbit)) ) { // this interrupt is not pending!
+  
+  if (int_pend_regs[regnum] & (1u << regbit)) { // previous interrupt is pending!
     return;
   }
-
-  uint32_t int_prio = int_prio_regs[source];
-  for (uint16_t i = 0; i < PLIC_CTX_COUNT; i++) {
-    if (!int_handling[i] && int_prio_thres[i] < int_prio && plic_find_en(i, source)) {
-      plic_notify_ctx(i);
-    }
-  }
+  int_pend_regs[regnum] |= 1u << regbit;
+  
+  plic_src_sync(source, true);
+  plic_src_update(source);
 }
 
-void plic_try_int_all() {
-  for (uint16_t i = 0; i < PLIC_SOURCE_COUNT; i++) {
-    plic_try_int(i);
+void plic_update_ctx(uint16_t ctx) {
+  uint16_t source = plic_ready_best(ctx);
+  if (!int_handling[ctx] && source && int_prio_thres[ctx] < int_prio_regs[source]) {
+    plic_notify_ctx(ctx);
+  } else {
+    plic_notify_finish_ctx(ctx);
   }
 }
 
 bool plic_find_en(uint16_t ctx, uint16_t source) {
-  return int_en_regs[(0x20) * ctx + source / 32] & (1 << (source % 32));
+  return int_en_regs[PLIC_EN_STRIDE * ctx + source / 32] & (1u << (source % 32));
 }
 
 void plic_notify_ctx(uint16_t ctx) {
   if (ctx & 0b1) {
-    hartlist[(ctx & (~0b1)) / 2].mip |= 1 << 9;
+    hart_raise_int(hartlist[(ctx & (~0b1)) / 2], 1 << 9);
     //hartlist[(ctx & (~0b1)) / 2].sip |= 1 << 9;
   } else {
-    hartlist[(ctx & (~0b1)) / 2].mip |= 1 << 11;
+    hart_raise_int(hartlist[(ctx & (~0b1)) / 2], 1 << 11);
   }
   //setup_pending_int(hartlist[(ctx & (~0b1)) / 2]);
 }
 
 void plic_notify_finish_ctx(uint16_t ctx) {
   if (ctx & 0b1) {
-    hartlist[(ctx & (~0b1)) / 2].mip &= ~(1 << 9);
+    hart_lower_int(hartlist[(ctx & (~0b1)) / 2], 1 << 9);
     //hartlist[(ctx & (~0b1)) / 2].sip &= ~(1 << 9);
   } else {
-    hartlist[(ctx & (~0b1)) / 2].mip &= ~(1 << 11);
+    hart_lower_int(hartlist[(ctx & (~0b1)) / 2], 1 << 11);
   }
 }
 
-void plic_chk() {
-  plic_try_int_all();
-}
-
-uint32_t highest_source = 0;
 #define OFFSET_TO_CTX(X) (X >> 12) - 0x200
 
 void* plic_r (uint64_t offset, [[maybe_unused]]uint8_t len) {
@@ -97,45 +199,72 @@ void* plic_r (uint64_t offset, [[maybe_unused]]uint8_t len) {
   if ((0x1000 / 4) <= roffset && roffset < (0x1000 / 4 + (PLIC_SOURCE_COUNT + 31) / 32)) {
     return &int_pend_regs[roffset - 0x1000/4];
   }
-  if ((0x2000 / 4) <= roffset && roffset < (0x2000u / 4 + PLIC_CTX_COUNT * (1024/8))) {
+  if ((0x2000 / 4) <= roffset && roffset < (0x2000u / 4 + PLIC_EN_WORDS)) {
     return &int_en_regs[roffset - 0x2000/4];
   }
+  if (offset >= 0x200000 && OFFSET_TO_CTX(offset) >= PLIC_CTX_COUNT) {
+    return &ZERO;
+  }
   if (offset >= 0x200000 && ((offset & 0xFFF) == 0)) {
     return &int_prio_thres[OFFSET_TO_CTX(offset)];
   }
   if (offset >= 0x200000 && ((offset & 0xFFF) == 4)) {
     // interrupt claim
-    uint32_t highest_prio = 0;
-    highest_source = 0;
-    for (uint16_t i = 0; i < PLIC_SOURCE_COUNT; i++) {
-      if (int_prio_regs[i] > highest_prio) {
-        if (plic_find_en(OFFSET_TO_CTX(offset), i)) {
-          highest_prio = int_prio_regs[i];
-          highest_source = i;
-        }
-      }
+    std::lock_guard<std::mutex> lock(plic_mtx);
+    uint16_t ctx = OFFSET_TO_CTX(offset);
+    uint16_t source = plic_ready_best(ctx);
+    int_claimed[ctx] = source;
+    if (source) {
+      int_handling[ctx] = true;
+      int_pend_regs[source / 32] &= ~(1u << (source % 32));
+      plic_src_sync(source, false);
+      // the other contexts lose it too
+      plic_src_update(source);
     }
-    if (highest_source) {
-      int_handling[OFFSET_TO_CTX(offset)] = true;
-      int_pend_regs[highest_source / 32] &= ~(1 << (highest_source % 32));
-    }
-    return &highest_source;
+    return &int_claimed[ctx];
   }
   return &ZERO;
 }
 void plic_w (uint64_t offset, void* dataptr, [[maybe_unused]]uint8_t len) {
+  std::lock_guard<std::mutex> lock(plic_mtx);
   uint64_t roffset = offset / 4; // reduced offset
   if (/*0 <= offset &&*/ roffset < PLIC_SOURCE_COUNT) {
-    int_prio_regs[roffset] = *(uint32_t*)dataptr;
+    // a pending source moves to the level of its new priority
+    bool pending = plic_pending(roffset);
+    if (pending) plic_src_sync(roffset, false);
+    int_prio_regs[roffset] = *(uint32_t*)dataptr & PLIC_PRIO_MAX;
+    if (pending) {
+      plic_src_sync(roffset, true);
+      plic_src_update(roffset);
+    }
   }
   if ((0x1000 / 4) <= roffset && roffset < (0x1000 / 4 + (PLIC_SOURCE_COUNT + 31) / 32)) {
-    int_pend_regs[roffset - 0x1000/4] = *(uint32_t*)dataptr;
+    uint16_t regnum = roffset - 0x1000/4;
+    uint32_t value = *(uint32_t*)dataptr;
+    if (regnum == 0) value &= ~1; // source 0 does not exist
+    uint32_t changed = int_pend_regs[regnum] ^ value;
+    int_pend_regs[regnum] ^= changed;
+    for (uint32_t bits = changed; bits; bits &= bits - 1) {
+      uint16_t source = regnum * 32 + std::countr_zero(bits);
+      plic_src_sync(source, plic_pending(source));
+      plic_src_update(source);
+    }
   }
-  if ((0x2000 / 4) <= roffset && roffset < (0x2000u / 4 + PLIC_CTX_COUNT * (0x20))) {
-    int_en_regs[roffset - 0x2000/4] = *(uint32_t*)dataptr & (~1); // cannot enable non-existent interrupt 0
+  if ((0x2000 / 4) <= roffset && roffset < (0x2000u / 4 + PLIC_EN_WORDS)) {
+    uint32_t value = *(uint32_t*)dataptr;
+    uint16_t ctx = (roffset - 0x2000/4) / PLIC_EN_STRIDE;
+    uint16_t word = (roffset - 0x2000/4) % PLIC_EN_STRIDE;
+    if (word == 0) value &= ~1; // cannot enable non-existent interrupt 0
+    int_en_regs[roffset - 0x2000/4] = value;
+    plic_en_sync(ctx, word);
+    plic_update_ctx(ctx);
+  }
+  if (offset >= 0x200000 && OFFSET_TO_CTX(offset) >= PLIC_CTX_COUNT) {
+    return;
   }
   if (offset >= 0x200000 && ((offset & 0xFFF) == 0)) {
-    int_prio_thres[OFFSET_TO_CTX(offset)] = *(uint32_t*)dataptr;
+    int_prio_thres[OFFSET_TO_CTX(offset)] = *(uint32_t*)dataptr & PLIC_PRIO_MAX;
+    plic_update_ctx(OFFSET_TO_CTX(offset));
   }
   if (offset >= 0x200000 && ((offset & 0xFFF) == 4)) {
     // interrupt complete
@@ -146,6 +275,25 @@ void plic_w (uint64_t offset, void* dataptr, [[maybe_unused]]uint8_t len) {
     int_pend_regs[regnum] &= ~(1 << regbit);
     */
     int_handling[OFFSET_TO_CTX(offset)] = false;
-    plic_notify_finish_ctx(OFFSET_TO_CTX(offset));
+    // lowers the interrupt, unless another source is pending
+    plic_update_ctx(OFFSET_TO_CTX(offset));
   }
 }
+
+void plic_save(std::vector<uint8_t>& out) {
+  snap_put(out, int_prio_regs, PLIC_SOURCE_COUNT * sizeof(uint32_t));
+  snap_put(out, int_pend_regs, (PLIC_SOURCE_COUNT + 31) / 32 * sizeof(uint32_t));
+  snap_put(out, int_en_regs, PLIC_EN_WORDS * sizeof(uint32_t));
+  snap_put(out, int_prio_thres, PLIC_CTX_COUNT * sizeof(uint32_t));
+  snap_put(out, int_handling, PLIC_CTX_COUNT * sizeof(bool));
+}
+
+bool plic_restore(snap_reader& in) {
+  bool ok = snap_get(in, int_prio_regs, PLIC_SOURCE_COUNT * sizeof(uint32_t))
+      && snap_get(in, int_pend_regs, (PLIC_SOURCE_COUNT + 31) / 32 * sizeof(uint32_t))
+      && snap_get(in, int_en_regs, PLIC_EN_WORDS * sizeof(uint32_t))
+      && snap_get(in, int_prio_thres, PLIC_CTX_COUNT * sizeof(uint32_t))
+      && snap_get(in, int_handling, PLIC_CTX_COUNT * sizeof(bool));
+  if (ok) plic_en_sync_all();
+  return ok;
+}
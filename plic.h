@@ -1,19 +1,26 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
-#define PLIC_SOURCE_COUNT 16
+#include "snapshot.h"
+
+// source 0 does not exist, so this is the full 1023 sources
+#define PLIC_SOURCE_COUNT 1024
+// priorities are 3 bits wide, writes to the priority and threshold registers drop the rest
+#define PLIC_PRIO_MAX 7
 
 void plic_init();
 
 void plic_send_int(uint16_t source);
 void plic_notify_ctx(uint16_t ctx);
 void plic_notify_finish_ctx(uint16_t ctx);
-void plic_try_int(uint16_t source);
-void plic_try_int_all();
+// raises the interrupt of a context if one of the pending sources it enabled is above its threshold, and lowers it otherwise
+void plic_update_ctx(uint16_t ctx);
 bool plic_find_en(uint16_t ctx, uint16_t source);
 
-void plic_chk();
-
 void* plic_r (uint64_t offset, uint8_t len);
 void plic_w (uint64_t offset, void* dataptr, uint8_t len);
+
+void plic_save(std::vector<uint8_t>& out);
+bool plic_restore(snap_reader& in);
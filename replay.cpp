@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "constants.h"
+#include "cpu.h"
+#include "io.h"
+#include "replay.h"
+
+extern bool interrupted;
+
+#define REPLAY_MAGIC "rvreplay"
+#define REPLAY_VERSION 1
+
+#define REPLAY_UART 0
+#define REPLAY_END 1
+
+struct __attribute__ ((packed)) replay_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t hart_count;
+};
+
+struct __attribute__ ((packed)) replay_event {
+  uint64_t round;
+  // retired by all harts together, to notice a replay that went another way
+  uint64_t instret;
+  uint8_t kind;
+  uint8_t data;
+};
+
+bool replay_recording = false;
+bool replay_replaying = false;
+
+FILE* replay_file = nullptr;
+uint64_t replay_rounds = 0;
+// the next event to replay, kind is REPLAY_END once the file runs out
+replay_event replay_next;
+
+uint64_t replay_instret() {
+  uint64_t instret = 0;
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) instret += hartlist[i].minstret;
+  return instret;
+}
+
+void replay_read() {
+  if (fread(&replay_next, sizeof(replay_next), 1, replay_file) != 1) {
+    replay_next = {UINT64_MAX, 0, REPLAY_END, 0};
+  }
+}
+
+void replay_write(uint8_t kind, uint8_t data) {
+  replay_event event = {replay_rounds, replay_instret(), kind, data};
+  fwrite(&event, sizeof(event), 1, replay_file);
+  // a recording has to survive a crash of the emulator, and events are rare
+  fflush(replay_file);
+}
+
+void replay_diverged() {
+  dbgerr_print("Replay diverged from the recording at round ");
+  dbgerr_print(replay_rounds, false);
+  dbgerr_endl();
+  replay_replaying = false;
+  interrupted = true;
+}
+
+// stops the replay if it no longer matches the recording
+bool replay_chk() {
+  if (replay_next.instret == replay_instret()) return true;
+  replay_diverged();
+  return false;
+}
+
+bool replay_open(const char* path, bool record) {
+  replay_file = fopen(path, record ? "wb" : "rb");
+  if (!replay_file) return false;
+  replay_header header;
+  if (record) {
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_VERSION;
+    header.hart_count = MACH_HART_COUNT;
+    fwrite(&header, sizeof(header), 1, replay_file);
+    replay_recording = true;
+  } else {
+    if (fread(&header, sizeof(header), 1, replay_file) != 1 || memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic))
+        || header.version != REPLAY_VERSION || header.hart_count != MACH_HART_COUNT) {
+      fclose(replay_file);
+      replay_file = nullptr;
+      return false;
+    }
+    replay_read();
+    replay_replaying = true;
+  }
+  return true;
+}
+
+void replay_close() {
+  if (!replay_file) return;
+  if (replay_recording) replay_write(REPLAY_END, 0);
+  // a replay that ran to its end stopped where the recording did, with nothing left over
+  if (replay_replaying && replay_next.kind != REPLAY_END) {
+    replay_diverged();
+  } else if (replay_replaying && replay_next.round != UINT64_MAX) {
+    replay_chk();
+  }
+  fclose(replay_file);
+  replay_file = nullptr;
+}
+
+void replay_round() {
+  replay_rounds++;
+  // a recording stopped between rounds ends after this one, one that halted ends partway through the next
+  if (replay_replaying && replay_next.kind == REPLAY_END && replay_next.round == replay_rounds
+      && replay_next.instret == replay_instret()) {
+    replay_next.round = UINT64_MAX;
+    interrupted = true;
+  }
+}
+
+char replay_getc() {
+  if (replay_recording) {
+    char ch = pty_getc();
+    if (ch != -1) replay_write(REPLAY_UART, ch);
+    return ch;
+  }
+  if (!replay_replaying || replay_next.kind != REPLAY_UART || replay_next.round != replay_rounds) return -1;
+  if (!replay_chk()) return -1;
+  char ch = replay_next.data;
+  replay_read();
+  return ch;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+
+// record and replay of a deterministic run: with -r, the input that reaches the guest is written to a file,
+// each event with the round of -D it arrived in and the instructions retired so far,
+// and -y feeds it back from the file at the same rounds in place of the real input
+// -D already fixes the time, the order of the harts, and the timer, IPI and UART interrupts, so for them only the input has to be kept
+// the virtio devices and vhost-user complete requests and raise interrupts on threads of their own, in host time,
+// and neither is recorded, so a guest that uses them does not replay
+
+extern bool replay_recording;
+extern bool replay_replaying;
+
+// opens the file to record to or replay from, before the harts start
+bool replay_open(const char* path, bool record);
+// writes the end of a recording, so its replay stops at the same round; called once the harts have stopped
+void replay_close();
+// counts a round of -D, called by its thread between the rounds, before the devices are updated
+void replay_round();
+// the next character of UART input, or -1 if there is none in this round
+// when recording it comes from the PTY, and is written to the file
+char replay_getc();
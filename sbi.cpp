@@ -0,0 +1,360 @@
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "constants.h"
+#include "cpu.h"
+#include "mem.h"
+#include "io.h"
+#include "uart.h"
+#include "aclint.h"
+#include "sbi.h"
+#include "hartexc.h"
+#include "hart_sched.h"
+
+extern bool interrupted;
+extern std::atomic<bool> harts_paused;
+
+// extension ids, the legacy ones are below BASE
+#define SBI_EXT_LEGACY_SET_TIMER 0x00
+#define SBI_EXT_LEGACY_PUTCHAR 0x01
+#define SBI_EXT_LEGACY_GETCHAR 0x02
+#define SBI_EXT_LEGACY_SHUTDOWN 0x08
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_TIME 0x54494D45
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_RFENCE 0x52464E43
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_SRST 0x53525354
+#define SBI_EXT_DBCN 0x4442434E
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_ALREADY_AVAILABLE -6
+// not an SBI error, the ECALL is run again after the harts are paused
+#define SBI_RETRY INT64_MIN
+
+#define SBI_SPEC_VERSION (2 << 24) // 2.0
+#define SBI_IMPL_ID 0x7276 // not in the list of registered implementations
+#define SBI_IMPL_VERSION 1
+
+#define SBI_HSM_SUSPEND_RETENTIVE 0
+#define SBI_HSM_SUSPEND_NON_RETENTIVE 0x8000'0000
+
+#define SIP_SSIP (1 << 1)
+#define SIP_STIP (1 << 5)
+#define SIP_SEIP (1 << 9)
+
+struct sbi_ret {
+  int64_t error;
+  int64_t value;
+};
+
+bool sbi_enabled = false;
+// set by a hart that wants another one to clear its TLB, and cleared by that one once done
+std::vector<std::atomic<bool>> sbi_fences;
+// a stopped or suspended hart sleeps on its word, anything that may get it going again bumps it
+std::vector<std::atomic<uint32_t>> sbi_wake;
+
+void sbi_init() {
+  sbi_fences = std::vector<std::atomic<bool>>(MACH_HART_COUNT);
+  sbi_wake = std::vector<std::atomic<uint32_t>>(MACH_HART_COUNT);
+}
+
+void sbi_wake_hart(uint16_t hartid) {
+  sbi_wake[hartid]++;
+  sbi_wake[hartid].notify_one();
+  if (sched_enabled) sched_wake(hartid);
+}
+
+void sbi_wake_all() {
+  for (uint16_t i = 0; i < sbi_wake.size(); i++) {
+    sbi_wake_hart(i);
+  }
+}
+
+// what a hart looks like when the SBI hands it to the kernel
+void sbi_enter(HartState& hs, uint64_t addr, uint64_t opaque) {
+  hs.privmode = 0b01; // S-mode
+  hs.pc = addr;
+  hs.regs[10] = hs.hartid;
+  hs.regs[11] = opaque;
+  hs.satp = 0;
+  hs.mstatus &= ~(0b1 << 1); // clear mstatus.SIE
+  tlb_clear(&hs.tlb);
+  hs.instbuf = 0;
+}
+
+bool sbi_boot() {
+  uint8_t* dtb = phy_mem_ptr(SBI_DTB_ADDR, MAX_DTB_SIZE);
+  if (!dtb) return false;
+  memcpy(dtb, dtb_buf, MAX_DTB_SIZE);
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    HartState& hs = hartlist[i];
+    // what a firmware would delegate: every exception but ECALLs from S- and M-mode, and the S-mode interrupts
+    hs.medeleg = 0b1011'0001'1111'1111;
+    hs.mideleg = SIP_SSIP | SIP_STIP | SIP_SEIP;
+    hs.mie &= ~(0b100010001000); // nothing in M-mode would take machine interrupts
+    sync_exp_pmp(hs); // the PMP entry allowing everything, which nobody writes to the CSRs for
+    if (i == 0) {
+      sbi_enter(hs, SBI_KERNEL_ADDR, SBI_DTB_ADDR);
+    } else {
+      hs.hsm_state = SBI_HSM_STOPPED;
+    }
+  }
+  return true;
+}
+
+// calls f(hartid) for every hart in a hart mask, or does nothing and returns false if one of them does not exist
+template <typename F>
+bool sbi_for_harts(uint64_t mask, uint64_t base, F f) {
+  if (base == UINT64_MAX) { // all harts
+    for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+      f(i);
+    }
+    return true;
+  }
+  for (uint64_t bit = 0; bit < 64; bit++) {
+    if ((mask >> bit & 1) && (base >= MACH_HART_COUNT || bit >= MACH_HART_COUNT - base)) return false;
+  }
+  for (uint64_t bit = 0; bit < 64; bit++) {
+    if (mask >> bit & 1) f(base + bit);
+  }
+  return true;
+}
+
+void sbi_poll(HartState& hs) {
+  if (sbi_fences[hs.hartid].exchange(false)) {
+    // a remote fence.i or sfence.vma, both are covered by clearing everything
+    tlb_clear(&hs.tlb);
+    hs.instbuf = 0;
+  }
+}
+
+sbi_ret sbi_base(uint64_t fid, uint64_t arg) {
+  switch (fid) {
+    case 0: return {SBI_SUCCESS, SBI_SPEC_VERSION};
+    case 1: return {SBI_SUCCESS, SBI_IMPL_ID};
+    case 2: return {SBI_SUCCESS, SBI_IMPL_VERSION};
+    case 3: // probe_extension
+      switch (arg) {
+        case SBI_EXT_LEGACY_SET_TIMER: case SBI_EXT_LEGACY_PUTCHAR: case SBI_EXT_LEGACY_GETCHAR: case SBI_EXT_LEGACY_SHUTDOWN:
+        case SBI_EXT_BASE: case SBI_EXT_TIME: case SBI_EXT_IPI: case SBI_EXT_RFENCE: case SBI_EXT_HSM: case SBI_EXT_SRST: case SBI_EXT_DBCN:
+          return {SBI_SUCCESS, 1};
+      }
+      return {SBI_SUCCESS, 0};
+    case 4: case 5: case 6: // mvendorid, marchid, mimpid
+      return {SBI_SUCCESS, 0};
+  }
+  return {SBI_ERR_NOT_SUPPORTED, 0};
+}
+
+sbi_ret sbi_ipi(uint64_t mask, uint64_t base) {
+  bool valid = sbi_for_harts(mask, base, [](uint64_t hartid) {
+    HartState& target = hartlist[hartid];
+    hart_raise_int(target, SIP_SSIP);
+    sbi_wake_hart(hartid);
+  });
+  return {valid ? SBI_SUCCESS : SBI_ERR_INVALID_PARAM, 0};
+}
+
+// the address ranges and ASIDs are ignored, as the whole TLB is cleared
+sbi_ret sbi_rfence(HartState& hs, uint64_t fid, uint64_t mask, uint64_t base) {
+  if (fid > 2) return {SBI_ERR_NOT_SUPPORTED, 0}; // the hypervisor fences
+  bool valid = sbi_for_harts(mask, base, [&](uint64_t hartid) {
+    // with one thread for all harts, none of the others is running
+    if (hartid == hs.hartid || sched_deterministic) {
+      tlb_clear(&hartlist[hartid].tlb);
+      hartlist[hartid].instbuf = 0;
+      return;
+    }
+    sbi_fences[hartid] = true;
+    hart_notify(hartlist[hartid]);
+    if (std::atomic_ref<uint8_t>(hartlist[hartid].hsm_state).load() != SBI_HSM_STARTED) sbi_wake_hart(hartid);
+  });
+  if (!valid) return {SBI_ERR_INVALID_PARAM, 0};
+  // the kernel may free the old page tables once this returns, so wait for every hart to be done
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    while (sbi_fences[i]) {
+      if (sched_enabled && i != hs.hartid) {
+        // a hart that is not on a worker may wait a long time for one, so fence it from here
+        std::unique_lock<std::mutex> lock(sched_hart_lock(i), std::try_to_lock);
+        if (lock) sbi_poll(hartlist[i]);
+      }
+      sbi_poll(hs); // the other hart may be waiting for this one too
+      // a paused hart does not get to its fence, so let this one be paused too, and ask again afterwards
+      if (harts_paused || interrupted) return {SBI_RETRY, 0};
+      std::this_thread::yield();
+    }
+  }
+  return {SBI_SUCCESS, 0};
+}
+
+sbi_ret sbi_hsm(HartState& hs, uint64_t fid, uint64_t a0, uint64_t a1, uint64_t a2) {
+  switch (fid) {
+    case 0: { // hart_start
+      if (a0 >= MACH_HART_COUNT) return {SBI_ERR_INVALID_PARAM, 0};
+      HartState& target = hartlist[a0];
+      std::atomic_ref<uint8_t> state(target.hsm_state);
+      uint8_t stopped = SBI_HSM_STOPPED;
+      if (!state.compare_exchange_strong(stopped, SBI_HSM_START_PENDING)) return {SBI_ERR_ALREADY_AVAILABLE, 0};
+      // a stopped hart only looks at its state, so it can be set up from here
+      sbi_enter(target, a1, a2);
+      state.store(SBI_HSM_STARTED, std::memory_order_release);
+      sbi_wake_hart(a0);
+      return {SBI_SUCCESS, 0};
+    }
+    case 1: // hart_stop
+      std::atomic_ref<uint8_t>(hs.hsm_state).store(SBI_HSM_STOPPED);
+      return {SBI_SUCCESS, 0};
+    case 2: // hart_get_status
+      if (a0 >= MACH_HART_COUNT) return {SBI_ERR_INVALID_PARAM, 0};
+      return {SBI_SUCCESS, std::atomic_ref<uint8_t>(hartlist[a0].hsm_state).load()};
+    case 3: // hart_suspend
+      if (a0 != SBI_HSM_SUSPEND_RETENTIVE && a0 != SBI_HSM_SUSPEND_NON_RETENTIVE) return {SBI_ERR_INVALID_PARAM, 0};
+      hs.hsm_suspend_type = a0;
+      hs.hsm_resume_addr = a1;
+      hs.hsm_opaque = a2;
+      std::atomic_ref<uint8_t>(hs.hsm_state).store(SBI_HSM_SUSPENDED);
+      return {SBI_SUCCESS, 0};
+  }
+  return {SBI_ERR_NOT_SUPPORTED, 0};
+}
+
+// a suspended hart wakes up on any enabled S-mode interrupt, even with mstatus.SIE clear
+bool sbi_wakeup_pending(HartState& hs) {
+  return hart_pending_int(hs) & hs.sie & (SIP_SSIP | SIP_STIP | SIP_SEIP);
+}
+
+void sbi_chk(HartState& hs) {
+  if (std::atomic_ref<uint8_t>(hs.hsm_state).load() == SBI_HSM_SUSPENDED && sbi_wakeup_pending(hs)) sbi_wake_hart(hs.hartid);
+}
+
+bool sbi_hart_wakeup(HartState& hs) {
+  // a hart that is not running has nothing to fence, and its TLB is cleared before it runs again
+  sbi_fences[hs.hartid] = false;
+  std::atomic_ref<uint8_t> state(hs.hsm_state);
+  uint8_t current = state.load(std::memory_order_acquire);
+  if (current == SBI_HSM_STARTED) return true;
+  if (current == SBI_HSM_SUSPENDED && sbi_wakeup_pending(hs)) {
+    if (hs.hsm_suspend_type == SBI_HSM_SUSPEND_NON_RETENTIVE) {
+      sbi_enter(hs, hs.hsm_resume_addr, hs.hsm_opaque);
+    } else {
+      tlb_clear(&hs.tlb);
+      hs.instbuf = 0;
+    }
+    hart_recheck(hs);
+    state.store(SBI_HSM_STARTED);
+    return true;
+  }
+  return false;
+}
+
+void sbi_hart_idle(HartState& hs) {
+  // read before looking at anything, so a wake up after that is not missed
+  uint32_t wake = sbi_wake[hs.hartid].load();
+  if (sbi_hart_wakeup(hs)) return;
+  // the hart loop parks the thread or ends it
+  if (harts_paused || interrupted) return;
+  // no host CPU is taken until another hart, an interrupt or the main thread wakes this one
+  harts_waiting++;
+  sbi_wake[hs.hartid].wait(wake);
+  harts_waiting--;
+}
+
+sbi_ret sbi_srst(uint64_t fid, uint64_t type) {
+  if (fid != 0) return {SBI_ERR_NOT_SUPPORTED, 0};
+  if (type > 2) return {SBI_ERR_INVALID_PARAM, 0};
+  // there is no reset, so a reboot stops the emulator as well
+  dbg_print(type == 0 ? "SBI shutdown" : "SBI reboot, stopping");
+  dbg_endl();
+  interrupted = true;
+  return {SBI_SUCCESS, 0};
+}
+
+sbi_ret sbi_dbcn(uint64_t fid, uint64_t a0, uint64_t a1, uint64_t a2) {
+  if (fid == 2) { // console_write_byte
+    char c = a0;
+    struct iovec iov = {&c, 1};
+    return {pty_writev(&iov, 1) < 0 ? SBI_ERR_FAILED : SBI_SUCCESS, 0};
+  }
+  if (fid > 2) return {SBI_ERR_NOT_SUPPORTED, 0};
+  // a0 is the length, a1 and a2 the low and high halves of the physical address
+  uint8_t* buf = a2 ? nullptr : phy_mem_ptr(a1, a0);
+  if (!buf) return {SBI_ERR_INVALID_PARAM, 0};
+  if (fid == 0) { // console_write
+    struct iovec iov = {buf, a0};
+    ssize_t written = pty_writev(&iov, 1);
+    if (written < 0) return {SBI_ERR_FAILED, 0};
+    return {SBI_SUCCESS, written};
+  }
+  // console_read, through the UART, which already takes the input
+  int64_t n_read = 0;
+  for (int c; (uint64_t)n_read < a0 && (c = uart_getc()) >= 0; n_read++) buf[n_read] = c;
+  mem_dirty_mark(a1, n_read);
+  return {SBI_SUCCESS, n_read};
+}
+
+// the legacy extensions only return a0
+int64_t sbi_legacy(HartState& hs, uint64_t eid, uint64_t a0) {
+  switch (eid) {
+    case SBI_EXT_LEGACY_SET_TIMER:
+      aclint_mtimer_set(hs, a0);
+      return SBI_SUCCESS;
+    case SBI_EXT_LEGACY_PUTCHAR:
+      return sbi_dbcn(2, a0, 0, 0).error;
+    case SBI_EXT_LEGACY_GETCHAR:
+      return uart_getc();
+    case SBI_EXT_LEGACY_SHUTDOWN:
+      return sbi_srst(0, 0).error;
+  }
+  return SBI_ERR_NOT_SUPPORTED;
+}
+
+HartException sbi_ecall(HartState& hs) {
+  uint64_t eid = hs.regs[17];
+  uint64_t fid = hs.regs[16];
+  uint64_t a0 = hs.regs[10], a1 = hs.regs[11], a2 = hs.regs[12];
+  if (eid < SBI_EXT_BASE) {
+    hs.regs[10] = sbi_legacy(hs, eid, a0);
+  } else {
+    sbi_ret ret = {SBI_ERR_NOT_SUPPORTED, 0};
+    switch (eid) {
+      case SBI_EXT_BASE:
+        ret = sbi_base(fid, a0);
+        break;
+      case SBI_EXT_TIME:
+        if (fid == 0) { // set_timer
+          aclint_mtimer_set(hs, a0);
+          ret = {SBI_SUCCESS, 0};
+        }
+        break;
+      case SBI_EXT_IPI:
+        if (fid == 0) ret = sbi_ipi(a0, a1); // send_ipi
+        break;
+      case SBI_EXT_RFENCE:
+        ret = sbi_rfence(hs, fid, a0, a1);
+        break;
+      case SBI_EXT_HSM:
+        ret = sbi_hsm(hs, fid, a0, a1, a2);
+        break;
+      case SBI_EXT_SRST:
+        ret = sbi_srst(fid, a0);
+        break;
+      case SBI_EXT_DBCN:
+        ret = sbi_dbcn(fid, a0, a1, a2);
+        break;
+    }
+    if (ret.error == SBI_RETRY) return HartException::NOEXC; // pc stays on the ECALL
+    hs.regs[10] = ret.error;
+    hs.regs[11] = ret.value;
+  }
+  hs.pc += 4;
+  return HartException::NOEXC;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+
+#include "cpu.h"
+
+// built-in SBI: with -f sbi the kernel runs in S-mode without a firmware, and its ECALLs are serviced by the emulator
+// implements BASE, TIME, IPI, RFENCE, HSM, SRST and DBCN, plus the legacy console and shutdown calls
+
+// the kernel is loaded at the same address as with a firmware, and the dtb is copied into RAM after it
+#define SBI_KERNEL_ADDR 0x8020'0000
+#define SBI_DTB_ADDR 0x8220'0000
+
+// HSM states, as returned by hart_get_status
+// zero is started, so harts run as usual without the built-in SBI
+#define SBI_HSM_STARTED 0
+#define SBI_HSM_STOPPED 1
+#define SBI_HSM_START_PENDING 2
+#define SBI_HSM_SUSPENDED 4
+
+extern bool sbi_enabled;
+
+void sbi_init();
+// called in place of loading a firmware, after the kernel and dtb are loaded
+// hart 0 starts at the kernel in S-mode, the others wait for an HSM start; returns false if the dtb does not fit in RAM
+bool sbi_boot();
+// services an ECALL from S-mode, called by create_exception in place of the trap
+// returns NOEXC, with pc past the ECALL unless the call has to be retried
+HartException sbi_ecall(HartState& hs);
+// applies remote fences requested by other harts, called when the hart checks its interrupts
+void sbi_poll(HartState& hs);
+// starts running a suspended hart if it has an interrupt to wake up for, returns whether the hart is running
+bool sbi_hart_wakeup(HartState& hs);
+// one step of a hart that is stopped or suspended, the thread sleeps until there may be something to do
+// returns once the hart is started or woken up, or when the harts are paused or interrupted
+void sbi_hart_idle(HartState& hs);
+// wakes a suspended hart with an interrupt pending, called through hart_notify when its interrupts change
+void sbi_chk(HartState& hs);
+// wakes every sleeping hart, so they see harts_paused or interrupted
+void sbi_wake_all();
@@ -0,0 +1,360 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "constants.h"
+#include "cpu.h"
+#include "mem.h"
+#include "mem_dump.h"
+#include "aclint.h"
+#include "plic.h"
+#include "imsic.h"
+#include "aplic.h"
+#include "uart.h"
+#include "virtio_common.h"
+#include "placement.h"
+#include "hartexc.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "RVEMUSNP"
+#define SNAPSHOT_VERSION 7
+// RAM images start on this boundary in the file, which is a multiple of any host page size but huge pages
+#define SNAPSHOT_RAM_ALIGN 0x20'0000ULL
+// pages that are all zero are left as holes in the file
+#define SNAPSHOT_PAGE DIRTY_PAGE_SIZE
+
+#define SNAPSHOT_F_DELTA 1
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t hart_count;
+  uint32_t bank_count;
+  uint32_t flags;
+  uint64_t id; // random, so a delta can check it is applied to the right base
+  uint64_t base_id; // the id of the base of a delta
+  uint64_t state_len; // the device state follows the header
+  uint64_t bank_base[MAX_RAM_BANKS];
+  uint64_t bank_size[MAX_RAM_BANKS];
+  uint64_t bank_file_offset[MAX_RAM_BANKS];
+};
+
+// the device state is a list of sections, each an 8 byte tag, a 64 bit length and the data
+struct snapshot_section {
+  char tag[8];
+  uint64_t len;
+};
+
+void snap_put(std::vector<uint8_t>& out, const void* src, size_t len) {
+  out.insert(out.end(), (const uint8_t*)src, (const uint8_t*)src + len);
+}
+
+bool snap_get(snap_reader& in, void* dst, size_t len) {
+  if (len > (size_t)(in.end - in.pos)) return false;
+  memcpy(dst, in.pos, len);
+  in.pos += len;
+  return true;
+}
+
+// appends a section, with the length filled in after the data
+// the tag is padded with zeros and has no terminator when it takes all 8 bytes
+template <size_t N>
+size_t snap_begin(std::vector<uint8_t>& out, const char (&tag)[N]) {
+  static_assert(N - 1 <= sizeof(snapshot_section::tag), "section tags are at most 8 characters");
+  snapshot_section section = {};
+  memcpy(section.tag, tag, N - 1);
+  snap_put(out, &section, sizeof(section));
+  return out.size();
+}
+
+void snap_end(std::vector<uint8_t>& out, size_t start) {
+  uint64_t len = out.size() - start;
+  memcpy(out.data() + start - sizeof(uint64_t), &len, sizeof(len));
+}
+
+// the reader over the next section, which must have the given tag
+bool snap_section(snap_reader& in, const char* tag, snap_reader& section_in) {
+  snapshot_section section;
+  if (!snap_get(in, &section, sizeof(section)) || strncmp(section.tag, tag, sizeof(section.tag))) return false;
+  if (section.len > (uint64_t)(in.end - in.pos)) return false;
+  section_in = {in.pos, in.pos + section.len};
+  in.pos += section.len;
+  return true;
+}
+
+bool snap_pwrite(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+  while (len) {
+    ssize_t written = pwrite(fd, data, len, offset);
+    if (written <= 0) return false;
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool snap_pread(int fd, uint8_t* data, size_t len, uint64_t offset) {
+  while (len) {
+    ssize_t n_read = pread(fd, data, len, offset);
+    if (n_read <= 0) return false;
+    data += n_read;
+    len -= n_read;
+    offset += n_read;
+  }
+  return true;
+}
+
+bool snap_page_selected(const uint64_t* pages, uint64_t page) {
+  return !pages || (pages[page / 64] >> (page % 64) & 1);
+}
+
+// writes the runs of non-zero pages of a bank, only the pages set in the bitmap if there is one
+bool snap_write_ram(int fd, const Ram_Bank& bank, uint64_t file_offset, const uint64_t* pages) {
+  uint64_t run_start = 0;
+  bool in_run = false;
+  for (uint64_t offset = 0; offset <= bank.size; offset += SNAPSHOT_PAGE) {
+    uint64_t len = std::min<uint64_t>(SNAPSHOT_PAGE, bank.size - offset);
+    bool skip = offset == bank.size || !snap_page_selected(pages, offset / SNAPSHOT_PAGE) || mem_is_zero(bank.host + offset, len);
+    if (!skip && !in_run) {
+      run_start = offset;
+      in_run = true;
+    } else if (skip && in_run) {
+      if (!snap_pwrite(fd, bank.host + run_start, offset - run_start, file_offset + run_start)) return false;
+      in_run = false;
+    }
+  }
+  return true;
+}
+
+uint64_t snap_bitmap_words(const Ram_Bank& bank) {
+  return ((bank.size >> DIRTY_PAGE_SHIFT) + 64) / 64;
+}
+
+std::string snapshot_path;
+bool snapshot_incremental = false;
+// the full snapshot deltas are taken against, 0 before the first one
+uint64_t snapshot_base_id = 0;
+std::string snapshot_base_path;
+uint32_t snapshot_delta_count = 0;
+
+bool snapshot_set_path(const char* spec) {
+  snapshot_path = spec;
+  size_t sep = snapshot_path.rfind(",incremental");
+  if (sep != std::string::npos && sep + strlen(",incremental") == snapshot_path.size()) {
+    snapshot_incremental = true;
+    snapshot_path.resize(sep);
+  }
+  return !snapshot_path.empty();
+}
+
+// a delta holds the device state and the pages written since its base, and names the base by path and id
+bool snapshot_write(const char* path, bool delta) {
+  std::vector<uint8_t> state;
+  size_t start;
+  if (delta) {
+    start = snap_begin(state, "base");
+    snap_put(state, snapshot_base_path.c_str(), snapshot_base_path.size());
+    snap_end(state, start);
+  }
+  start = snap_begin(state, "harts");
+  snap_put(state, hartlist, MACH_HART_COUNT * sizeof(HartState));
+  snap_end(state, start);
+  start = snap_begin(state, "aclint");
+  aclint_save(state);
+  snap_end(state, start);
+  start = snap_begin(state, "plic");
+  plic_save(state);
+  snap_end(state, start);
+  start = snap_begin(state, "imsic");
+  imsic_save(state);
+  snap_end(state, start);
+  start = snap_begin(state, "aplic");
+  aplic_save(state);
+  snap_end(state, start);
+  start = snap_begin(state, "uart");
+  uart_save(state);
+  snap_end(state, start);
+  start = snap_begin(state, "dtb");
+  snap_put(state, dtb_buf, MAX_DTB_SIZE);
+  snap_end(state, start);
+  start = snap_begin(state, "virtio");
+  if (!virtio_save(state)) return false;
+  snap_end(state, start);
+  // from here on the devices are locked and the harts paused, nothing writes to RAM
+  if (delta) {
+    start = snap_begin(state, "dirty");
+    for (uint8_t i = 0; i < ram_bank_count; i++) {
+      snap_put(state, ram_banks[i].dirty, snap_bitmap_words(ram_banks[i]) * sizeof(uint64_t));
+    }
+    snap_end(state, start);
+  }
+
+  snapshot_header header = {};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.hart_count = MACH_HART_COUNT;
+  header.bank_count = ram_bank_count;
+  header.flags = delta ? SNAPSHOT_F_DELTA : 0;
+  header.base_id = delta ? snapshot_base_id : 0;
+  header.state_len = state.size();
+  uint64_t file_len = (sizeof(header) + state.size() + SNAPSHOT_RAM_ALIGN - 1) & ~(SNAPSHOT_RAM_ALIGN - 1);
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    header.bank_base[i] = ram_banks[i].base;
+    header.bank_size[i] = ram_banks[i].size;
+    header.bank_file_offset[i] = file_len;
+    file_len += (ram_banks[i].size + SNAPSHOT_RAM_ALIGN - 1) & ~(SNAPSHOT_RAM_ALIGN - 1);
+  }
+
+  // a restored machine may still map the old file, so the new one replaces it only once it is complete
+  std::string tmp_path = std::string(path) + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool ok = fd >= 0 && getrandom(&header.id, sizeof(header.id), 0) == sizeof(header.id);
+  ok = ok && snap_pwrite(fd, (const uint8_t*)&header, sizeof(header), 0);
+  ok = ok && snap_pwrite(fd, state.data(), state.size(), sizeof(header));
+  for (uint8_t i = 0; ok && i < ram_bank_count; i++) {
+    ok = snap_write_ram(fd, ram_banks[i], header.bank_file_offset[i], delta ? ram_banks[i].dirty : nullptr);
+  }
+  // a new base starts the dirty pages over, while still nothing can write to RAM
+  if (ok && snapshot_incremental && !delta) mem_dirty_reset();
+  virtio_save_done();
+  ok = ok && !ftruncate(fd, file_len);
+  if (fd >= 0) close(fd);
+  ok = ok && !rename(tmp_path.c_str(), path);
+  if (!ok) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  if (!delta) snapshot_base_id = header.id;
+  return true;
+}
+
+std::string snapshot_take() {
+  if (!snapshot_incremental || !snapshot_base_id) {
+    if (!snapshot_write(snapshot_path.c_str(), false)) return "";
+    if (snapshot_incremental) {
+      // deltas may be restored from another directory
+      char* base = realpath(snapshot_path.c_str(), nullptr);
+      snapshot_base_path = base ? base : snapshot_path;
+      free(base);
+    }
+    return snapshot_path;
+  }
+  std::string path = snapshot_path + "." + std::to_string(snapshot_delta_count + 1);
+  if (!snapshot_write(path.c_str(), true)) return "";
+  snapshot_delta_count++;
+  return path;
+}
+
+// maps a bank copy-on-write from the file, or reads it in where RAM has to stay anonymous or shared memory
+bool snap_load_ram(int fd, Ram_Bank& bank, uint64_t file_offset) {
+  if (!mem_can_map_files()) return snap_pread(fd, bank.host, bank.size, file_offset);
+  uint64_t len = (bank.size + mem_page_size - 1) & ~(mem_page_size - 1);
+  void* ptr = mmap(bank.host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_offset);
+  mem_file_mapped = true;
+  return ptr == bank.host;
+}
+
+// reads the pages of a delta over the RAM of its base
+bool snap_load_delta_ram(int fd, Ram_Bank& bank, uint64_t file_offset, snap_reader& dirty) {
+  std::vector<uint64_t> pages(snap_bitmap_words(bank));
+  if (!snap_get(dirty, pages.data(), pages.size() * sizeof(uint64_t))) return false;
+  uint64_t run_start = 0;
+  bool in_run = false;
+  for (uint64_t offset = 0; offset <= bank.size; offset += SNAPSHOT_PAGE) {
+    bool skip = offset == bank.size || !snap_page_selected(pages.data(), offset / SNAPSHOT_PAGE);
+    if (!skip && !in_run) {
+      run_start = offset;
+      in_run = true;
+    } else if (skip && in_run) {
+      uint64_t end = std::min(offset, bank.size);
+      if (!snap_pread(fd, bank.host + run_start, end - run_start, file_offset + run_start)) return false;
+      in_run = false;
+    }
+  }
+  return true;
+}
+
+// reads the header and device state, and checks the snapshot fits this machine
+int snap_open(const char* path, snapshot_header& header, std::vector<uint8_t>& state) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  bool ok = snap_pread(fd, (uint8_t*)&header, sizeof(header), 0);
+  ok = ok && !memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) && header.version == SNAPSHOT_VERSION;
+  // the machine has to be set up the same way as the one that was saved
+  ok = ok && header.hart_count == MACH_HART_COUNT && header.bank_count == ram_bank_count;
+  for (uint8_t i = 0; ok && i < ram_bank_count; i++) {
+    ok = header.bank_base[i] == ram_banks[i].base && header.bank_size[i] == ram_banks[i].size;
+  }
+  struct stat st;
+  ok = ok && !fstat(fd, &st) && header.state_len < (uint64_t)st.st_size;
+  if (ok) {
+    state.resize(header.state_len);
+    ok = snap_pread(fd, state.data(), state.size(), sizeof(header));
+  }
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool snapshot_restore(const char* path) {
+  snapshot_header header;
+  std::vector<uint8_t> state;
+  int fd = snap_open(path, header, state);
+  if (fd < 0) return false;
+  snap_reader in = {state.data(), state.data() + state.size()};
+  snap_reader section;
+  bool ok = true;
+  if (header.flags & SNAPSHOT_F_DELTA) {
+    // RAM comes from the base, with the pages of the delta on top
+    snapshot_header base_header;
+    std::vector<uint8_t> base_state;
+    ok = snap_section(in, "base", section);
+    std::string base_path((const char*)section.pos, section.end - section.pos);
+    int base_fd = ok ? snap_open(base_path.c_str(), base_header, base_state) : -1;
+    ok = base_fd >= 0 && base_header.id == header.base_id && !(base_header.flags & SNAPSHOT_F_DELTA);
+    for (uint8_t i = 0; ok && i < ram_bank_count; i++) {
+      ok = snap_load_ram(base_fd, ram_banks[i], base_header.bank_file_offset[i]);
+    }
+    if (base_fd >= 0) close(base_fd);
+  } else {
+    for (uint8_t i = 0; ok && i < ram_bank_count; i++) {
+      ok = snap_load_ram(fd, ram_banks[i], header.bank_file_offset[i]);
+    }
+  }
+  // a fresh mapping has lost the NUMA binding of the old one
+  ok = ok && placement_bind_banks();
+  ok = ok && snap_section(in, "harts", section) && snap_get(section, hartlist, MACH_HART_COUNT * sizeof(HartState));
+  for (uint16_t i = 0; i < MACH_HART_COUNT; i++) {
+    hart_recheck(hartlist[i]);
+  }
+  ok = ok && snap_section(in, "aclint", section) && aclint_restore(section);
+  ok = ok && snap_section(in, "plic", section) && plic_restore(section);
+  ok = ok && snap_section(in, "imsic", section) && imsic_restore(section);
+  ok = ok && snap_section(in, "aplic", section) && aplic_restore(section);
+  ok = ok && snap_section(in, "uart", section) && uart_restore(section);
+  ok = ok && snap_section(in, "dtb", section) && snap_get(section, dtb_buf, MAX_DTB_SIZE);
+  // the devices may start using guest memory and interrupts right away, so RAM has to be complete first
+  snap_reader virtio_section;
+  ok = ok && snap_section(in, "virtio", virtio_section);
+  if (ok && (header.flags & SNAPSHOT_F_DELTA)) {
+    ok = snap_section(in, "dirty", section);
+    for (uint8_t i = 0; ok && i < ram_bank_count; i++) {
+      ok = snap_load_delta_ram(fd, ram_banks[i], header.bank_file_offset[i], section);
+    }
+  }
+  // the mappings keep the files alive
+  close(fd);
+  return ok && virtio_restore(virtio_section);
+}
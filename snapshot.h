@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// full machine snapshots: harts, ACLINT, PLIC, UART, the virtio transports and guest RAM in one file
+// RAM is stored page aligned after the device state, so a restore can map it copy-on-write straight from the file
+// and only the pages the guest touches afterwards are ever read
+// an incremental snapshot names a full one, and restoring it maps that one's RAM and reads its own pages on top
+
+// device state is serialised into a byte vector, and read back through a reader over one section
+struct snap_reader {
+  const uint8_t* pos;
+  const uint8_t* end;
+};
+void snap_put(std::vector<uint8_t>& out, const void* src, size_t len);
+// returns false if the section is too short
+bool snap_get(snap_reader& in, void* dst, size_t len);
+
+// spec is "<path>[,incremental]"
+// when incremental, the first snapshot is a full one at <path>, and each later one is <path>.<n>,
+// holding only the RAM pages written since that first one
+bool snapshot_set_path(const char* spec);
+// the harts must be paused; returns the path written to, or an empty string if the snapshot could not be written
+std::string snapshot_take();
+// called after hw_init and before the harts start, in place of loading firmware, kernel, dtb and initrd
+// the hart count and RAM banks must match the ones the snapshot was taken with
+bool snapshot_restore(const char* path);
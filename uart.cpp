@@ -4,12 +4,16 @@
 
 #include <cstdint>
 #include <cstring>
+#include <string>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
 #include "io.h"
+#include "hart_sched.h"
 #include "plic.h"
+#include "replay.h"
+#include "virtio_console.h"
 
 #define IBUF_SIZE 16
 // circular buffer for input
@@ -34,20 +38,46 @@ bool uart_end = false;
 
 char output[IBUF_SIZE];
 size_t tx_offset = 0;
+// with -D the guest sees each transmit finish at once, and only the text waits here for the pty
+std::string tx_queue;
 
 void uart_init() {
   read_ptr = input_buffer;
   write_ptr = input_buffer;
   regs[2] = 0b01;
   regs[5] = 0b01100000;
+  uart_start();
+}
+
+void uart_start() {
+  uart_end = false;
   uart_thread = std::thread(uart_loop);
 }
 
+void uart_stop() {
+  if (!uart_thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(uart_mtx);
+    uart_end = true;
+    uart_cv.notify_all();
+  }
+  uart_thread.join();
+}
+
 void uart_loop() {
   std::unique_lock<std::mutex> uart_lock (uart_mtx);
   while (true) {
     uart_cv.wait(uart_lock, []{return tx_required || uart_end;});
     if (uart_end) break;
+    if (sched_deterministic) {
+      std::string text = std::move(tx_queue);
+      tx_queue.clear();
+      tx_required = false;
+      uart_lock.unlock();
+      pty_print(text.c_str());
+      uart_lock.lock();
+      continue;
+    }
     if (output[tx_offset] == 0xa) { // last character is a line feed
       output[tx_offset] = 0;
       pty_print(output);
@@ -65,10 +95,32 @@ void uart_loop() {
   }
 }
 
+// finishes the transmit on the hart thread, so the guest sees it at the same instruction on every run
+void uart_tx_det() {
+  {
+    std::lock_guard<std::mutex> uart_lock(uart_mtx);
+    tx_queue.append(output, tx_offset);
+    tx_required = true;
+    uart_cv.notify_one();
+  }
+  tx_offset = 0;
+  memset(output, 0, IBUF_SIZE);
+  regs[5] |= 0b1100000;
+  if (regs[1] & 0b10) { // THR empty interrupt enabled
+    uart_sendint(0b0010);
+  }
+}
+
 void uart_uninit() {
-  uart_end = true;
-  uart_cv.notify_all();
-  uart_thread.join();
+  uart_stop();
+}
+
+int uart_getc() {
+  if (pending_in == 0) return -1;
+  uint8_t ch = *read_ptr++;
+  if ((read_ptr - input_buffer) > IBUF_SIZE) read_ptr = input_buffer;
+  pending_in--;
+  return ch;
 }
 
 void* uart_r(uint64_t offset, [[maybe_unused]] uint8_t len) {
@@ -77,13 +129,8 @@ void* uart_r(uint64_t offset, [[maybe_unused]] uint8_t len) {
       if (dlab) {
         output_byte = ls;
       } else {
-        if (pending_in > 0) {
-          output_byte = *read_ptr++;
-          if ((read_ptr - input_buffer) > IBUF_SIZE) read_ptr = input_buffer;
-          pending_in--;
-        } else {
-          output_byte = 0;
-        }
+        int ch = uart_getc();
+        output_byte = ch < 0 ? 0 : ch;
       }
       break;
     case 1:
@@ -117,13 +164,15 @@ void uart_w(uint64_t offset, void* dataptr, [[maybe_unused]] uint8_t len) {
     if ((regs[2] & 0xF) == 0b0010) {
       uart_clearint();
     }
-    while (tx_required); // spinlock to prevent race condition on output
+    while (tx_required && !sched_deterministic); // spinlock to prevent race condition on output
     char data_char = *(char*)dataptr;
     output[tx_offset] = data_char;
     tx_offset++;
     // transmitter buffer not empty
     regs[5] &= ~(0b1000000);
-    if (tx_offset >= (IBUF_SIZE - 1) || data_char == 0xa) {
+    if (sched_deterministic && (tx_offset >= (IBUF_SIZE - 1) || data_char == 0xa)) {
+      uart_tx_det();
+    } else if (tx_offset >= (IBUF_SIZE - 1) || data_char == 0xa) {
       // THR full
       regs[5] &= ~(0b0100000);
       // trigger printing
@@ -173,7 +222,14 @@ void uart_clearint() {
 uint16_t uart_timeout = 0;
 // takes in one character from console and monitors interrupts
 void uart_chk() {
-  char ch = pty_getc();
+  // once the guest uses the virtio console, it gets the console input instead
+  // a replay gets what the recording got, from whichever owner the console had then
+  char ch = -1;
+  if (replay_replaying) {
+    ch = replay_getc();
+  } else if (!virtio_console_owns_pty()) {
+    ch = replay_recording ? replay_getc() : pty_getc();
+  }
   if (ch != -1) {
     *write_ptr = ch;
     write_ptr++;
@@ -201,9 +257,23 @@ void uart_chk() {
     if (regs[1] & 0b10) { // THR empty interrupt enabled
       uart_sendint(0b0010);
     }
+  } else if (sched_deterministic) {
+    uart_tx_det();
   } else if (tx_required == false) {
     std::lock_guard<std::mutex> uart_lock(uart_mtx);
     tx_required = true;
     uart_cv.notify_one();
   }
 }
+
+void uart_save(std::vector<uint8_t>& out) {
+  snap_put(out, regs, sizeof(regs));
+  snap_put(out, &fifo_trigger_lvl, sizeof(fifo_trigger_lvl));
+}
+
+bool uart_restore(snap_reader& in) {
+  if (!snap_get(in, regs, sizeof(regs)) || !snap_get(in, &fifo_trigger_lvl, sizeof(fifo_trigger_lvl))) return false;
+  dlab = regs[3] & (0b1 << 7);
+  regs[5] |= 0b1100000; // the transmitter starts out empty
+  return true;
+}
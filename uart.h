@@ -1,14 +1,28 @@
 #pragma once
 #include <cstdint>
+#include <vector>
+
+#include "snapshot.h"
 
 void uart_init();
 void uart_loop();
 void uart_uninit();
+// stop and restart the worker thread, leaving the device state alone
+void uart_start();
+void uart_stop();
 
 void* uart_r(uint64_t offset, uint8_t len);
 void uart_w(uint64_t offset, void* dataptr, uint8_t len);
 
+// takes the next received character out of the input buffer, or returns -1 if it is empty
+// for the SBI console, so it gets the same input as the UART, recorded with -r
+int uart_getc();
+
 void uart_sendint(uint8_t code);
 void uart_clearint();
 
 void uart_chk();
+
+// the registers only, characters still in the FIFOs are dropped
+void uart_save(std::vector<uint8_t>& out);
+bool uart_restore(snap_reader& in);
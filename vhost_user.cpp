@@ -0,0 +1,392 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "io.h"
+#include "mem.h"
+#include "virtio_common.h"
+#include "vhost_user.h"
+
+enum vhost_user_req : uint32_t {
+  VHOST_USER_GET_FEATURES = 1, VHOST_USER_SET_FEATURES = 2, VHOST_USER_SET_OWNER = 3,
+  VHOST_USER_SET_MEM_TABLE = 5, VHOST_USER_SET_VRING_NUM = 8, VHOST_USER_SET_VRING_ADDR = 9,
+  VHOST_USER_SET_VRING_BASE = 10, VHOST_USER_GET_VRING_BASE = 11, VHOST_USER_SET_VRING_KICK = 12,
+  VHOST_USER_SET_VRING_CALL = 13, VHOST_USER_GET_PROTOCOL_FEATURES = 15, VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+  VHOST_USER_GET_QUEUE_NUM = 17, VHOST_USER_SET_VRING_ENABLE = 18, VHOST_USER_GET_CONFIG = 24,
+  VHOST_USER_SET_CONFIG = 25
+};
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_REPLY 0x4
+
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+#define VHOST_USER_PROTOCOL_F_MQ (1ULL << 0)
+#define VHOST_USER_PROTOCOL_F_CONFIG (1ULL << 9)
+
+// device features we cannot pass through: we only set up split rings, and have no IOMMU or dirty logging
+#define VHOST_USER_FEAT_MASK ~((1ULL << 29) | (1ULL << 30) | (1ULL << 33) | (1ULL << 34))
+
+#define VHOST_USER_MAX_CONFIG 256
+
+struct __attribute__ ((packed)) vhost_user_hdr {
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size;
+};
+
+struct __attribute__ ((packed)) vhost_user_region {
+  uint64_t guest_phys_addr;
+  uint64_t memory_size;
+  uint64_t userspace_addr;
+  uint64_t mmap_offset;
+};
+
+struct __attribute__ ((packed)) vhost_user_mem_table {
+  uint32_t nregions;
+  uint32_t padding;
+  vhost_user_region regions[MAX_RAM_BANKS];
+};
+
+struct __attribute__ ((packed)) vhost_vring_state {
+  uint32_t index;
+  uint32_t num;
+};
+
+struct __attribute__ ((packed)) vhost_vring_addr {
+  uint32_t index;
+  uint32_t flags;
+  uint64_t desc;
+  uint64_t used;
+  uint64_t avail;
+  uint64_t log;
+};
+
+struct __attribute__ ((packed)) vhost_user_config {
+  uint32_t offset;
+  uint32_t size;
+  uint32_t flags;
+  uint8_t region[VHOST_USER_MAX_CONFIG];
+};
+
+struct vhost_user_dev {
+  std::string path;
+  int sock = -1;
+  // one request at a time, they come from the hart threads through status and config writes
+  std::mutex sock_mtx;
+  uint64_t features = 0; // as offered by the backend
+  uint64_t protocol_features = 0; // as agreed with the backend
+  bool running = false; // the rings have been handed to the backend
+  bool started[VIRTIO_MAX_QUEUES] = {}; // the rings the backend was given, only those are stopped again
+  int kick_fd[VIRTIO_MAX_QUEUES];
+  int call_fd[VIRTIO_MAX_QUEUES];
+  virtio_mmio_dev dev;
+  uint8_t config[VHOST_USER_MAX_CONFIG];
+};
+
+vhost_user_dev vhost_devs[VHOST_USER_MAX_DEVS];
+uint16_t vhost_dev_count = 0;
+
+std::thread vhost_thread;
+std::atomic<bool> vhost_end = false;
+int vhost_stop_fd = -1;
+
+bool vhost_user_add_dev(const char* spec) {
+  if (vhost_dev_count >= VHOST_USER_MAX_DEVS) return false;
+  const char* sep = strchr(spec, ':');
+  if (!sep) return false;
+  vhost_user_dev& vdev = vhost_devs[vhost_dev_count];
+  std::string type(spec, sep - spec);
+  uint32_t deviceid;
+  // the backend may raise the queue count later if it supports multiqueue
+  uint16_t queue_count = 1;
+  if (type == "net") {
+    deviceid = 1;
+    queue_count = 2;
+  } else if (type == "blk") {
+    deviceid = 2;
+  } else {
+    char* end;
+    deviceid = strtoul(type.c_str(), &end, 0);
+    if (*end || type.empty() || deviceid == 0) return false;
+  }
+  vdev.path = sep + 1;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (vdev.path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, vdev.path.c_str());
+  vdev.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (vdev.sock < 0) return false;
+  if (connect(vdev.sock, (sockaddr*)&addr, sizeof(addr))) {
+    close(vdev.sock);
+    vdev.sock = -1;
+    return false;
+  }
+  vdev.dev.deviceid = deviceid;
+  vdev.dev.queue_count = queue_count;
+  // the backend maps guest RAM from the memfd
+  mem_opts |= MEM_OPT_MEMFD;
+  vhost_dev_count++;
+  return true;
+}
+
+// the following talk to the backend, with sock_mtx held
+
+bool vhost_user_send(vhost_user_dev& vdev, uint32_t request, const void* payload, uint32_t size, int fd = -1) {
+  vhost_user_hdr hdr = {request, VHOST_USER_VERSION, size};
+  iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void*)payload, size}};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = size ? 2 : 1;
+  if (fd >= 0) {
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(vdev.sock, &msg, MSG_NOSIGNAL) == (ssize_t)(sizeof(hdr) + size);
+}
+
+// waits for the reply to request and copies up to size bytes of it, returns the reply size or -1
+int64_t vhost_user_recv(vhost_user_dev& vdev, uint32_t request, void* payload, uint32_t size) {
+  vhost_user_hdr hdr;
+  if (recv(vdev.sock, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)) return -1;
+  if (hdr.request != request || !(hdr.flags & VHOST_USER_REPLY)) return -1;
+  uint8_t buf[sizeof(vhost_user_config)];
+  if (hdr.size > sizeof(buf) || recv(vdev.sock, buf, hdr.size, MSG_WAITALL) != hdr.size) return -1;
+  memcpy(payload, buf, std::min(size, hdr.size));
+  return hdr.size;
+}
+
+bool vhost_user_get_u64(vhost_user_dev& vdev, uint32_t request, uint64_t& value) {
+  return vhost_user_send(vdev, request, nullptr, 0) && vhost_user_recv(vdev, request, &value, sizeof(value)) == sizeof(value);
+}
+
+bool vhost_user_set_u64(vhost_user_dev& vdev, uint32_t request, uint64_t value, int fd = -1) {
+  return vhost_user_send(vdev, request, &value, sizeof(value), fd);
+}
+
+bool vhost_user_set_state(vhost_user_dev& vdev, uint32_t request, uint32_t index, uint32_t num) {
+  vhost_vring_state state = {index, num};
+  return vhost_user_send(vdev, request, &state, sizeof(state));
+}
+
+bool vhost_user_setup(vhost_user_dev& vdev) {
+  if (!vhost_user_send(vdev, VHOST_USER_SET_OWNER, nullptr, 0)) return false;
+  if (!vhost_user_get_u64(vdev, VHOST_USER_GET_FEATURES, vdev.features)) return false;
+  if (vdev.features & VHOST_USER_F_PROTOCOL_FEATURES) {
+    uint64_t offered;
+    if (!vhost_user_get_u64(vdev, VHOST_USER_GET_PROTOCOL_FEATURES, offered)) return false;
+    vdev.protocol_features = offered & (VHOST_USER_PROTOCOL_F_MQ | VHOST_USER_PROTOCOL_F_CONFIG);
+    if (!vhost_user_set_u64(vdev, VHOST_USER_SET_PROTOCOL_FEATURES, vdev.protocol_features)) return false;
+  }
+  if (vdev.protocol_features & VHOST_USER_PROTOCOL_F_MQ) {
+    uint64_t queue_num;
+    if (!vhost_user_get_u64(vdev, VHOST_USER_GET_QUEUE_NUM, queue_num)) return false;
+    vdev.dev.queue_count = std::clamp<uint64_t>(queue_num, vdev.dev.queue_count, VIRTIO_MAX_QUEUES);
+  }
+  vdev.dev.config_len = 0;
+  if (vdev.protocol_features & VHOST_USER_PROTOCOL_F_CONFIG) {
+    vhost_user_config cfg = {0, VHOST_USER_MAX_CONFIG, 0, {}};
+    if (!vhost_user_send(vdev, VHOST_USER_GET_CONFIG, &cfg, sizeof(cfg))) return false;
+    int64_t reply_size = vhost_user_recv(vdev, VHOST_USER_GET_CONFIG, &cfg, sizeof(cfg));
+    if (reply_size < 12) return false;
+    vdev.dev.config_len = std::min<uint32_t>(cfg.size, VHOST_USER_MAX_CONFIG);
+    memcpy(vdev.config, cfg.region, vdev.dev.config_len);
+  }
+  // one region per RAM bank, at the same address it has in this process, all backed by the one memfd
+  vhost_user_mem_table table = {ram_bank_count, 0, {}};
+  for (uint8_t i = 0; i < ram_bank_count; i++) {
+    table.regions[i] = {ram_banks[i].base, ram_banks[i].size, (uint64_t)ram_banks[i].host, ram_banks[i].offset};
+  }
+  uint32_t table_len = 8 + ram_bank_count * sizeof(vhost_user_region);
+  return vhost_user_send(vdev, VHOST_USER_SET_MEM_TABLE, &table, table_len, main_mem_fd);
+}
+
+// hands the rings the driver has set up to the backend, once the driver is ready
+void vhost_user_start(vhost_user_dev& vdev) {
+  std::lock_guard<std::mutex> lock(vdev.sock_mtx);
+  if (vdev.running) return;
+  bool ok = vhost_user_set_u64(vdev, VHOST_USER_SET_FEATURES, vdev.dev.drifeat | (vdev.features & VHOST_USER_F_PROTOCOL_FEATURES));
+  for (uint16_t i = 0; ok && i < vdev.dev.queue_count; i++) {
+    virtio_queue_state q;
+    {
+      std::lock_guard<std::mutex> dev_lock(vdev.dev.mtx);
+      q = vdev.dev.queues[i];
+    }
+    if (!q.ready || !q.num) continue;
+    // ring addresses are given as addresses in this process, the backend translates them through the memory table
+    vhost_vring_addr addr = {i, 0,
+      (uint64_t)phy_mem_ptr(q.desc, sizeof(virtq_desc) * q.num),
+      (uint64_t)phy_mem_ptr(q.device, 4 + 8 * q.num),
+      (uint64_t)phy_mem_ptr(q.driver, 4 + 2 * q.num), 0};
+    if (!addr.desc || !addr.used || !addr.avail) continue;
+    ok = vhost_user_set_state(vdev, VHOST_USER_SET_VRING_NUM, i, q.num)
+      && vhost_user_send(vdev, VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr))
+      && vhost_user_set_state(vdev, VHOST_USER_SET_VRING_BASE, i, 0)
+      && vhost_user_set_u64(vdev, VHOST_USER_SET_VRING_KICK, i, vdev.kick_fd[i]);
+    // the backend starts a ring once it has its kick
+    vdev.started[i] = ok;
+    ok = ok && vhost_user_set_u64(vdev, VHOST_USER_SET_VRING_CALL, i, vdev.call_fd[i]);
+    // with protocol features, rings start disabled
+    if (ok && (vdev.features & VHOST_USER_F_PROTOCOL_FEATURES)) ok = vhost_user_set_state(vdev, VHOST_USER_SET_VRING_ENABLE, i, 1);
+  }
+  if (!ok) {
+    dbgerr_print("vhost-user backend went away: ");
+    dbgerr_print(vdev.path.c_str());
+    dbgerr_endl();
+    return;
+  }
+  vdev.running = true;
+}
+
+// stops the backend from touching the rings, it replies once it is done with them
+// rings that were never started are left alone, some backends take stopping one as a protocol error
+void vhost_user_stop(vhost_user_dev& vdev) {
+  std::lock_guard<std::mutex> lock(vdev.sock_mtx);
+  vdev.running = false;
+  for (uint16_t i = 0; i < vdev.dev.queue_count; i++) {
+    if (!vdev.started[i]) continue;
+    vdev.started[i] = false;
+    vhost_vring_state state = {i, 0};
+    if (!vhost_user_send(vdev, VHOST_USER_GET_VRING_BASE, &state, sizeof(state))) return;
+    if (vhost_user_recv(vdev, VHOST_USER_GET_VRING_BASE, &state, sizeof(state)) < 0) return;
+  }
+}
+
+void vhost_user_config_write(vhost_user_dev& vdev, uint64_t offset, uint8_t len) {
+  std::lock_guard<std::mutex> lock(vdev.sock_mtx);
+  if (!(vdev.protocol_features & VHOST_USER_PROTOCOL_F_CONFIG)) return;
+  vhost_user_config cfg = {(uint32_t)offset, len, 0, {}};
+  memcpy(cfg.region, vdev.config + offset, len);
+  vhost_user_send(vdev, VHOST_USER_SET_CONFIG, &cfg, 12 + len);
+}
+
+// transport callbacks only get a queue number, so each slot gets its own set
+
+template <int N> void vhost_user_notify(uint16_t queue) {
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t ret = write(vhost_devs[N].kick_fd[queue], &one, sizeof(one));
+}
+template <int N> void vhost_user_status(uint32_t status) {
+  if (status & VIRTIO_STATUS_DRIVER_OK) vhost_user_start(vhost_devs[N]);
+}
+template <int N> void vhost_user_reset() {
+  vhost_user_stop(vhost_devs[N]);
+}
+template <int N> void vhost_user_config_w(uint64_t offset, uint8_t len) {
+  vhost_user_config_write(vhost_devs[N], offset, len);
+}
+
+void (*const vhost_user_notify_fns[VHOST_USER_MAX_DEVS]) (uint16_t) = {vhost_user_notify<0>, vhost_user_notify<1>};
+void (*const vhost_user_status_fns[VHOST_USER_MAX_DEVS]) (uint32_t) = {vhost_user_status<0>, vhost_user_status<1>};
+void (*const vhost_user_reset_fns[VHOST_USER_MAX_DEVS]) () = {vhost_user_reset<0>, vhost_user_reset<1>};
+void (*const vhost_user_config_w_fns[VHOST_USER_MAX_DEVS]) (uint64_t, uint8_t) = {vhost_user_config_w<0>, vhost_user_config_w<1>};
+
+// the rings are processed by the backend, whose state cannot be captured
+bool vhost_user_save([[maybe_unused]] std::vector<uint8_t>& out) {
+  return false;
+}
+
+void vhost_user_init() {
+  if (!vhost_dev_count) return;
+  for (uint16_t n = 0; n < vhost_dev_count; n++) {
+    vhost_user_dev& vdev = vhost_devs[n];
+    if (!vhost_user_setup(vdev)) {
+      dbgerr_print("vhost-user setup failed: ");
+      dbgerr_print(vdev.path.c_str());
+      dbgerr_endl();
+      exit(1);
+    }
+    vdev.dev.devfeat = (vdev.features & VHOST_USER_FEAT_MASK) | VIRTIO_F_VERSION_1;
+    vdev.dev.irq = 7 + n;
+    vdev.dev.config = vdev.config;
+    vdev.dev.notify = vhost_user_notify_fns[n];
+    vdev.dev.status_w = vhost_user_status_fns[n];
+    vdev.dev.reset = vhost_user_reset_fns[n];
+    vdev.dev.config_w = vhost_user_config_w_fns[n];
+    vdev.dev.save = vhost_user_save;
+    virtio_mmio_dev_reset(vdev.dev);
+    virtio_mmio_register(vdev.dev);
+    for (uint16_t i = 0; i < vdev.dev.queue_count; i++) {
+      vdev.kick_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      vdev.call_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+  }
+  vhost_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  vhost_thread = std::thread(vhost_user_loop);
+}
+
+void vhost_user_uninit() {
+  if (!vhost_dev_count) return;
+  vhost_end = true;
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t ret = write(vhost_stop_fd, &one, sizeof(one));
+  vhost_thread.join();
+  for (uint16_t n = 0; n < vhost_dev_count; n++) {
+    vhost_user_dev& vdev = vhost_devs[n];
+    vhost_user_stop(vdev);
+    close(vdev.sock);
+    for (uint16_t i = 0; i < vdev.dev.queue_count; i++) {
+      close(vdev.kick_fd[i]);
+      close(vdev.call_fd[i]);
+    }
+  }
+  close(vhost_stop_fd);
+}
+
+// turns call eventfd signals from the backends into device interrupts
+void vhost_user_loop() {
+  pollfd fds[1 + VHOST_USER_MAX_DEVS * VIRTIO_MAX_QUEUES];
+  uint16_t fd_dev[1 + VHOST_USER_MAX_DEVS * VIRTIO_MAX_QUEUES];
+  nfds_t nfds = 0;
+  fds[nfds++] = {vhost_stop_fd, POLLIN, 0};
+  for (uint16_t n = 0; n < vhost_dev_count; n++) {
+    for (uint16_t i = 0; i < vhost_devs[n].dev.queue_count; i++) {
+      fd_dev[nfds] = n;
+      fds[nfds++] = {vhost_devs[n].call_fd[i], POLLIN, 0};
+    }
+  }
+  while (!vhost_end) {
+    if (poll(fds, nfds, -1) < 0) continue;
+    bool signalled[VHOST_USER_MAX_DEVS] = {};
+    for (nfds_t i = 1; i < nfds; i++) {
+      if (!fds[i].revents) continue;
+      uint64_t calls;
+      [[maybe_unused]] ssize_t ret = read(fds[i].fd, &calls, sizeof(calls));
+      signalled[fd_dev[i]] = true;
+    }
+    // one interrupt per device covers all of its queues
+    for (uint16_t n = 0; n < vhost_dev_count; n++) {
+      if (signalled[n]) virtio_send_int(vhost_devs[n].dev);
+    }
+  }
+}
+
+void* vhost_user0_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vhost_devs[0].dev, offset, len);
+}
+void vhost_user0_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vhost_devs[0].dev, offset, dataptr, len);
+}
+void* vhost_user1_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vhost_devs[1].dev, offset, len);
+}
+void vhost_user1_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vhost_devs[1].dev, offset, dataptr, len);
+}
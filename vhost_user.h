@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+
+// virtio devices whose queues are processed by a separate backend process, over the vhost-user protocol
+// guest RAM is shared with the backend as a memfd, so the emulator only forwards queue setup,
+// kicks go straight from the hart thread to an eventfd the backend waits on,
+// and the backend signals used buffers through a call eventfd that is turned into the device interrupt
+
+#define VHOST_USER_MAX_DEVS 2
+
+// spec is "<type>:/path/to/socket", type is blk, net, or a virtio device id
+// the backend must already be listening on the socket; enables memfd backed RAM, must be called before mem_init
+bool vhost_user_add_dev(const char* spec);
+
+void vhost_user_init();
+void vhost_user_uninit();
+
+void vhost_user_loop();
+
+// one pair of memory map callbacks per device slot
+void* vhost_user0_r (uint64_t offset, uint8_t len);
+void vhost_user0_w (uint64_t offset, void* dataptr, uint8_t len);
+void* vhost_user1_r (uint64_t offset, uint8_t len);
+void vhost_user1_w (uint64_t offset, void* dataptr, uint8_t len);
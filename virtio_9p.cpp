@@ -0,0 +1,823 @@
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "constants.h"
+#include "virtio_common.h"
+#include "virtio_9p.h"
+
+#define VIRTIO_9P_MOUNT_TAG (1ULL << 0)
+
+// 9P2000.L message types, the reply is always type + 1
+enum p9_type : uint8_t {
+  TLERROR = 6, TSTATFS = 8, TLOPEN = 12, TLCREATE = 14, TSYMLINK = 16, TMKNOD = 18,
+  TRENAME = 20, TREADLINK = 22, TGETATTR = 24, TSETATTR = 26, TXATTRWALK = 30,
+  TREADDIR = 40, TFSYNC = 50, TLOCK = 52, TGETLOCK = 54, TLINK = 70, TMKDIR = 72,
+  TRENAMEAT = 74, TUNLINKAT = 76, TVERSION = 100, TAUTH = 102, TATTACH = 104,
+  TFLUSH = 108, TWALK = 110, TREAD = 116, TWRITE = 118, TCLUNK = 120, TREMOVE = 122
+};
+
+#define P9_HDR_SIZE 7 // size[4] type[1] tag[2]
+#define P9_QID_SIZE 13
+#define P9_MAX_WALK 16
+
+// Tsetattr valid bits
+#define P9_SETATTR_MODE 0x1
+#define P9_SETATTR_UID 0x2
+#define P9_SETATTR_GID 0x4
+#define P9_SETATTR_SIZE 0x8
+#define P9_SETATTR_ATIME 0x10
+#define P9_SETATTR_MTIME 0x20
+#define P9_SETATTR_ATIME_SET 0x80
+#define P9_SETATTR_MTIME_SET 0x100
+
+#define P9_GETATTR_BASIC 0x7ffULL
+
+struct p9_fid {
+  std::string path; // relative to the share root, empty for the root itself
+  int fd = -1;
+  DIR* dir = nullptr;
+};
+
+// little-endian reader over the copied request header
+struct p9_reader {
+  const uint8_t* buf;
+  size_t len;
+  size_t pos = 0;
+  bool err = false;
+
+  uint64_t uint(uint8_t size) {
+    if (pos + size > len) {
+      err = true;
+      return 0;
+    }
+    uint64_t value = 0;
+    memcpy(&value, buf + pos, size);
+    pos += size;
+    return value;
+  }
+  uint8_t u8() { return uint(1); }
+  uint16_t u16() { return uint(2); }
+  uint32_t u32() { return uint(4); }
+  uint64_t u64() { return uint(8); }
+  std::string str() {
+    uint16_t slen = u16();
+    if (err || pos + slen > len) {
+      err = true;
+      return "";
+    }
+    std::string s((const char*)buf + pos, slen);
+    pos += slen;
+    return s;
+  }
+};
+
+// reply builder, the header is filled in by p9_handle
+struct p9_writer {
+  std::vector<uint8_t> buf = std::vector<uint8_t>(P9_HDR_SIZE);
+
+  void uint(uint64_t value, uint8_t size) {
+    buf.insert(buf.end(), (uint8_t*)&value, (uint8_t*)&value + size);
+  }
+  void u8(uint8_t v) { uint(v, 1); }
+  void u16(uint16_t v) { uint(v, 2); }
+  void u32(uint32_t v) { uint(v, 4); }
+  void u64(uint64_t v) { uint(v, 8); }
+  void str(const std::string& s) {
+    u16(s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+  }
+  void qid(const struct stat& st) {
+    u8(S_ISDIR(st.st_mode) ? 0x80 : S_ISLNK(st.st_mode) ? 0x02 : 0x00);
+    u32(st.st_mtim.tv_sec ^ st.st_mtim.tv_nsec ^ st.st_size); // changes whenever the contents do
+    u64(st.st_ino);
+  }
+};
+
+std::string p9_root_path;
+std::string p9_tag = "hostshare";
+int p9_root_fd = -1;
+uint32_t p9_msize = P9_MAX_MSIZE;
+std::unordered_map<uint32_t, p9_fid> p9_fids;
+
+virtio_mmio_dev v9p_dev;
+virtio_9p_config v9pcfg;
+
+std::thread p9_thread;
+std::mutex p9_mtx;
+std::condition_variable p9_cv;
+bool p9_needs_io = false;
+bool p9_end = false;
+
+void virtio_9p_notify([[maybe_unused]] uint16_t queue) {
+  std::lock_guard<std::mutex> lock(p9_mtx);
+  p9_needs_io = true;
+  p9_cv.notify_one();
+}
+
+bool virtio_9p_set_share(const char* spec) {
+  const char* sep = strchr(spec, '=');
+  if (sep) {
+    p9_tag.assign(spec, sep - spec);
+    p9_root_path = sep + 1;
+  } else {
+    p9_root_path = spec;
+  }
+  if (p9_tag.empty() || p9_tag.size() > sizeof(v9pcfg.tag)) return false;
+  p9_root_fd = open(p9_root_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return p9_root_fd >= 0;
+}
+
+void p9_clunk_all() {
+  for (auto& [id, fid] : p9_fids) {
+    if (fid.dir) {
+      closedir(fid.dir); // also closes fd
+    } else if (fid.fd >= 0) {
+      close(fid.fd);
+    }
+  }
+  p9_fids.clear();
+}
+
+void virtio_9p_init() {
+  if (p9_root_fd < 0) return; // no share, the device shows up as a placeholder with id 0
+  v9p_dev.deviceid = 9;
+  v9p_dev.devfeat = VIRTIO_F_VERSION_1 | VIRTIO_9P_MOUNT_TAG;
+  v9p_dev.irq = 3;
+  v9p_dev.queue_count = 1;
+  v9p_dev.config = &v9pcfg;
+  v9p_dev.config_len = sizeof(uint16_t) + p9_tag.size();
+  v9p_dev.notify = virtio_9p_notify;
+  virtio_mmio_dev_reset(v9p_dev);
+  virtio_mmio_register(v9p_dev);
+
+  v9pcfg.tag_len = p9_tag.size();
+  memcpy(v9pcfg.tag, p9_tag.data(), p9_tag.size());
+
+  virtio_9p_start();
+}
+
+void virtio_9p_start() {
+  if (p9_root_fd < 0) return;
+  p9_end = false;
+  p9_needs_io = true; // requests queued in between
+  p9_thread = std::thread(virtio_9p_loop);
+}
+
+void virtio_9p_stop() {
+  if (!p9_thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(p9_mtx);
+    p9_end = true;
+    p9_cv.notify_all();
+  }
+  p9_thread.join();
+}
+
+void virtio_9p_uninit() {
+  if (p9_root_fd < 0) return;
+  virtio_9p_stop();
+  p9_clunk_all();
+  close(p9_root_fd);
+}
+
+// path helpers, all paths are relative to p9_root_fd
+// they are only ever resolved beneath it: a symlink or ".." that leads out of the share fails with EXDEV,
+// and a magic link of /proc with ELOOP, so a guest cannot get at host files through a symlink it made
+
+const char* p9_at(const std::string& path) {
+  return path.empty() ? "." : path.c_str();
+}
+
+bool p9_valid_name(const std::string& name) {
+  return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos;
+}
+
+std::string p9_join(const std::string& dir, const std::string& name) {
+  return dir.empty() ? name : dir + "/" + name;
+}
+
+// returns -1 and sets errno on failure, like openat
+int p9_open_beneath(const std::string& path, uint64_t flags, uint64_t mode = 0) {
+  open_how how = {};
+  how.flags = flags | O_CLOEXEC;
+  how.mode = mode;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  return syscall(SYS_openat2, p9_root_fd, p9_at(path), &how, sizeof(how));
+}
+
+// the directory a path is in, and the last component of the path
+// the *at calls given both only look up that one name in it, so whatever it is is not followed out of the share
+struct p9_parent {
+  int fd;
+  std::string name;
+  p9_parent(const std::string& path) {
+    size_t sep = path.rfind('/');
+    name = sep == std::string::npos ? path : path.substr(sep + 1);
+    fd = p9_open_beneath(sep == std::string::npos ? "" : path.substr(0, sep), O_PATH | O_DIRECTORY);
+  }
+  ~p9_parent() {
+    if (fd >= 0) close(fd);
+  }
+  const char* at() {
+    return p9_at(name);
+  }
+};
+
+int p9_lstat(const std::string& path, struct stat& st) {
+  p9_parent parent(path);
+  if (parent.fd < 0) return errno;
+  return fstatat(parent.fd, parent.at(), &st, AT_SYMLINK_NOFOLLOW) ? errno : 0;
+}
+
+// only pass through open flags that make sense on the host, numbering follows the Linux generic ABI
+int p9_open_flags(uint32_t flags) {
+  return (flags & (O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_DSYNC | O_DIRECTORY | O_NOFOLLOW | O_SYNC))
+    | O_CLOEXEC | O_NOCTTY;
+}
+
+// request handlers
+// each one parses the rest of the request from r and appends the reply body to w
+// a non-zero return value is an errno that is sent back as Rlerror instead
+
+int p9_version(p9_reader& r, p9_writer& w) {
+  uint32_t msize = r.u32();
+  std::string version = r.str();
+  p9_clunk_all(); // a new session starts
+  p9_msize = std::min<uint32_t>(msize, P9_MAX_MSIZE);
+  w.u32(p9_msize);
+  w.str(version == "9P2000.L" ? "9P2000.L" : "unknown");
+  return 0;
+}
+
+int p9_attach(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  r.u32(); // afid, no authentication
+  struct stat st;
+  if (int err = p9_lstat("", st)) return err;
+  p9_fids[fid] = p9_fid();
+  w.qid(st);
+  return 0;
+}
+
+int p9_walk(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint32_t newfid = r.u32();
+  uint16_t nwname = r.u16();
+  if (!p9_fids.count(fid)) return EBADF;
+  if (nwname > P9_MAX_WALK) return EINVAL;
+  if (newfid != fid && p9_fids.count(newfid)) return EBADF;
+
+  std::string path = p9_fids[fid].path;
+  std::vector<struct stat> qids;
+  for (uint16_t i = 0; i < nwname; i++) {
+    std::string name = r.str();
+    if (r.err) return EINVAL;
+    std::string next;
+    if (name == "..") {
+      size_t sep = path.rfind('/');
+      next = sep == std::string::npos ? "" : path.substr(0, sep); // never above the share root
+    } else if (p9_valid_name(name)) {
+      next = p9_join(path, name);
+    } else {
+      return ENOENT;
+    }
+    struct stat st;
+    if (int err = p9_lstat(next, st)) {
+      if (i == 0) return err;
+      break; // a partial walk only returns the qids that succeeded
+    }
+    qids.push_back(st);
+    path = next;
+  }
+  if (qids.size() == nwname) {
+    if (newfid == fid) {
+      // walking a fid in place drops whatever it had open
+      p9_fid& old = p9_fids[fid];
+      if (old.dir) {
+        closedir(old.dir);
+      } else if (old.fd >= 0) {
+        close(old.fd);
+      }
+    }
+    p9_fid walked;
+    walked.path = path;
+    p9_fids[newfid] = walked;
+  }
+  w.u16(qids.size());
+  for (struct stat& st : qids) w.qid(st);
+  return 0;
+}
+
+int p9_getattr(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  struct stat st;
+  if (int err = p9_lstat(p9_fids[fid].path, st)) return err;
+  w.u64(P9_GETATTR_BASIC);
+  w.qid(st);
+  w.u32(st.st_mode);
+  w.u32(st.st_uid);
+  w.u32(st.st_gid);
+  w.u64(st.st_nlink);
+  w.u64(st.st_rdev);
+  w.u64(st.st_size);
+  w.u64(st.st_blksize);
+  w.u64(st.st_blocks);
+  w.u64(st.st_atim.tv_sec);
+  w.u64(st.st_atim.tv_nsec);
+  w.u64(st.st_mtim.tv_sec);
+  w.u64(st.st_mtim.tv_nsec);
+  w.u64(st.st_ctim.tv_sec);
+  w.u64(st.st_ctim.tv_nsec);
+  w.u64(0); // btime
+  w.u64(0);
+  w.u64(0); // gen
+  w.u64(0); // data_version
+  return 0;
+}
+
+int p9_setattr(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint32_t valid = r.u32();
+  uint32_t mode = r.u32();
+  uint32_t uid = r.u32();
+  uint32_t gid = r.u32();
+  uint64_t size = r.u64();
+  timespec times[2];
+  times[0].tv_sec = r.u64();
+  times[0].tv_nsec = r.u64();
+  times[1].tv_sec = r.u64();
+  times[1].tv_nsec = r.u64();
+  if (!p9_fids.count(fid)) return EBADF;
+  p9_parent parent(p9_fids[fid].path);
+  if (parent.fd < 0) return errno;
+  const char* path = parent.at();
+
+  // a symlink has no mode of its own, and the target it points to is left alone
+  if ((valid & P9_SETATTR_MODE) && fchmodat(parent.fd, path, mode & 07777, AT_SYMLINK_NOFOLLOW)) return errno;
+  if (valid & (P9_SETATTR_UID | P9_SETATTR_GID)) {
+    if (fchownat(parent.fd, path, (valid & P9_SETATTR_UID) ? uid : -1, (valid & P9_SETATTR_GID) ? gid : -1, AT_SYMLINK_NOFOLLOW)) {
+      return errno;
+    }
+  }
+  if (valid & P9_SETATTR_SIZE) {
+    int fd = p9_fids[fid].fd;
+    if (fd < 0) {
+      fd = p9_open_beneath(p9_fids[fid].path, O_WRONLY | O_NOFOLLOW);
+      if (fd < 0) return errno;
+      int err = ftruncate(fd, size) ? errno : 0;
+      close(fd);
+      if (err) return err;
+    } else if (ftruncate(fd, size)) {
+      return errno;
+    }
+  }
+  if (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) {
+    if (!(valid & P9_SETATTR_ATIME)) times[0].tv_nsec = UTIME_OMIT;
+    else if (!(valid & P9_SETATTR_ATIME_SET)) times[0].tv_nsec = UTIME_NOW;
+    if (!(valid & P9_SETATTR_MTIME)) times[1].tv_nsec = UTIME_OMIT;
+    else if (!(valid & P9_SETATTR_MTIME_SET)) times[1].tv_nsec = UTIME_NOW;
+    if (utimensat(parent.fd, path, times, AT_SYMLINK_NOFOLLOW)) return errno;
+  }
+  return 0;
+}
+
+int p9_lopen(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint32_t flags = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  p9_fid& f = p9_fids[fid];
+  if (f.fd >= 0) return EBADF;
+  struct stat st;
+  if (int err = p9_lstat(f.path, st)) return err;
+
+  if (S_ISDIR(st.st_mode)) {
+    // it was not a symlink when looked at, and is not followed if it became one since
+    f.fd = p9_open_beneath(f.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (f.fd < 0) return errno;
+    f.dir = fdopendir(f.fd);
+    if (!f.dir) {
+      int err = errno;
+      close(f.fd);
+      f.fd = -1;
+      return err;
+    }
+  } else {
+    f.fd = p9_open_beneath(f.path, (p9_open_flags(flags) & ~(O_CREAT | O_EXCL)) | O_NOFOLLOW);
+    if (f.fd < 0) return errno;
+    // let the host read ahead aggressively, most guest reads here are sequential loads of binaries
+    posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  w.qid(st);
+  w.u32(p9_msize - (P9_HDR_SIZE + 4)); // iounit, one full message worth of data
+  return 0;
+}
+
+int p9_lcreate(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  std::string name = r.str();
+  uint32_t flags = r.u32();
+  uint32_t mode = r.u32();
+  r.u32(); // gid, files are owned by the emulator user
+  if (!p9_fids.count(fid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  p9_fid& f = p9_fids[fid];
+  if (f.fd >= 0) return EBADF;
+  std::string path = p9_join(f.path, name);
+  int fd = p9_open_beneath(path, p9_open_flags(flags) | O_CREAT | O_NOFOLLOW, mode & 07777);
+  if (fd < 0) return errno;
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  // the fid now refers to the new file
+  f.path = path;
+  f.fd = fd;
+  w.qid(st);
+  w.u32(p9_msize - (P9_HDR_SIZE + 4));
+  return 0;
+}
+
+// shared tail of Tmkdir, Tsymlink and Tmknod, reply with the qid of the new entry
+int p9_reply_new(const std::string& path, p9_writer& w) {
+  struct stat st;
+  if (int err = p9_lstat(path, st)) return err;
+  w.qid(st);
+  return 0;
+}
+
+int p9_mkdir(p9_reader& r, p9_writer& w) {
+  uint32_t dfid = r.u32();
+  std::string name = r.str();
+  uint32_t mode = r.u32();
+  if (!p9_fids.count(dfid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  std::string path = p9_join(p9_fids[dfid].path, name);
+  p9_parent parent(path);
+  if (parent.fd < 0) return errno;
+  if (mkdirat(parent.fd, parent.at(), mode & 07777)) return errno;
+  return p9_reply_new(path, w);
+}
+
+int p9_symlink(p9_reader& r, p9_writer& w) {
+  uint32_t dfid = r.u32();
+  std::string name = r.str();
+  std::string target = r.str();
+  if (!p9_fids.count(dfid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  std::string path = p9_join(p9_fids[dfid].path, name);
+  p9_parent parent(path);
+  if (parent.fd < 0) return errno;
+  // the target is kept as it is, it only gets resolved beneath the share when followed
+  if (symlinkat(target.c_str(), parent.fd, parent.at())) return errno;
+  return p9_reply_new(path, w);
+}
+
+int p9_mknod(p9_reader& r, p9_writer& w) {
+  uint32_t dfid = r.u32();
+  std::string name = r.str();
+  uint32_t mode = r.u32();
+  uint32_t major = r.u32();
+  uint32_t minor = r.u32();
+  if (!p9_fids.count(dfid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  std::string path = p9_join(p9_fids[dfid].path, name);
+  p9_parent parent(path);
+  if (parent.fd < 0) return errno;
+  if (mknodat(parent.fd, parent.at(), mode, makedev(major, minor))) return errno;
+  return p9_reply_new(path, w);
+}
+
+int p9_readlink(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  p9_parent parent(p9_fids[fid].path);
+  if (parent.fd < 0) return errno;
+  char target[PATH_MAX];
+  ssize_t len = readlinkat(parent.fd, parent.at(), target, sizeof(target));
+  if (len < 0) return errno;
+  w.str(std::string(target, len));
+  return 0;
+}
+
+int p9_link(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t dfid = r.u32();
+  uint32_t fid = r.u32();
+  std::string name = r.str();
+  if (!p9_fids.count(dfid) || !p9_fids.count(fid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  p9_parent oldparent(p9_fids[fid].path);
+  p9_parent newparent(p9_join(p9_fids[dfid].path, name));
+  if (oldparent.fd < 0 || newparent.fd < 0) return errno;
+  if (linkat(oldparent.fd, oldparent.at(), newparent.fd, newparent.at(), 0)) return errno;
+  return 0;
+}
+
+int p9_rename(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint32_t dfid = r.u32();
+  std::string name = r.str();
+  if (!p9_fids.count(fid) || !p9_fids.count(dfid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  std::string path = p9_join(p9_fids[dfid].path, name);
+  p9_parent oldparent(p9_fids[fid].path);
+  p9_parent newparent(path);
+  if (oldparent.fd < 0 || newparent.fd < 0) return errno;
+  if (renameat(oldparent.fd, oldparent.at(), newparent.fd, newparent.at())) return errno;
+  p9_fids[fid].path = path;
+  return 0;
+}
+
+int p9_renameat(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t olddfid = r.u32();
+  std::string oldname = r.str();
+  uint32_t newdfid = r.u32();
+  std::string newname = r.str();
+  if (!p9_fids.count(olddfid) || !p9_fids.count(newdfid)) return EBADF;
+  if (!p9_valid_name(oldname) || !p9_valid_name(newname)) return EINVAL;
+  std::string oldpath = p9_join(p9_fids[olddfid].path, oldname);
+  std::string newpath = p9_join(p9_fids[newdfid].path, newname);
+  p9_parent oldparent(oldpath);
+  p9_parent newparent(newpath);
+  if (oldparent.fd < 0 || newparent.fd < 0) return errno;
+  if (renameat(oldparent.fd, oldparent.at(), newparent.fd, newparent.at())) return errno;
+  // keep the fids that point into the renamed entry valid
+  for (auto& [id, f] : p9_fids) {
+    if (f.path == oldpath || f.path.starts_with(oldpath + "/")) {
+      f.path = newpath + f.path.substr(oldpath.size());
+    }
+  }
+  return 0;
+}
+
+int p9_unlinkat(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t dfid = r.u32();
+  std::string name = r.str();
+  uint32_t flags = r.u32();
+  if (!p9_fids.count(dfid)) return EBADF;
+  if (!p9_valid_name(name)) return EINVAL;
+  p9_parent parent(p9_join(p9_fids[dfid].path, name));
+  if (parent.fd < 0) return errno;
+  if (unlinkat(parent.fd, parent.at(), flags & AT_REMOVEDIR)) return errno;
+  return 0;
+}
+
+int p9_statfs(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  struct statfs sf;
+  if (fstatfs(p9_root_fd, &sf)) return errno;
+  w.u32(sf.f_type);
+  w.u32(sf.f_bsize);
+  w.u64(sf.f_blocks);
+  w.u64(sf.f_bfree);
+  w.u64(sf.f_bavail);
+  w.u64(sf.f_files);
+  w.u64(sf.f_ffree);
+  uint64_t fsid;
+  memcpy(&fsid, &sf.f_fsid, sizeof(fsid));
+  w.u64(fsid);
+  w.u32(sf.f_namelen);
+  return 0;
+}
+
+int p9_fsync(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint32_t datasync = r.u32();
+  if (!p9_fids.count(fid) || p9_fids[fid].fd < 0) return EBADF;
+  if ((datasync ? fdatasync : fsync)(p9_fids[fid].fd)) return errno;
+  return 0;
+}
+
+int p9_readdir(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  uint64_t offset = r.u64();
+  uint32_t count = r.u32();
+  if (!p9_fids.count(fid) || !p9_fids[fid].dir) return EBADF;
+  p9_fid& f = p9_fids[fid];
+  count = std::min(count, p9_msize - (P9_HDR_SIZE + 4));
+
+  if (offset == 0) {
+    rewinddir(f.dir);
+  } else {
+    seekdir(f.dir, offset);
+  }
+  size_t count_pos = w.buf.size();
+  w.u32(0);
+  size_t start = w.buf.size();
+  while (true) {
+    long pos = telldir(f.dir);
+    dirent* ent = readdir(f.dir);
+    if (!ent) break;
+    size_t namelen = strlen(ent->d_name);
+    if (w.buf.size() - start + P9_QID_SIZE + 8 + 1 + 2 + namelen > count) {
+      seekdir(f.dir, pos); // does not fit, the guest picks it up with the next request
+      break;
+    }
+    struct stat st = {};
+    st.st_ino = ent->d_ino;
+    st.st_mode = ent->d_type == DT_DIR ? S_IFDIR : ent->d_type == DT_LNK ? S_IFLNK : S_IFREG;
+    w.qid(st);
+    w.u64(telldir(f.dir));
+    w.u8(ent->d_type);
+    w.str(ent->d_name);
+  }
+  uint32_t written = w.buf.size() - start;
+  memcpy(&w.buf[count_pos], &written, sizeof(written));
+  return 0;
+}
+
+int p9_lock(p9_reader& r, p9_writer& w) {
+  r.u32(); // fid
+  // locks are advisory and the share has a single client, so they always succeed
+  w.u8(0); // P9_LOCK_SUCCESS
+  return 0;
+}
+
+int p9_getlock(p9_reader& r, p9_writer& w) {
+  r.u32(); // fid
+  r.u8(); // type
+  uint64_t start = r.u64();
+  uint64_t length = r.u64();
+  uint32_t proc_id = r.u32();
+  std::string client_id = r.str();
+  w.u8(2); // F_UNLCK, nothing conflicts
+  w.u64(start);
+  w.u64(length);
+  w.u32(proc_id);
+  w.str(client_id);
+  return 0;
+}
+
+int p9_clunk(p9_reader& r, [[maybe_unused]] p9_writer& w) {
+  uint32_t fid = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  p9_fid& f = p9_fids[fid];
+  if (f.dir) {
+    closedir(f.dir);
+  } else if (f.fd >= 0) {
+    close(f.fd);
+  }
+  p9_fids.erase(fid);
+  return 0;
+}
+
+int p9_remove(p9_reader& r, p9_writer& w) {
+  uint32_t fid = r.u32();
+  if (!p9_fids.count(fid)) return EBADF;
+  std::string path = p9_fids[fid].path;
+  struct stat st;
+  int err = p9_lstat(path, st);
+  if (!err) {
+    p9_parent parent(path);
+    if (parent.fd < 0 || unlinkat(parent.fd, parent.at(), S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0)) err = errno;
+  }
+  // the fid is clunked even if the remove fails
+  p9_reader clunk_r = {(const uint8_t*)&fid, sizeof(fid)};
+  p9_clunk(clunk_r, w);
+  return err;
+}
+
+// Tread and Twrite move the data between the file and the guest buffers directly
+
+int p9_read(p9_reader& r, p9_writer& w, virtio_chain& chain, size_t& data_len) {
+  uint32_t fid = r.u32();
+  uint64_t offset = r.u64();
+  uint32_t count = r.u32();
+  if (!p9_fids.count(fid) || p9_fids[fid].fd < 0) return EBADF;
+  size_t data_start = P9_HDR_SIZE + 4;
+  if (chain.wr_len < data_start) return EINVAL;
+  count = std::min<size_t>(count, std::min<size_t>(chain.wr_len - data_start, p9_msize - data_start));
+
+  static iovec iov[VIRTIO_MAX_CHAIN];
+  int iovcnt = virtio_iov_slice(chain.wr, chain.wr_cnt, data_start, count, iov, VIRTIO_MAX_CHAIN);
+  ssize_t n = preadv(p9_fids[fid].fd, iov, iovcnt, offset);
+  if (n < 0) return errno;
+  w.u32(n);
+  data_len = n;
+  return 0;
+}
+
+int p9_write(p9_reader& r, p9_writer& w, virtio_chain& chain) {
+  uint32_t fid = r.u32();
+  uint64_t offset = r.u64();
+  uint32_t count = r.u32();
+  if (!p9_fids.count(fid) || p9_fids[fid].fd < 0) return EBADF;
+  size_t data_start = r.pos;
+  if (data_start + count > chain.rd_len) return EINVAL;
+
+  static iovec iov[VIRTIO_MAX_CHAIN];
+  int iovcnt = virtio_iov_slice(chain.rd, chain.rd_cnt, data_start, count, iov, VIRTIO_MAX_CHAIN);
+  ssize_t n = pwritev(p9_fids[fid].fd, iov, iovcnt, offset);
+  if (n < 0) return errno;
+  w.u32(n);
+  return 0;
+}
+
+// handle one request, returns the number of bytes written into the guest buffers
+uint32_t p9_handle(virtio_chain& chain) {
+  // everything except the Twrite payload fits in a small header copy
+  static uint8_t req[P9_HDR_SIZE + 4 + P9_MAX_WALK * (2 + NAME_MAX) + 2 * PATH_MAX];
+  size_t req_len = virtio_chain_read(chain, 0, req, sizeof(req));
+  p9_reader r = {req, req_len};
+  r.u32(); // size
+  uint8_t type = r.u8();
+  uint16_t tag = r.u16();
+  if (r.err) return 0;
+
+  p9_writer w;
+  size_t data_len = 0; // bytes read directly into the guest buffers after the reply header
+  int err = 0;
+  switch (type) {
+    case TVERSION: err = p9_version(r, w); break;
+    case TATTACH: err = p9_attach(r, w); break;
+    case TWALK: err = p9_walk(r, w); break;
+    case TGETATTR: err = p9_getattr(r, w); break;
+    case TSETATTR: err = p9_setattr(r, w); break;
+    case TLOPEN: err = p9_lopen(r, w); break;
+    case TLCREATE: err = p9_lcreate(r, w); break;
+    case TMKDIR: err = p9_mkdir(r, w); break;
+    case TSYMLINK: err = p9_symlink(r, w); break;
+    case TMKNOD: err = p9_mknod(r, w); break;
+    case TREADLINK: err = p9_readlink(r, w); break;
+    case TLINK: err = p9_link(r, w); break;
+    case TRENAME: err = p9_rename(r, w); break;
+    case TRENAMEAT: err = p9_renameat(r, w); break;
+    case TUNLINKAT: err = p9_unlinkat(r, w); break;
+    case TSTATFS: err = p9_statfs(r, w); break;
+    case TFSYNC: err = p9_fsync(r, w); break;
+    case TREADDIR: err = p9_readdir(r, w); break;
+    case TLOCK: err = p9_lock(r, w); break;
+    case TGETLOCK: err = p9_getlock(r, w); break;
+    case TCLUNK: err = p9_clunk(r, w); break;
+    case TREMOVE: err = p9_remove(r, w); break;
+    case TREAD: err = p9_read(r, w, chain, data_len); break;
+    case TWRITE: err = p9_write(r, w, chain); break;
+    case TFLUSH: break; // requests are handled in order, so there is never anything to flush
+    case TXATTRWALK: err = EOPNOTSUPP; break;
+    case TAUTH: err = EOPNOTSUPP; break;
+    default: err = EOPNOTSUPP;
+  }
+  if (r.err && !err) err = EINVAL;
+
+  uint8_t reply_type = type + 1;
+  if (err) {
+    w.buf.resize(P9_HDR_SIZE);
+    w.u32(err);
+    reply_type = TLERROR + 1;
+    data_len = 0;
+  }
+  uint32_t size = w.buf.size() + data_len;
+  memcpy(&w.buf[0], &size, 4);
+  w.buf[4] = reply_type;
+  memcpy(&w.buf[5], &tag, 2);
+  virtio_chain_write(chain, 0, w.buf.data(), w.buf.size());
+  return size;
+}
+
+void virtio_9p_loop() {
+  static virtio_chain chain;
+  std::unique_lock<std::mutex> flags_lock (p9_mtx);
+  while (true) {
+    p9_cv.wait(flags_lock, []{return p9_needs_io || p9_end;});
+    if (p9_end) break;
+    p9_needs_io = false;
+    flags_lock.unlock();
+
+    bool pushed = false;
+    while (virtq_pop(v9p_dev, 0, chain)) {
+      uint32_t written = p9_handle(chain);
+      virtq_push(v9p_dev, 0, chain.head, written);
+      pushed = true;
+    }
+    if (pushed) virtio_send_int(v9p_dev);
+
+    flags_lock.lock();
+  }
+}
+
+void* virtio_9p_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(v9p_dev, offset, len);
+}
+void virtio_9p_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(v9p_dev, offset, dataptr, len);
+}
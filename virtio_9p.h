@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+// virtio 9p transport serving 9P2000.L from a host directory
+
+// largest msize the device accepts, the guest picks the actual value with the msize mount option
+#define P9_MAX_MSIZE (4 << 20)
+
+// spec is "tag=/path/to/dir", or just a path which then uses the tag "hostshare"
+bool virtio_9p_set_share(const char* spec);
+
+void virtio_9p_init();
+void virtio_9p_uninit();
+// stop and restart the worker thread, the fids stay open
+void virtio_9p_start();
+void virtio_9p_stop();
+
+void virtio_9p_loop();
+
+void* virtio_9p_r (uint64_t offset, uint8_t len);
+void virtio_9p_w (uint64_t offset, void* dataptr, uint8_t len);
+
+struct __attribute__ ((packed)) virtio_9p_config {
+  uint16_t tag_len;
+  char tag[64];
+};
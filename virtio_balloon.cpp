@@ -0,0 +1,235 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "mem.h"
+#include "virtio_common.h"
+#include "virtio_balloon.h"
+
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM (1ULL << 2)
+#define VIRTIO_BALLOON_F_REPORTING (1ULL << 5)
+
+// the balloon always works in 4KiB pages, whatever the guest page size
+#define BALLOON_PAGE_SHIFT 12
+// at most this many pfns are read from one inflate request at a time
+#define BALLOON_PFN_BATCH 256
+#define BALLOON_MAX_CLIENTS 4
+#define BALLOON_MAX_LINE 64
+
+// queue layout: the guest only creates the queues of features it accepted, and numbers them without gaps
+// since neither stats nor free page hinting is offered, the reporting queue follows the deflate queue
+#define BALLOON_INFLATEQ 0
+#define BALLOON_DEFLATEQ 1
+#define BALLOON_REPORTQ 2
+
+struct balloon_client {
+  int fd;
+  std::string line;
+};
+
+std::string balloon_path;
+int balloon_listen_fd = -1;
+std::vector<balloon_client> balloon_clients;
+
+virtio_mmio_dev vballoon_dev;
+virtio_balloon_config vballooncfg;
+
+std::thread balloon_thread;
+std::atomic<bool> balloon_end = false;
+int balloon_kick_fd = -1;
+
+void virtio_balloon_notify([[maybe_unused]] uint16_t queue) {
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t ret = write(balloon_kick_fd, &one, sizeof(one));
+}
+
+bool virtio_balloon_set_socket(const char* spec) {
+  balloon_path = spec;
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (balloon_path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, balloon_path.c_str());
+  unlink(addr.sun_path);
+  balloon_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (balloon_listen_fd < 0) return false;
+  if (bind(balloon_listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(balloon_listen_fd, BALLOON_MAX_CLIENTS)) {
+    close(balloon_listen_fd);
+    balloon_listen_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void virtio_balloon_init() {
+  if (balloon_listen_fd < 0) return; // no control socket, the device shows up as a placeholder with id 0
+  vballoon_dev.deviceid = 5;
+  vballoon_dev.devfeat = VIRTIO_F_VERSION_1 | VIRTIO_BALLOON_F_DEFLATE_ON_OOM | VIRTIO_BALLOON_F_REPORTING;
+  vballoon_dev.irq = 6;
+  vballoon_dev.queue_count = 3;
+  vballoon_dev.config = &vballooncfg;
+  vballoon_dev.config_len = sizeof(vballooncfg);
+  vballoon_dev.notify = virtio_balloon_notify;
+  virtio_mmio_dev_reset(vballoon_dev);
+  virtio_mmio_register(vballoon_dev);
+
+  balloon_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  balloon_thread = std::thread(virtio_balloon_loop);
+}
+
+void virtio_balloon_uninit() {
+  if (balloon_listen_fd < 0) return;
+  balloon_end = true;
+  virtio_balloon_notify(0);
+  balloon_thread.join();
+  for (balloon_client& client : balloon_clients) {
+    close(client.fd);
+  }
+  close(balloon_listen_fd);
+  unlink(balloon_path.c_str());
+  close(balloon_kick_fd);
+}
+
+// the following run on the balloon thread
+
+// inflate requests are arrays of 4KiB pfns, runs of adjacent pages are dropped together
+void balloon_inflate(const virtio_chain& chain) {
+  uint32_t pfns[BALLOON_PFN_BATCH];
+  uint64_t run_start = 0, run_len = 0;
+  for (size_t offset = 0; offset < chain.rd_len; offset += sizeof(pfns)) {
+    size_t n_pfns = virtio_chain_read(chain, offset, pfns, sizeof(pfns)) / sizeof(uint32_t);
+    for (size_t i = 0; i < n_pfns; i++) {
+      uint64_t addr = (uint64_t)pfns[i] << BALLOON_PAGE_SHIFT;
+      if (run_len && addr == run_start + run_len) {
+        run_len += 1 << BALLOON_PAGE_SHIFT;
+        continue;
+      }
+      if (run_len) phy_mem_discard(run_start, run_len);
+      run_start = addr;
+      run_len = 1 << BALLOON_PAGE_SHIFT;
+    }
+  }
+  if (run_len) phy_mem_discard(run_start, run_len);
+}
+
+// reported free ranges come as device-writable buffers, one per range
+void balloon_report(const virtio_chain& chain) {
+  for (uint16_t i = 0; i < chain.wr_cnt; i++) {
+    uint64_t addr = phy_mem_addr(chain.wr[i].iov_base);
+    if (!addr) continue;
+    phy_mem_discard(addr, chain.wr[i].iov_len);
+  }
+}
+
+void balloon_handle_queues(virtio_chain& chain) {
+  bool pushed = false;
+  while (virtq_pop(vballoon_dev, BALLOON_INFLATEQ, chain)) {
+    balloon_inflate(chain);
+    virtq_push(vballoon_dev, BALLOON_INFLATEQ, chain.head, 0);
+    pushed = true;
+  }
+  // deflated pages refault as zero pages on their next access, nothing to do
+  while (virtq_pop(vballoon_dev, BALLOON_DEFLATEQ, chain)) {
+    virtq_push(vballoon_dev, BALLOON_DEFLATEQ, chain.head, 0);
+    pushed = true;
+  }
+  while (virtq_pop(vballoon_dev, BALLOON_REPORTQ, chain)) {
+    balloon_report(chain);
+    virtq_push(vballoon_dev, BALLOON_REPORTQ, chain.head, 0);
+    pushed = true;
+  }
+  if (pushed) virtio_send_int(vballoon_dev);
+}
+
+void balloon_command(balloon_client& client) {
+  char reply[BALLOON_MAX_LINE];
+  uint32_t mib;
+  char tail;
+  if (sscanf(client.line.c_str(), "set %u%c", &mib, &tail) == 1 && mib <= mem_total_size() >> 20) {
+    vballooncfg.num_pages = mib << (20 - BALLOON_PAGE_SHIFT);
+    virtio_config_changed(vballoon_dev);
+    strcpy(reply, "OK\n");
+  } else if (client.line == "get") {
+    uint32_t target = vballooncfg.num_pages;
+    uint32_t actual = vballooncfg.actual;
+    snprintf(reply, sizeof(reply), "target %u actual %u\n", target >> (20 - BALLOON_PAGE_SHIFT), actual >> (20 - BALLOON_PAGE_SHIFT));
+  } else {
+    strcpy(reply, "ERR\n");
+  }
+  send(client.fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// returns false if the client went away
+bool balloon_client_rx(balloon_client& client) {
+  char buf[BALLOON_MAX_LINE];
+  ssize_t n_read = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if (n_read <= 0) return n_read < 0 && errno == EAGAIN;
+  for (ssize_t i = 0; i < n_read; i++) {
+    if (buf[i] != '\n') {
+      client.line += buf[i];
+      if (client.line.size() > BALLOON_MAX_LINE) return false;
+      continue;
+    }
+    balloon_command(client);
+    client.line.clear();
+  }
+  return true;
+}
+
+void virtio_balloon_loop() {
+  // one chain is large, keep it off the stack
+  static virtio_chain chain;
+  pollfd fds[2 + BALLOON_MAX_CLIENTS];
+  while (!balloon_end) {
+    nfds_t nfds = 0;
+    fds[nfds++] = {balloon_kick_fd, POLLIN, 0};
+    fds[nfds++] = {balloon_listen_fd, POLLIN, 0};
+    for (balloon_client& client : balloon_clients) {
+      fds[nfds++] = {client.fd, POLLIN, 0};
+    }
+    if (poll(fds, nfds, -1) < 0) continue;
+
+    if (fds[0].revents) {
+      uint64_t kicks;
+      [[maybe_unused]] ssize_t ret = read(balloon_kick_fd, &kicks, sizeof(kicks));
+      if (virtio_driver_ok(vballoon_dev)) balloon_handle_queues(chain);
+    }
+    for (nfds_t i = 2; i < nfds; i++) {
+      if (!fds[i].revents) continue;
+      balloon_client& client = balloon_clients[i - 2];
+      if (!balloon_client_rx(client)) {
+        close(client.fd);
+        client.fd = -1;
+      }
+    }
+    std::erase_if(balloon_clients, [](const balloon_client& client) {return client.fd < 0;});
+    if (fds[1].revents) {
+      int fd = accept4(balloon_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0 && balloon_clients.size() >= BALLOON_MAX_CLIENTS) {
+        close(fd);
+      } else if (fd >= 0) {
+        balloon_clients.push_back({fd, ""});
+      }
+    }
+  }
+}
+
+void* virtio_balloon_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vballoon_dev, offset, len);
+}
+void virtio_balloon_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vballoon_dev, offset, dataptr, len);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+
+// virtio balloon with free page reporting
+// pages the guest reports as free or puts in the balloon are returned to the host
+// the balloon size is set through a UNIX control socket, one command per line:
+// "set <MiB>" asks the guest to grow or shrink the balloon, "get" replies "target <MiB> actual <MiB>"
+
+// spec is the path of the control socket; must be called before virtio_balloon_init
+bool virtio_balloon_set_socket(const char* spec);
+
+void virtio_balloon_init();
+void virtio_balloon_uninit();
+
+void virtio_balloon_loop();
+
+void* virtio_balloon_r (uint64_t offset, uint8_t len);
+void virtio_balloon_w (uint64_t offset, void* dataptr, uint8_t len);
+
+struct __attribute__ ((packed)) virtio_balloon_config {
+  uint32_t num_pages; // requested balloon size in 4KiB pages
+  uint32_t actual; // current balloon size, written by the guest
+  uint32_t free_page_hint_cmd_id;
+  uint32_t poison_val;
+};
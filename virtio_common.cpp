@@ -0,0 +1,418 @@
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+#include "virtio_common.h"
+#include "constants.h"
+#include "mem.h"
+#include "plic.h"
+
+std::vector<virtio_mmio_dev*> virtio_devs;
+
+void virtio_mmio_register(virtio_mmio_dev& dev) {
+  virtio_devs.push_back(&dev);
+}
+
+void virtio_mmio_dev_reset(virtio_mmio_dev& dev) {
+  dev.drifeat = 0;
+  dev.devfeatsel = 0;
+  dev.drifeatsel = 0;
+  dev.queuesel = 0;
+  dev.intstatus = 0;
+  dev.status = 0;
+  memset(dev.queues, 0, sizeof(dev.queues));
+}
+
+void* virtio_mmio_r (virtio_mmio_dev& dev, uint64_t offset, uint8_t len) {
+  // device-specific config, a read running past its end reads as zero like the write is dropped
+  if (offset >= 0x100) {
+    if (offset - 0x100 + len > dev.config_len) return &ZERO;
+    return (uint8_t*)dev.config + offset - 0x100;
+  }
+  
+  std::lock_guard<std::mutex> lock(dev.mtx);
+  virtio_queue_state& q = dev.queues[dev.queuesel % VIRTIO_MAX_QUEUES];
+  bool queue_exists = dev.queuesel < dev.queue_count;
+  switch (offset) {
+    case 0x000: // magic value
+      dev.handler_output = 0x74726976;
+      break;
+    case 0x004: // version
+      dev.handler_output = 0x2;
+      break;
+    case 0x008:
+      dev.handler_output = dev.deviceid;
+      break;
+    case 0x00c:
+      dev.handler_output = 0x554d4551; // qemu vendor...?
+      break;
+    case 0x010:
+      dev.handler_output = dev.devfeatsel < 2 ? dev.devfeat >> (32 * dev.devfeatsel) : 0;
+      break;
+    case 0x034: // QueueNumMax, 0 if the queue is not available
+      dev.handler_output = queue_exists ? VIRTIO_QUEUE_SIZE : 0;
+      break;
+    case 0x044:
+      dev.handler_output = q.ready;
+      break;
+    case 0x060:
+      dev.handler_output = dev.intstatus;
+      break;
+    case 0x070:
+      dev.handler_output = dev.status;
+      break;
+    case 0x0fc:
+      dev.handler_output = dev.configgen;
+      break;
+    default: // write-only or reserved
+      dev.handler_output = 0;
+  }
+  return &dev.handler_output;
+}
+
+void virtio_mmio_w (virtio_mmio_dev& dev, uint64_t offset, void* dataptr, uint8_t len) {
+  uint64_t value = 0;
+  memcpy(&value, dataptr, len > sizeof(value) ? sizeof(value) : len);
+  
+  // device-specific config
+  if (offset >= 0x100) {
+    if (offset - 0x100 + len > dev.config_len) return;
+    memcpy((uint8_t*)dev.config + offset - 0x100, dataptr, len);
+    if (dev.config_w) dev.config_w(offset - 0x100, len);
+    return;
+  }
+  
+  if (offset == 0x050) { // QueueNotify
+    if (value < dev.queue_count) dev.notify(value);
+    return;
+  }
+  
+  bool was_reset = false;
+  bool status_set = false;
+  {
+    std::lock_guard<std::mutex> lock(dev.mtx);
+    virtio_queue_state& q = dev.queues[dev.queuesel % VIRTIO_MAX_QUEUES];
+    switch (offset) {
+      case 0x014:
+        dev.devfeatsel = value;
+        break;
+      case 0x020:
+        if (dev.drifeatsel < 2) {
+          dev.drifeat &= ~(0xffffffffULL << (32 * dev.drifeatsel));
+          dev.drifeat |= (value & 0xffffffff) << (32 * dev.drifeatsel);
+          dev.drifeat &= dev.devfeat; // the driver cannot accept what we never offered
+        }
+        break;
+      case 0x024:
+        dev.drifeatsel = value;
+        break;
+      case 0x030:
+        dev.queuesel = value;
+        break;
+      case 0x038:
+        if (value && value <= VIRTIO_QUEUE_SIZE && !(value & (value - 1))) q.num = value;
+        break;
+      case 0x044:
+        q.ready = value & 1;
+        break;
+      case 0x064: // InterruptACK
+        dev.intstatus &= ~value;
+        break;
+      case 0x070:
+        if (value == 0) {
+          virtio_mmio_dev_reset(dev);
+          was_reset = true;
+        } else {
+          dev.status = value;
+          status_set = true;
+        }
+        break;
+      case 0x080:
+        q.desc = (q.desc & ~0xffffffffULL) | (value & 0xffffffff);
+        break;
+      case 0x084:
+        q.desc = (q.desc & 0xffffffff) | (value << 32);
+        break;
+      case 0x090:
+        q.driver = (q.driver & ~0xffffffffULL) | (value & 0xffffffff);
+        break;
+      case 0x094:
+        q.driver = (q.driver & 0xffffffff) | (value << 32);
+        break;
+      case 0x0a0:
+        q.device = (q.device & ~0xffffffffULL) | (value & 0xffffffff);
+        break;
+      case 0x0a4:
+        q.device = (q.device & 0xffffffff) | (value << 32);
+        break;
+    }
+  }
+  if (was_reset && dev.reset) dev.reset();
+  if (status_set && dev.status_w) dev.status_w(value);
+}
+
+bool virtio_driver_ok(virtio_mmio_dev& dev) {
+  std::lock_guard<std::mutex> lock(dev.mtx);
+  return dev.status & VIRTIO_STATUS_DRIVER_OK;
+}
+
+// avail ring: flags, idx, ring[num]
+// used ring: flags, idx, {id, len}[num]
+static uint16_t* virtq_avail(virtio_queue_state& q) {
+  return (uint16_t*)phy_mem_ptr(q.driver, 4 + 2 * q.num);
+}
+
+bool virtq_has_avail(virtio_mmio_dev& dev, uint16_t queue) {
+  std::lock_guard<std::mutex> lock(dev.mtx);
+  virtio_queue_state& q = dev.queues[queue];
+  if (!q.ready || !q.num) return false;
+  uint16_t* avail = virtq_avail(q);
+  if (!avail) return false;
+  return std::atomic_ref<uint16_t>(avail[1]).load(std::memory_order_acquire) != q.last_avail;
+}
+
+bool virtq_pop(virtio_mmio_dev& dev, uint16_t queue, virtio_chain& chain) {
+  while (true) {
+    std::unique_lock<std::mutex> lock(dev.mtx);
+    virtio_queue_state& q = dev.queues[queue];
+    if (!q.ready || !q.num) return false;
+    uint16_t* avail = virtq_avail(q);
+    virtq_desc* table = (virtq_desc*)phy_mem_ptr(q.desc, sizeof(virtq_desc) * q.num);
+    if (!avail || !table) return false;
+    if (std::atomic_ref<uint16_t>(avail[1]).load(std::memory_order_acquire) == q.last_avail) return false;
+    
+    chain.head = avail[2 + q.last_avail % q.num];
+    chain.rd_cnt = chain.wr_cnt = 0;
+    chain.rd_len = chain.wr_len = 0;
+    q.last_avail++;
+    
+    uint32_t table_num = q.num;
+    uint16_t idx = chain.head;
+    bool indirect = false;
+    bool malformed = idx >= table_num;
+    for (uint32_t steps = 0; !malformed; steps++) {
+      if (steps >= VIRTIO_MAX_CHAIN) {
+        malformed = true;
+        break;
+      }
+      virtq_desc d = table[idx];
+      if (d.flags & VIRTQ_DESC_F_INDIRECT) {
+        // an indirect table replaces the rest of the chain
+        table = (virtq_desc*)phy_mem_ptr(d.addr, d.len);
+        if (indirect || !table || d.len < sizeof(virtq_desc)) {
+          malformed = true;
+          break;
+        }
+        indirect = true;
+        table_num = d.len / sizeof(virtq_desc);
+        idx = 0;
+        continue;
+      }
+      uint8_t* host = phy_mem_ptr(d.addr, d.len);
+      if (!host && d.len) {
+        malformed = true;
+        break;
+      }
+      if (d.flags & VIRTQ_DESC_F_WRITE) {
+        chain.wr[chain.wr_cnt++] = {host, d.len};
+        chain.wr_len += d.len;
+      } else {
+        chain.rd[chain.rd_cnt++] = {host, d.len};
+        chain.rd_len += d.len;
+      }
+      if (!(d.flags & VIRTQ_DESC_F_NEXT)) break;
+      idx = d.next;
+      if (idx >= table_num) malformed = true;
+    }
+    if (!malformed) return true;
+    
+    // give the broken chain back untouched and try the next one
+    lock.unlock();
+    virtq_push(dev, queue, chain.head, 0);
+  }
+}
+
+// marks the device-writable buffers of a chain dirty, walking it again as virtq_pop does not keep it
+// the device is done writing once it pushes the chain, so this catches every write into it
+static void virtq_mark_dirty(virtio_queue_state& q, uint16_t head) {
+  virtq_desc* table = (virtq_desc*)phy_mem_ptr(q.desc, sizeof(virtq_desc) * q.num);
+  if (!table) return;
+  uint32_t table_num = q.num;
+  uint16_t idx = head;
+  bool indirect = false;
+  for (uint32_t steps = 0; idx < table_num && steps < VIRTIO_MAX_CHAIN; steps++) {
+    virtq_desc d = table[idx];
+    if (d.flags & VIRTQ_DESC_F_INDIRECT) {
+      table = (virtq_desc*)phy_mem_ptr(d.addr, d.len);
+      if (indirect || !table) return;
+      indirect = true;
+      table_num = d.len / sizeof(virtq_desc);
+      idx = 0;
+      continue;
+    }
+    if (d.flags & VIRTQ_DESC_F_WRITE) mem_dirty_mark(d.addr, d.len);
+    if (!(d.flags & VIRTQ_DESC_F_NEXT)) return;
+    idx = d.next;
+  }
+}
+
+void virtq_push(virtio_mmio_dev& dev, uint16_t queue, uint16_t head, uint32_t written) {
+  std::lock_guard<std::mutex> lock(dev.mtx);
+  virtio_queue_state& q = dev.queues[queue];
+  if (!q.ready || !q.num) return;
+  uint16_t* used = (uint16_t*)phy_mem_ptr(q.device, 4 + 8 * q.num);
+  if (!used) return;
+  if (mem_dirty_tracking()) [[unlikely]] {
+    virtq_mark_dirty(q, head);
+    mem_dirty_mark(q.device, 4 + 8 * q.num);
+  }
+  uint32_t* elem = (uint32_t*)(used + 2) + 2 * (q.used_idx % q.num);
+  elem[0] = head;
+  elem[1] = written;
+  q.used_idx++;
+  // the ring entry must be visible before the index that publishes it
+  std::atomic_ref<uint16_t>(used[1]).store(q.used_idx, std::memory_order_release);
+}
+
+void virtio_send_int(virtio_mmio_dev& dev, uint32_t reason) {
+  {
+    std::lock_guard<std::mutex> lock(dev.mtx);
+    dev.intstatus |= reason;
+  }
+  plic_send_int(dev.irq);
+}
+
+void virtio_config_changed(virtio_mmio_dev& dev) {
+  {
+    std::lock_guard<std::mutex> lock(dev.mtx);
+    dev.configgen++;
+  }
+  virtio_send_int(dev, VIRTIO_INT_CONFIG);
+}
+
+size_t virtio_chain_read(const virtio_chain& chain, size_t offset, void* dst, size_t len) {
+  size_t done = 0;
+  for (uint16_t i = 0; i < chain.rd_cnt && done < len; i++) {
+    const iovec& part = chain.rd[i];
+    if (offset >= part.iov_len) {
+      offset -= part.iov_len;
+      continue;
+    }
+    size_t n = std::min(part.iov_len - offset, len - done);
+    memcpy((uint8_t*)dst + done, (uint8_t*)part.iov_base + offset, n);
+    done += n;
+    offset = 0;
+  }
+  return done;
+}
+
+size_t virtio_chain_write(virtio_chain& chain, size_t offset, const void* src, size_t len) {
+  size_t done = 0;
+  for (uint16_t i = 0; i < chain.wr_cnt && done < len; i++) {
+    iovec& part = chain.wr[i];
+    if (offset >= part.iov_len) {
+      offset -= part.iov_len;
+      continue;
+    }
+    size_t n = std::min(part.iov_len - offset, len - done);
+    memcpy((uint8_t*)part.iov_base + offset, (const uint8_t*)src + done, n);
+    done += n;
+    offset = 0;
+  }
+  return done;
+}
+
+int virtio_iov_slice(const iovec* parts, uint16_t cnt, size_t offset, size_t len, iovec* out, int out_max) {
+  int out_cnt = 0;
+  for (uint16_t i = 0; i < cnt && len && out_cnt < out_max; i++) {
+    if (offset >= parts[i].iov_len) {
+      offset -= parts[i].iov_len;
+      continue;
+    }
+    size_t n = std::min(parts[i].iov_len - offset, len);
+    out[out_cnt++] = {(uint8_t*)parts[i].iov_base + offset, n};
+    len -= n;
+    offset = 0;
+  }
+  return out_cnt;
+}
+
+// transport state in a snapshot, per device
+struct virtio_snap_dev {
+  uint32_t deviceid;
+  uint16_t irq;
+  uint16_t queue_count;
+  uint32_t config_len;
+  uint32_t devfeatsel, drifeatsel, queuesel;
+  uint32_t intstatus, status, configgen;
+  uint64_t drifeat;
+};
+
+bool virtio_save(std::vector<uint8_t>& out) {
+  uint32_t count = virtio_devs.size();
+  snap_put(out, &count, sizeof(count));
+  // device state first, as the devices take their own locks for it
+  std::vector<std::vector<uint8_t>> extra(count);
+  for (uint32_t i = 0; i < count; i++) {
+    if (virtio_devs[i]->save && !virtio_devs[i]->save(extra[i])) return false;
+  }
+  for (virtio_mmio_dev* dev : virtio_devs) {
+    dev->mtx.lock();
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    virtio_mmio_dev& dev = *virtio_devs[i];
+    virtio_snap_dev snap = {dev.deviceid, dev.irq, dev.queue_count, dev.config_len, dev.devfeatsel, dev.drifeatsel, dev.queuesel,
+                            dev.intstatus, dev.status, dev.configgen, dev.drifeat};
+    snap_put(out, &snap, sizeof(snap));
+    snap_put(out, dev.queues, dev.queue_count * sizeof(virtio_queue_state));
+    snap_put(out, dev.config, dev.config_len);
+    uint64_t extra_len = extra[i].size();
+    snap_put(out, &extra_len, sizeof(extra_len));
+    snap_put(out, extra[i].data(), extra_len);
+  }
+  return true;
+}
+
+void virtio_save_done() {
+  for (virtio_mmio_dev* dev : virtio_devs) {
+    dev->mtx.unlock();
+  }
+}
+
+bool virtio_restore(snap_reader& in) {
+  uint32_t count;
+  if (!snap_get(in, &count, sizeof(count)) || count != virtio_devs.size()) return false;
+  for (virtio_mmio_dev* devptr : virtio_devs) {
+    virtio_mmio_dev& dev = *devptr;
+    virtio_snap_dev snap;
+    if (!snap_get(in, &snap, sizeof(snap))) return false;
+    // the same devices have to be configured as when the snapshot was taken
+    if (snap.deviceid != dev.deviceid || snap.irq != dev.irq || snap.queue_count != dev.queue_count || snap.config_len != dev.config_len) return false;
+    {
+      std::lock_guard<std::mutex> lock(dev.mtx);
+      dev.devfeatsel = snap.devfeatsel;
+      dev.drifeatsel = snap.drifeatsel;
+      dev.queuesel = snap.queuesel;
+      dev.intstatus = snap.intstatus;
+      dev.status = snap.status;
+      dev.configgen = snap.configgen;
+      dev.drifeat = snap.drifeat;
+      if (!snap_get(in, dev.queues, dev.queue_count * sizeof(virtio_queue_state))) return false;
+      // chains the device had taken but not finished are gone with its threads, so they are offered again
+      for (uint16_t i = 0; i < dev.queue_count; i++) {
+        dev.queues[i].last_avail = dev.queues[i].used_idx;
+      }
+      if (!snap_get(in, dev.config, dev.config_len)) return false;
+    }
+    uint64_t extra_len;
+    if (!snap_get(in, &extra_len, sizeof(extra_len)) || extra_len > (uint64_t)(in.end - in.pos)) return false;
+    snap_reader extra = {in.pos, in.pos + extra_len};
+    in.pos += extra_len;
+    if (dev.restore && !dev.restore(extra)) return false;
+  }
+  // wake the device threads for the chains that are offered again
+  for (virtio_mmio_dev* dev : virtio_devs) {
+    if (virtio_driver_ok(*dev)) dev->notify(0);
+  }
+  return true;
+}
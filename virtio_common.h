@@ -1,6 +1,12 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <sys/uio.h>
+
+#include "snapshot.h"
 
 struct __attribute__ ((packed)) virtio_dev_cfg {
   uint32_t magic = 0x74726976;
@@ -43,3 +49,104 @@ struct __attribute__ ((packed)) virtqueue {
   uint32_t _res4[1]; // offset 0x9c
   uint64_t queuedev;
 };
+
+// generic virtio-mmio (version 2) transport with split virtqueues
+// devices fill in a virtio_mmio_dev, forward their MMIO callbacks to virtio_mmio_r/w,
+// and pop/push descriptor chains from their own worker thread
+
+#define VIRTIO_MAX_QUEUES 32
+#define VIRTIO_QUEUE_SIZE 256
+// longest descriptor chain we accept, to stop malicious or broken loops
+#define VIRTIO_MAX_CHAIN 1024
+
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTIO_INT_USED 0b01
+#define VIRTIO_INT_CONFIG 0b10
+
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+struct __attribute__ ((packed)) virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct virtio_queue_state {
+  uint32_t num;
+  uint32_t ready;
+  uint64_t desc, driver, device;
+  uint16_t last_avail; // next entry of the avail ring to consume
+  uint16_t used_idx; // our copy of used->idx
+};
+
+struct virtio_mmio_dev {
+  uint32_t deviceid;
+  uint64_t devfeat; // features offered by the device
+  uint16_t irq; // PLIC source
+  uint16_t queue_count;
+  void* config; // device-specific config space at offset 0x100
+  uint32_t config_len;
+  // called from the hart thread on QueueNotify, should wake the device worker
+  void (*notify) (uint16_t queue);
+  // called after the driver resets the device by writing 0 to status, may be null
+  void (*reset) ();
+  // called after the driver writes into the device config space, may be null
+  void (*config_w) (uint64_t offset, uint8_t len);
+  // called after the driver writes a non-zero device status, may be null
+  void (*status_w) (uint32_t status);
+  // device state outside the config space for snapshots, may be null
+  // save returns false if the device cannot be snapshotted, restore gets what save wrote
+  bool (*save) (std::vector<uint8_t>& out);
+  bool (*restore) (snap_reader& in);
+
+  // everything below is transport state
+  uint64_t drifeat;
+  uint32_t devfeatsel, drifeatsel, queuesel;
+  uint32_t intstatus, status, configgen;
+  virtio_queue_state queues[VIRTIO_MAX_QUEUES];
+  // held by the transport around queue config and ring updates
+  std::mutex mtx;
+  uint32_t handler_output;
+};
+
+// a descriptor chain popped off the avail ring, translated into host pointers
+// rd is the device-readable (driver to device) part, wr the device-writable part
+struct virtio_chain {
+  uint16_t head;
+  iovec rd[VIRTIO_MAX_CHAIN];
+  iovec wr[VIRTIO_MAX_CHAIN];
+  uint16_t rd_cnt, wr_cnt;
+  size_t rd_len, wr_len;
+};
+
+void virtio_mmio_dev_reset(virtio_mmio_dev& dev);
+// called once by every device that is in use, so snapshots include it
+void virtio_mmio_register(virtio_mmio_dev& dev);
+void* virtio_mmio_r (virtio_mmio_dev& dev, uint64_t offset, uint8_t len);
+void virtio_mmio_w (virtio_mmio_dev& dev, uint64_t offset, void* dataptr, uint8_t len);
+
+bool virtio_driver_ok(virtio_mmio_dev& dev);
+bool virtq_has_avail(virtio_mmio_dev& dev, uint16_t queue);
+// returns false if nothing is available or the chain is malformed
+bool virtq_pop(virtio_mmio_dev& dev, uint16_t queue, virtio_chain& chain);
+void virtq_push(virtio_mmio_dev& dev, uint16_t queue, uint16_t head, uint32_t written);
+void virtio_send_int(virtio_mmio_dev& dev, uint32_t reason = VIRTIO_INT_USED);
+void virtio_config_changed(virtio_mmio_dev& dev);
+
+// snapshots of all registered devices, with the harts paused
+// the transports stay locked from virtio_save until virtio_save_done, so the rings in RAM match the saved state
+bool virtio_save(std::vector<uint8_t>& out);
+void virtio_save_done();
+bool virtio_restore(snap_reader& in);
+
+// copy between a flat buffer and the scattered parts of a chain, starting at offset
+size_t virtio_chain_read(const virtio_chain& chain, size_t offset, void* dst, size_t len);
+size_t virtio_chain_write(virtio_chain& chain, size_t offset, const void* src, size_t len);
+// build an iovec array covering [offset, offset+len) of the given parts, returns the count
+int virtio_iov_slice(const iovec* parts, uint16_t cnt, size_t offset, size_t len, iovec* out, int out_max);
@@ -0,0 +1,347 @@
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "io.h"
+#include "virtio_common.h"
+#include "virtio_console.h"
+
+#define VIRTIO_CONSOLE_F_MULTIPORT (1ULL << 1)
+#define VIRTIO_CONSOLE_F_EMERG_WRITE (1ULL << 2)
+
+// control events
+#define VIRTIO_CONSOLE_DEVICE_READY 0
+#define VIRTIO_CONSOLE_DEVICE_ADD 1
+#define VIRTIO_CONSOLE_PORT_READY 3
+#define VIRTIO_CONSOLE_CONSOLE_PORT 4
+#define VIRTIO_CONSOLE_PORT_OPEN 6
+#define VIRTIO_CONSOLE_PORT_NAME 7
+
+// queue layout with VIRTIO_CONSOLE_F_MULTIPORT:
+// 0/1 port 0 rx/tx, 2/3 control rx/tx, then rx/tx pairs for ports 1 and up
+#define CTRL_RXQ 2
+#define CTRL_TXQ 3
+#define PORT_RXQ(n) ((n) == 0 ? 0 : 2 * (n) + 2)
+#define PORT_TXQ(n) ((n) == 0 ? 1 : 2 * (n) + 3)
+
+struct console_port {
+  std::string name;
+  std::string path;
+  int listen_fd = -1;
+  int conn_fd = -1; // for port 0 this is the PTY/stdio input
+  bool guest_open = false;
+};
+
+console_port console_ports[VIRTIO_CONSOLE_MAX_PORTS];
+uint16_t console_port_count = 1;
+
+virtio_mmio_dev vconsole_dev;
+virtio_console_config vconsolecfg;
+
+std::thread console_thread;
+// protects the port state and the control message backlog
+std::mutex console_mtx;
+std::deque<std::vector<uint8_t>> ctrl_backlog;
+std::atomic<bool> console_end = false;
+int console_kick_fd = -1;
+
+void virtio_console_notify([[maybe_unused]] uint16_t queue) {
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t ret = write(console_kick_fd, &one, sizeof(one));
+}
+
+void virtio_console_reset() {
+  std::lock_guard<std::mutex> lock(console_mtx);
+  for (uint16_t i = 0; i < console_port_count; i++) {
+    console_ports[i].guest_open = false;
+  }
+  ctrl_backlog.clear();
+}
+
+void virtio_console_config_w (uint64_t offset, [[maybe_unused]] uint8_t len) {
+  if (offset == offsetof(virtio_console_config, emerg_wr)) {
+    char msg[2] = {(char)vconsolecfg.emerg_wr, 0};
+    pty_print(msg);
+  }
+}
+
+// which ports the guest has open, host connections are not kept across snapshots
+bool virtio_console_save(std::vector<uint8_t>& out) {
+  std::lock_guard<std::mutex> lock(console_mtx);
+  for (uint16_t i = 0; i < console_port_count; i++) {
+    out.push_back(console_ports[i].guest_open);
+  }
+  return true;
+}
+
+bool virtio_console_restore(snap_reader& in) {
+  std::lock_guard<std::mutex> lock(console_mtx);
+  for (uint16_t i = 0; i < console_port_count; i++) {
+    uint8_t open;
+    if (!snap_get(in, &open, 1)) return false;
+    console_ports[i].guest_open = open;
+  }
+  return true;
+}
+
+bool virtio_console_add_port(const char* spec) {
+  if (console_port_count >= VIRTIO_CONSOLE_MAX_PORTS) return false;
+  console_port& port = console_ports[console_port_count];
+  const char* sep = strchr(spec, '=');
+  if (sep) {
+    port.name.assign(spec, sep - spec);
+    port.path = sep + 1;
+  } else {
+    port.name = "port" + std::to_string(console_port_count);
+    port.path = spec;
+  }
+  
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (port.path.size() >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, port.path.c_str());
+  unlink(addr.sun_path);
+  port.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (port.listen_fd < 0) return false;
+  if (bind(port.listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(port.listen_fd, 1)) {
+    close(port.listen_fd);
+    port.listen_fd = -1;
+    return false;
+  }
+  console_port_count++;
+  return true;
+}
+
+void virtio_console_init() {
+  console_ports[0].name = "console";
+  
+  vconsole_dev.deviceid = 3;
+  vconsole_dev.devfeat = VIRTIO_F_VERSION_1 | VIRTIO_CONSOLE_F_MULTIPORT | VIRTIO_CONSOLE_F_EMERG_WRITE;
+  vconsole_dev.irq = 2;
+  vconsole_dev.queue_count = 2 * console_port_count + 2;
+  vconsole_dev.config = &vconsolecfg;
+  vconsole_dev.config_len = sizeof(vconsolecfg);
+  vconsole_dev.notify = virtio_console_notify;
+  vconsole_dev.reset = virtio_console_reset;
+  vconsole_dev.config_w = virtio_console_config_w;
+  vconsole_dev.save = virtio_console_save;
+  vconsole_dev.restore = virtio_console_restore;
+  virtio_mmio_dev_reset(vconsole_dev);
+  virtio_mmio_register(vconsole_dev);
+  
+  vconsolecfg.cols = 80;
+  vconsolecfg.rows = 25;
+  vconsolecfg.max_nr_ports = console_port_count;
+  
+  virtio_console_start();
+}
+
+void virtio_console_start() {
+  // the PTY may have been opened again since, and a forked copy must not share the eventfd with its parent
+  console_ports[0].conn_fd = pty_in_fd();
+  console_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  console_end = false;
+  console_thread = std::thread(virtio_console_loop);
+  // anything the guest queued in between is picked up on the first kick
+  virtio_console_notify(0);
+}
+
+void virtio_console_stop() {
+  if (!console_thread.joinable()) return;
+  console_end = true;
+  virtio_console_notify(0);
+  console_thread.join();
+  close(console_kick_fd);
+}
+
+void virtio_console_uninit() {
+  virtio_console_stop();
+  for (uint16_t i = 1; i < console_port_count; i++) {
+    if (console_ports[i].conn_fd >= 0) close(console_ports[i].conn_fd);
+    close(console_ports[i].listen_fd);
+    unlink(console_ports[i].path.c_str());
+  }
+}
+
+bool virtio_console_owns_pty() {
+  return console_ports[0].guest_open;
+}
+
+// the following run on the console thread, with console_mtx held
+
+void console_send_ctrl(uint32_t id, uint16_t event, uint16_t value, const std::string& extra = "") {
+  virtio_console_control msg = {id, event, value};
+  std::vector<uint8_t> buf((uint8_t*)&msg, (uint8_t*)&msg + sizeof(msg));
+  buf.insert(buf.end(), extra.begin(), extra.end());
+  ctrl_backlog.push_back(std::move(buf));
+}
+
+void console_flush_ctrl(virtio_chain& chain) {
+  bool pushed = false;
+  while (!ctrl_backlog.empty() && virtq_pop(vconsole_dev, CTRL_RXQ, chain)) {
+    std::vector<uint8_t>& msg = ctrl_backlog.front();
+    size_t written = virtio_chain_write(chain, 0, msg.data(), msg.size());
+    virtq_push(vconsole_dev, CTRL_RXQ, chain.head, written);
+    ctrl_backlog.pop_front();
+    pushed = true;
+  }
+  if (pushed) virtio_send_int(vconsole_dev);
+}
+
+void console_handle_ctrl(const virtio_console_control& msg) {
+  switch (msg.event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+      if (msg.value != 1) break;
+      for (uint16_t i = 0; i < console_port_count; i++) {
+        console_send_ctrl(i, VIRTIO_CONSOLE_DEVICE_ADD, 1);
+      }
+      break;
+    case VIRTIO_CONSOLE_PORT_READY:
+      if (msg.value != 1 || msg.id >= console_port_count) break;
+      if (msg.id == 0) {
+        console_send_ctrl(0, VIRTIO_CONSOLE_CONSOLE_PORT, 1);
+        console_send_ctrl(0, VIRTIO_CONSOLE_PORT_OPEN, 1);
+      } else {
+        console_send_ctrl(msg.id, VIRTIO_CONSOLE_PORT_NAME, 1, console_ports[msg.id].name);
+        if (console_ports[msg.id].conn_fd >= 0) {
+          console_send_ctrl(msg.id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+        }
+      }
+      break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+      if (msg.id >= console_port_count) break;
+      console_ports[msg.id].guest_open = msg.value;
+      break;
+  }
+}
+
+void console_port_tx(uint16_t n, virtio_chain& chain) {
+  console_port& port = console_ports[n];
+  bool pushed = false;
+  while (virtq_pop(vconsole_dev, PORT_TXQ(n), chain)) {
+    // the guest buffers are handed to the host fd as they are, without copying
+    if (n == 0) {
+      pty_writev(chain.rd, chain.rd_cnt);
+    } else if (port.conn_fd >= 0) {
+      msghdr hdr = {};
+      hdr.msg_iov = chain.rd;
+      hdr.msg_iovlen = chain.rd_cnt;
+      size_t left = chain.rd_len;
+      while (left > 0) {
+        ssize_t n_sent = sendmsg(port.conn_fd, &hdr, MSG_NOSIGNAL);
+        if (n_sent <= 0) break; // the reader went away, the hangup is handled on poll
+        left -= n_sent;
+        while (hdr.msg_iovlen > 0 && (size_t)n_sent >= hdr.msg_iov->iov_len) {
+          n_sent -= hdr.msg_iov->iov_len;
+          hdr.msg_iov++;
+          hdr.msg_iovlen--;
+        }
+        if (hdr.msg_iovlen > 0) {
+          hdr.msg_iov->iov_base = (uint8_t*)hdr.msg_iov->iov_base + n_sent;
+          hdr.msg_iov->iov_len -= n_sent;
+        }
+      }
+    } // otherwise nobody is listening on the host side, and the data is dropped
+    virtq_push(vconsole_dev, PORT_TXQ(n), chain.head, 0);
+    pushed = true;
+  }
+  if (pushed) virtio_send_int(vconsole_dev);
+}
+
+// returns false if the host side hung up
+bool console_port_rx(uint16_t n, virtio_chain& chain) {
+  console_port& port = console_ports[n];
+  int avail_bytes = 0;
+  if (ioctl(port.conn_fd, FIONREAD, &avail_bytes) || avail_bytes == 0) {
+    return n == 0; // readable with nothing to read is EOF, but the console never hangs up
+  }
+  bool pushed = false;
+  while (avail_bytes > 0 && virtq_pop(vconsole_dev, PORT_RXQ(n), chain)) {
+    // read straight into the guest buffers
+    ssize_t n_read = readv(port.conn_fd, chain.wr, chain.wr_cnt);
+    if (n_read < 0) n_read = 0;
+    virtq_push(vconsole_dev, PORT_RXQ(n), chain.head, n_read);
+    avail_bytes -= n_read;
+    pushed = true;
+    if (n_read == 0) break;
+  }
+  if (pushed) virtio_send_int(vconsole_dev);
+  return true;
+}
+
+void virtio_console_loop() {
+  // one chain is large, keep it off the stack
+  static virtio_chain chain;
+  pollfd fds[1 + 2 * VIRTIO_CONSOLE_MAX_PORTS];
+  int16_t fd_port[1 + 2 * VIRTIO_CONSOLE_MAX_PORTS];
+  while (!console_end) {
+    nfds_t nfds = 0;
+    fds[nfds++] = {console_kick_fd, POLLIN, 0};
+    {
+      std::lock_guard<std::mutex> lock(console_mtx);
+      for (uint16_t i = 0; i < console_port_count; i++) {
+        console_port& port = console_ports[i];
+        if (i > 0 && port.conn_fd < 0) {
+          fd_port[nfds] = -1 - i; // negative for the listening socket
+          fds[nfds++] = {port.listen_fd, POLLIN, 0};
+        } else if (port.guest_open && virtq_has_avail(vconsole_dev, PORT_RXQ(i))) {
+          // only wait for input when the guest has somewhere to put it
+          fd_port[nfds] = i;
+          fds[nfds++] = {port.conn_fd, POLLIN, 0};
+        }
+      }
+    }
+    if (poll(fds, nfds, -1) < 0) continue;
+    
+    std::lock_guard<std::mutex> lock(console_mtx);
+    if (fds[0].revents) {
+      uint64_t kicks;
+      [[maybe_unused]] ssize_t ret = read(console_kick_fd, &kicks, sizeof(kicks));
+      if (!virtio_driver_ok(vconsole_dev)) continue;
+      while (virtq_pop(vconsole_dev, CTRL_TXQ, chain)) {
+        virtio_console_control msg = {};
+        virtio_chain_read(chain, 0, &msg, sizeof(msg));
+        virtq_push(vconsole_dev, CTRL_TXQ, chain.head, 0);
+        console_handle_ctrl(msg);
+      }
+      for (uint16_t i = 0; i < console_port_count; i++) {
+        console_port_tx(i, chain);
+      }
+    }
+    for (nfds_t i = 1; i < nfds; i++) {
+      if (!fds[i].revents) continue;
+      if (fd_port[i] < 0) {
+        console_port& port = console_ports[-1 - fd_port[i]];
+        port.conn_fd = accept4(port.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (port.conn_fd >= 0) console_send_ctrl(-1 - fd_port[i], VIRTIO_CONSOLE_PORT_OPEN, 1);
+      } else if (!console_port_rx(fd_port[i], chain)) {
+        console_port& port = console_ports[fd_port[i]];
+        close(port.conn_fd);
+        port.conn_fd = -1;
+        console_send_ctrl(fd_port[i], VIRTIO_CONSOLE_PORT_OPEN, 0);
+      }
+    }
+    console_flush_ctrl(chain);
+  }
+}
+
+void* virtio_console_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vconsole_dev, offset, len);
+}
+void virtio_console_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vconsole_dev, offset, dataptr, len);
+}
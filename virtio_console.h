@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+// virtio console with multiport support
+// port 0 is the emulator console (PTY or stdio), extra ports are host UNIX sockets
+
+#define VIRTIO_CONSOLE_MAX_PORTS 8
+
+// spec is "name=/path/to/socket", or just a path; must be called before virtio_console_init
+bool virtio_console_add_port(const char* spec);
+
+void virtio_console_init();
+void virtio_console_uninit();
+// stop and restart the worker thread, leaving the device state and the ports alone
+void virtio_console_start();
+void virtio_console_stop();
+
+void virtio_console_loop();
+
+void* virtio_console_r (uint64_t offset, uint8_t len);
+void virtio_console_w (uint64_t offset, void* dataptr, uint8_t len);
+
+// true once the guest has opened the console port, so it should get the console input
+bool virtio_console_owns_pty();
+
+struct __attribute__ ((packed)) virtio_console_config {
+  uint16_t cols;
+  uint16_t rows;
+  uint32_t max_nr_ports;
+  uint32_t emerg_wr;
+};
+
+struct __attribute__ ((packed)) virtio_console_control {
+  uint32_t id;
+  uint16_t event;
+  uint16_t value;
+};
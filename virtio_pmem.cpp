@@ -0,0 +1,166 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "virtio_common.h"
+#include "virtio_pmem.h"
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+// the window is advertised in units the guest can hotplug and map with huge pages
+#define PMEM_ALIGN (2ULL << 20)
+
+uint8_t* pmem_mem = nullptr;
+uint64_t pmem_size = 0;
+bool pmem_readonly = false;
+
+std::string pmem_path;
+bool pmem_private = false;
+int pmem_fd = -1;
+
+virtio_mmio_dev vpmem_dev;
+virtio_pmem_config vpmemcfg;
+
+std::thread pmem_thread;
+std::mutex pmem_mtx;
+std::condition_variable pmem_cv;
+bool pmem_needs_io = false;
+bool pmem_end = false;
+
+void virtio_pmem_notify([[maybe_unused]] uint16_t queue) {
+  std::lock_guard<std::mutex> lock(pmem_mtx);
+  pmem_needs_io = true;
+  pmem_cv.notify_one();
+}
+
+bool virtio_pmem_set_file(const char* spec) {
+  pmem_path = spec;
+  if (pmem_path.ends_with(",ro")) {
+    pmem_readonly = true;
+    pmem_path.resize(pmem_path.size() - 3);
+  } else if (pmem_path.ends_with(",cow")) {
+    pmem_private = true;
+    pmem_path.resize(pmem_path.size() - 4);
+  }
+  pmem_fd = open(pmem_path.c_str(), (pmem_readonly || pmem_private ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (pmem_fd < 0) return false;
+  struct stat st;
+  if (fstat(pmem_fd, &st) || st.st_size == 0) return false;
+  pmem_size = (st.st_size + PMEM_ALIGN - 1) & ~(PMEM_ALIGN - 1);
+  if (pmem_size > PMEM_MAX_SIZE) return false;
+  // a shared writable file grows to the whole window, otherwise writes to the tail past its end would not reach it
+  if (!pmem_readonly && !pmem_private && (uint64_t)st.st_size < pmem_size) {
+    if (ftruncate(pmem_fd, pmem_size)) return false;
+    st.st_size = pmem_size;
+  }
+  
+  int prot = pmem_readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+  // reserve the whole window first, so the tail past the end of the file reads as zeros instead of faulting
+  void* window = mmap(nullptr, pmem_size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (window == MAP_FAILED) return false;
+  // shared mappings use the host page cache directly, so every VM mapping the same file shares it
+  void* file = mmap(window, st.st_size, prot, (pmem_private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED, pmem_fd, 0);
+  if (file == MAP_FAILED) {
+    munmap(window, pmem_size);
+    return false;
+  }
+  pmem_mem = (uint8_t*)window;
+  return true;
+}
+
+void virtio_pmem_init() {
+  if (!pmem_mem) return; // no file, the device shows up as a placeholder with id 0
+  vpmem_dev.deviceid = 27;
+  vpmem_dev.devfeat = VIRTIO_F_VERSION_1;
+  vpmem_dev.irq = 4;
+  vpmem_dev.queue_count = 1;
+  vpmem_dev.config = &vpmemcfg;
+  vpmem_dev.config_len = sizeof(vpmemcfg);
+  vpmem_dev.notify = virtio_pmem_notify;
+  virtio_mmio_dev_reset(vpmem_dev);
+  virtio_mmio_register(vpmem_dev);
+  
+  vpmemcfg.start = PMEM_BASE;
+  vpmemcfg.size = pmem_size;
+  
+  virtio_pmem_start();
+}
+
+void virtio_pmem_start() {
+  if (!pmem_mem) return;
+  pmem_end = false;
+  pmem_needs_io = true; // requests queued in between
+  pmem_thread = std::thread(virtio_pmem_loop);
+}
+
+void virtio_pmem_stop() {
+  if (!pmem_thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(pmem_mtx);
+    pmem_end = true;
+    pmem_cv.notify_all();
+  }
+  pmem_thread.join();
+}
+
+void virtio_pmem_uninit() {
+  if (!pmem_mem) return;
+  virtio_pmem_stop();
+  munmap(pmem_mem, pmem_size);
+  close(pmem_fd);
+}
+
+// the only request is a flush, which makes guest writes durable in the backing file
+void virtio_pmem_loop() {
+  static virtio_chain chain;
+  std::unique_lock<std::mutex> flags_lock (pmem_mtx);
+  while (true) {
+    pmem_cv.wait(flags_lock, []{return pmem_needs_io || pmem_end;});
+    if (pmem_end) break;
+    pmem_needs_io = false;
+    flags_lock.unlock();
+    
+    bool pushed = false;
+    while (virtq_pop(vpmem_dev, 0, chain)) {
+      uint32_t type = 0xffffffff;
+      virtio_chain_read(chain, 0, &type, sizeof(type));
+      uint32_t ret = 0;
+      if (type != VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+        ret = 1;
+      } else if (!pmem_readonly && !pmem_private) {
+        ret = msync(pmem_mem, pmem_size, MS_SYNC) ? 1 : 0;
+      }
+      virtq_push(vpmem_dev, 0, chain.head, virtio_chain_write(chain, 0, &ret, sizeof(ret)));
+      pushed = true;
+    }
+    if (pushed) virtio_send_int(vpmem_dev);
+    
+    flags_lock.lock();
+  }
+}
+
+void* virtio_pmem_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vpmem_dev, offset, len);
+}
+void virtio_pmem_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vpmem_dev, offset, dataptr, len);
+}
+
+// slow path for the window, the fast path in phy_mem_fetch/phy_mem_store normally handles it
+void* pmem_window_r (uint64_t offset, uint8_t len) {
+  if (offset + len > pmem_size) return &ZERO;
+  return pmem_mem + offset;
+}
+void pmem_window_w (uint64_t offset, void* dataptr, uint8_t len) {
+  if (pmem_readonly || offset + len > pmem_size) return; // writes to a read-only window are dropped
+  memcpy(pmem_mem + offset, dataptr, len);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+
+// virtio pmem device exposing a host file as a physical memory window outside of RAM
+// the guest maps it with DAX, so reads are plain loads from the host page cache
+
+// far above any RAM, and aligned for memory hotplug
+#define PMEM_BASE 0x40'0000'0000ULL
+#define PMEM_MAX_SIZE 0x40'0000'0000ULL
+
+// window contents, accessed directly by the memory fast path
+extern uint8_t* pmem_mem;
+extern uint64_t pmem_size;
+extern bool pmem_readonly;
+// mapped copy-on-write, so guest writes never reach the file
+extern bool pmem_private;
+
+// spec is "/path/to/file" with an optional ",ro" (read-only, shared) or ",cow" (private copy-on-write) suffix
+// the default maps the file shared and writable, so guest writes reach the file
+bool virtio_pmem_set_file(const char* spec);
+
+void virtio_pmem_init();
+void virtio_pmem_uninit();
+// stop and restart the worker thread, the window stays mapped
+void virtio_pmem_start();
+void virtio_pmem_stop();
+
+void virtio_pmem_loop();
+
+void* virtio_pmem_r (uint64_t offset, uint8_t len);
+void virtio_pmem_w (uint64_t offset, void* dataptr, uint8_t len);
+
+// memory map callbacks for the window itself
+void* pmem_window_r (uint64_t offset, uint8_t len);
+void pmem_window_w (uint64_t offset, void* dataptr, uint8_t len);
+
+struct __attribute__ ((packed)) virtio_pmem_config {
+  uint64_t start;
+  uint64_t size;
+};
@@ -0,0 +1,516 @@
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+
+#include "constants.h"
+#include "virtio_common.h"
+#include "virtio_vsock.h"
+
+#define VSOCK_RXQ 0
+#define VSOCK_TXQ 1
+#define VSOCK_EVTQ 2 // only used for transport reset events, sent after a snapshot restore
+
+#define VIRTIO_VSOCK_EVENT_TRANSPORT_RESET 0
+
+#define VIRTIO_VSOCK_TYPE_STREAM 1
+
+enum vsock_op : uint16_t {
+  OP_INVALID = 0, OP_REQUEST = 1, OP_RESPONSE = 2, OP_RST = 3, OP_SHUTDOWN = 4,
+  OP_RW = 5, OP_CREDIT_UPDATE = 6, OP_CREDIT_REQUEST = 7
+};
+
+#define VSOCK_SHUTDOWN_RCV 1
+#define VSOCK_SHUTDOWN_SEND 2
+#define VSOCK_SHUTDOWN_BOTH (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND)
+
+// ports handed out on the host side for streams opened by the host
+#define VSOCK_HOST_PORT_BASE (1u << 30)
+#define VSOCK_MAX_IOV 64
+// longest "CONNECT <port>" line we wait for
+#define VSOCK_MAX_LINE 32
+
+struct vsock_conn {
+  int fd = -1;
+  uint32_t local_port = 0; // port on the host (CID 2) side
+  uint32_t peer_port = 0; // port on the guest side
+  bool established = false; // false while a host CONNECT waits for the guest to respond
+  bool host_eof = false;
+  uint32_t guest_shut = 0; // VSOCK_SHUTDOWN_* flags received from the guest
+  // credit accounting, all counters wrap around
+  uint32_t fwd_cnt = 0; // bytes from the guest that reached the host socket
+  uint32_t fwd_cnt_sent = 0; // fwd_cnt as last told to the guest
+  uint32_t rx_cnt = 0; // bytes sent to the guest
+  uint32_t peer_buf_alloc = 0;
+  uint32_t peer_fwd_cnt = 0;
+  // guest data the host socket could not take yet, counts against our buf_alloc
+  std::vector<uint8_t> tx_pending;
+
+  uint32_t credit() const {
+    return peer_buf_alloc - (rx_cnt - peer_fwd_cnt);
+  }
+};
+
+// a host connection on the listening socket that has not sent its CONNECT line yet
+struct vsock_handshake {
+  int fd;
+  std::string line;
+};
+
+std::string vsock_path;
+int vsock_listen_fd = -1;
+
+virtio_mmio_dev vvsock_dev;
+virtio_vsock_config vvsockcfg;
+
+std::thread vsock_thread;
+// protects the connections and the control packet backlog
+std::mutex vsock_mtx;
+std::unordered_map<uint64_t, vsock_conn> vsock_conns;
+std::vector<vsock_handshake> vsock_handshakes;
+std::deque<virtio_vsock_hdr> vsock_ctrl;
+uint32_t vsock_next_port = VSOCK_HOST_PORT_BASE;
+std::atomic<bool> vsock_end = false;
+int vsock_kick_fd = -1;
+
+uint64_t vsock_key(uint32_t local_port, uint32_t peer_port) {
+  return (uint64_t)local_port << 32 | peer_port;
+}
+
+void virtio_vsock_notify([[maybe_unused]] uint16_t queue) {
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t ret = write(vsock_kick_fd, &one, sizeof(one));
+}
+
+void virtio_vsock_reset() {
+  std::lock_guard<std::mutex> lock(vsock_mtx);
+  for (auto& [key, conn] : vsock_conns) {
+    close(conn.fd);
+  }
+  vsock_conns.clear();
+  for (vsock_handshake& hs : vsock_handshakes) {
+    close(hs.fd);
+  }
+  vsock_handshakes.clear();
+  vsock_ctrl.clear();
+}
+
+// connections do not survive a snapshot, so the guest is told to drop all of its own
+bool virtio_vsock_restore([[maybe_unused]] snap_reader& in) {
+  static virtio_chain chain;
+  if (!virtio_driver_ok(vvsock_dev) || !virtq_pop(vvsock_dev, VSOCK_EVTQ, chain)) return true;
+  uint32_t event = VIRTIO_VSOCK_EVENT_TRANSPORT_RESET;
+  size_t written = virtio_chain_write(chain, 0, &event, sizeof(event));
+  virtq_push(vvsock_dev, VSOCK_EVTQ, chain.head, written);
+  virtio_send_int(vvsock_dev);
+  return true;
+}
+
+bool virtio_vsock_set_socket(const char* spec) {
+  vsock_path = spec;
+  vvsockcfg.guest_cid = VSOCK_DEFAULT_GUEST_CID;
+  size_t sep = vsock_path.rfind(",cid=");
+  if (sep != std::string::npos) {
+    char* end;
+    vvsockcfg.guest_cid = strtoul(vsock_path.c_str() + sep + 5, &end, 0);
+    if (*end || vvsockcfg.guest_cid <= VSOCK_HOST_CID || vvsockcfg.guest_cid >= 0xffff'ffff) return false;
+    vsock_path.resize(sep);
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  // leave room for the "_<port>" suffix of guest initiated connections
+  if (vsock_path.size() + 11 >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, vsock_path.c_str());
+  unlink(addr.sun_path);
+  vsock_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (vsock_listen_fd < 0) return false;
+  if (bind(vsock_listen_fd, (sockaddr*)&addr, sizeof(addr)) || listen(vsock_listen_fd, 16)) {
+    close(vsock_listen_fd);
+    vsock_listen_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void virtio_vsock_init() {
+  if (vsock_listen_fd < 0) return; // no socket, the device shows up as a placeholder with id 0
+  vvsock_dev.deviceid = 19;
+  vvsock_dev.devfeat = VIRTIO_F_VERSION_1;
+  vvsock_dev.irq = 5;
+  vvsock_dev.queue_count = 3;
+  vvsock_dev.config = &vvsockcfg;
+  vvsock_dev.config_len = sizeof(vvsockcfg);
+  vvsock_dev.notify = virtio_vsock_notify;
+  vvsock_dev.reset = virtio_vsock_reset;
+  vvsock_dev.restore = virtio_vsock_restore;
+  virtio_mmio_dev_reset(vvsock_dev);
+  virtio_mmio_register(vvsock_dev);
+
+  vsock_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  vsock_thread = std::thread(virtio_vsock_loop);
+}
+
+void virtio_vsock_uninit() {
+  if (vsock_listen_fd < 0) return;
+  vsock_end = true;
+  virtio_vsock_notify(0);
+  vsock_thread.join();
+  virtio_vsock_reset();
+  close(vsock_listen_fd);
+  unlink(vsock_path.c_str());
+  close(vsock_kick_fd);
+}
+
+// the following run on the vsock thread, with vsock_mtx held
+
+virtio_vsock_hdr vsock_hdr(uint32_t local_port, uint32_t peer_port, uint16_t op, uint32_t flags = 0) {
+  virtio_vsock_hdr hdr = {};
+  hdr.src_cid = VSOCK_HOST_CID;
+  hdr.dst_cid = vvsockcfg.guest_cid;
+  hdr.src_port = local_port;
+  hdr.dst_port = peer_port;
+  hdr.type = VIRTIO_VSOCK_TYPE_STREAM;
+  hdr.op = op;
+  hdr.flags = flags;
+  hdr.buf_alloc = VSOCK_BUF_ALLOC;
+  return hdr;
+}
+
+void vsock_send_ctrl(uint32_t local_port, uint32_t peer_port, uint16_t op, uint32_t flags = 0) {
+  vsock_ctrl.push_back(vsock_hdr(local_port, peer_port, op, flags));
+}
+
+void vsock_close(uint64_t key, bool rst) {
+  auto it = vsock_conns.find(key);
+  if (it == vsock_conns.end()) return;
+  if (rst) vsock_send_ctrl(it->second.local_port, it->second.peer_port, OP_RST);
+  close(it->second.fd);
+  vsock_conns.erase(it);
+}
+
+// every packet carries fwd_cnt, but a stream that only flows towards the host needs explicit updates
+void vsock_update_credit(vsock_conn& conn) {
+  if (conn.fwd_cnt - conn.fwd_cnt_sent >= VSOCK_BUF_ALLOC / 4) {
+    conn.fwd_cnt_sent = conn.fwd_cnt;
+    vsock_send_ctrl(conn.local_port, conn.peer_port, OP_CREDIT_UPDATE);
+  }
+}
+
+// completes a guest shutdown once everything it sent has reached the host socket
+void vsock_finish_shutdown(vsock_conn& conn) {
+  if (!conn.tx_pending.empty()) return;
+  if (conn.guest_shut == VSOCK_SHUTDOWN_BOTH) {
+    // the guest waits for our RST before it considers the stream closed
+    vsock_close(vsock_key(conn.local_port, conn.peer_port), true);
+  } else if (conn.guest_shut & VSOCK_SHUTDOWN_SEND) {
+    shutdown(conn.fd, SHUT_WR);
+  }
+}
+
+// returns false if the host socket failed
+bool vsock_conn_flush(vsock_conn& conn) {
+  while (!conn.tx_pending.empty()) {
+    ssize_t n_sent = send(conn.fd, conn.tx_pending.data(), conn.tx_pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n_sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    conn.tx_pending.erase(conn.tx_pending.begin(), conn.tx_pending.begin() + n_sent);
+    conn.fwd_cnt += n_sent;
+  }
+  return true;
+}
+
+// guest to host payload, returns false if the host socket failed
+bool vsock_conn_tx(vsock_conn& conn, const virtio_chain& chain, uint32_t len) {
+  iovec iov[VSOCK_MAX_IOV];
+  int cnt = virtio_iov_slice(chain.rd, chain.rd_cnt, sizeof(virtio_vsock_hdr), len, iov, VSOCK_MAX_IOV);
+  size_t sent = 0;
+  if (conn.tx_pending.empty()) {
+    // the guest buffers go straight to the host socket
+    msghdr hdr = {};
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = cnt;
+    ssize_t n_sent = sendmsg(conn.fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+    if (n_sent > 0) sent = n_sent;
+    conn.fwd_cnt += sent;
+  }
+  // whatever the host could not take now waits for POLLOUT
+  for (int i = 0; i < cnt; i++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+    uint8_t* base = (uint8_t*)iov[i].iov_base;
+    conn.tx_pending.insert(conn.tx_pending.end(), base + sent, base + iov[i].iov_len);
+    sent = 0;
+  }
+  return true;
+}
+
+// host to guest payload, returns false if the host closed its end
+bool vsock_conn_rx(vsock_conn& conn, virtio_chain& chain) {
+  int avail_bytes = 0;
+  if (ioctl(conn.fd, FIONREAD, &avail_bytes) || avail_bytes == 0) return false;
+  bool pushed = false;
+  while (avail_bytes > 0 && conn.credit() > 0 && virtq_pop(vvsock_dev, VSOCK_RXQ, chain)) {
+    if (chain.wr_len <= sizeof(virtio_vsock_hdr)) {
+      virtq_push(vvsock_dev, VSOCK_RXQ, chain.head, 0);
+      pushed = true;
+      continue;
+    }
+    size_t len = std::min({chain.wr_len - sizeof(virtio_vsock_hdr), (size_t)conn.credit(), (size_t)avail_bytes});
+    iovec iov[VSOCK_MAX_IOV];
+    int cnt = virtio_iov_slice(chain.wr, chain.wr_cnt, sizeof(virtio_vsock_hdr), len, iov, VSOCK_MAX_IOV);
+    // read straight into the guest buffers, behind the header
+    ssize_t n_read = readv(conn.fd, iov, cnt);
+    if (n_read < 0) n_read = 0;
+    virtio_vsock_hdr hdr = vsock_hdr(conn.local_port, conn.peer_port, OP_RW);
+    hdr.len = n_read;
+    hdr.fwd_cnt = conn.fwd_cnt_sent = conn.fwd_cnt;
+    virtio_chain_write(chain, 0, &hdr, sizeof(hdr));
+    virtq_push(vvsock_dev, VSOCK_RXQ, chain.head, sizeof(hdr) + n_read);
+    conn.rx_cnt += n_read;
+    avail_bytes -= n_read;
+    pushed = true;
+    if (n_read == 0) break;
+  }
+  if (pushed) virtio_send_int(vvsock_dev);
+  return true;
+}
+
+// a guest connect to the host CID goes to the UNIX socket <path>_<port>
+void vsock_connect_host(const virtio_vsock_hdr& pkt) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", vsock_path.c_str(), pkt.dst_port);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr))) {
+    if (fd >= 0) close(fd);
+    vsock_send_ctrl(pkt.dst_port, pkt.src_port, OP_RST);
+    return;
+  }
+  vsock_conn& conn = vsock_conns[vsock_key(pkt.dst_port, pkt.src_port)];
+  conn.fd = fd;
+  conn.local_port = pkt.dst_port;
+  conn.peer_port = pkt.src_port;
+  conn.established = true;
+  conn.peer_buf_alloc = pkt.buf_alloc;
+  conn.peer_fwd_cnt = pkt.fwd_cnt;
+  vsock_send_ctrl(conn.local_port, conn.peer_port, OP_RESPONSE);
+}
+
+void vsock_handle_pkt(const virtio_vsock_hdr& pkt, const virtio_chain& chain) {
+  if (pkt.dst_cid != VSOCK_HOST_CID || pkt.src_cid != vvsockcfg.guest_cid) return;
+  if (pkt.type != VIRTIO_VSOCK_TYPE_STREAM) {
+    if (pkt.op != OP_RST) vsock_send_ctrl(pkt.dst_port, pkt.src_port, OP_RST);
+    return;
+  }
+  uint64_t key = vsock_key(pkt.dst_port, pkt.src_port);
+  auto it = vsock_conns.find(key);
+  if (pkt.op == OP_REQUEST) {
+    if (it != vsock_conns.end()) {
+      vsock_close(key, true);
+    } else {
+      vsock_connect_host(pkt);
+    }
+    return;
+  }
+  if (it == vsock_conns.end()) {
+    if (pkt.op != OP_RST) vsock_send_ctrl(pkt.dst_port, pkt.src_port, OP_RST);
+    return;
+  }
+  vsock_conn& conn = it->second;
+  conn.peer_buf_alloc = pkt.buf_alloc;
+  conn.peer_fwd_cnt = pkt.fwd_cnt;
+  switch (pkt.op) {
+    case OP_RESPONSE:
+      if (!conn.established) {
+        conn.established = true;
+        std::string ok = "OK " + std::to_string(conn.local_port) + "\n";
+        send(conn.fd, ok.data(), ok.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      }
+      break;
+    case OP_RW:
+      if (!conn.established || !vsock_conn_tx(conn, chain, std::min<size_t>(pkt.len, chain.rd_len - sizeof(pkt)))) {
+        vsock_close(key, true);
+        break;
+      }
+      vsock_update_credit(conn);
+      break;
+    case OP_CREDIT_REQUEST:
+      conn.fwd_cnt_sent = conn.fwd_cnt;
+      vsock_send_ctrl(conn.local_port, conn.peer_port, OP_CREDIT_UPDATE);
+      break;
+    case OP_SHUTDOWN:
+      conn.guest_shut |= pkt.flags & VSOCK_SHUTDOWN_BOTH;
+      vsock_finish_shutdown(conn);
+      break;
+    case OP_RST:
+      vsock_close(key, false);
+      break;
+  }
+}
+
+// returns false once the handshake is over, either as a new stream or a failure
+bool vsock_handshake_rx(vsock_handshake& hs) {
+  char c;
+  ssize_t n_read;
+  // one byte at a time, so nothing after the newline is consumed
+  while ((n_read = recv(hs.fd, &c, 1, MSG_DONTWAIT)) == 1) {
+    if (c != '\n') {
+      hs.line += c;
+      if (hs.line.size() > VSOCK_MAX_LINE) break;
+      continue;
+    }
+    uint32_t peer_port;
+    char tail;
+    if (sscanf(hs.line.c_str(), "CONNECT %u%c", &peer_port, &tail) != 1) break;
+    uint32_t local_port;
+    do {
+      local_port = vsock_next_port++;
+      if (vsock_next_port == 0) vsock_next_port = VSOCK_HOST_PORT_BASE;
+    } while (vsock_conns.count(vsock_key(local_port, peer_port)));
+    vsock_conn& conn = vsock_conns[vsock_key(local_port, peer_port)];
+    conn.fd = hs.fd;
+    conn.local_port = local_port;
+    conn.peer_port = peer_port;
+    vsock_send_ctrl(local_port, peer_port, OP_REQUEST);
+    return false;
+  }
+  if (n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+  close(hs.fd);
+  return false;
+}
+
+void vsock_flush_ctrl(virtio_chain& chain) {
+  bool pushed = false;
+  while (!vsock_ctrl.empty() && virtq_pop(vvsock_dev, VSOCK_RXQ, chain)) {
+    virtio_vsock_hdr& hdr = vsock_ctrl.front();
+    auto it = vsock_conns.find(vsock_key(hdr.src_port, hdr.dst_port));
+    if (it != vsock_conns.end()) {
+      hdr.fwd_cnt = it->second.fwd_cnt_sent = it->second.fwd_cnt;
+    }
+    size_t written = virtio_chain_write(chain, 0, &hdr, sizeof(hdr));
+    virtq_push(vvsock_dev, VSOCK_RXQ, chain.head, written);
+    vsock_ctrl.pop_front();
+    pushed = true;
+  }
+  if (pushed) virtio_send_int(vvsock_dev);
+}
+
+void virtio_vsock_loop() {
+  // one chain is large, keep it off the stack
+  static virtio_chain chain;
+  // what each polled fd belongs to
+  enum poll_kind : uint8_t { POLL_KICK, POLL_LISTEN, POLL_HANDSHAKE, POLL_CONN };
+  struct poll_tag {
+    poll_kind kind;
+    uint64_t key; // connection key, or handshake index
+  };
+  std::vector<pollfd> fds;
+  std::vector<poll_tag> tags;
+  while (!vsock_end) {
+    fds.clear();
+    tags.clear();
+    fds.push_back({vsock_kick_fd, POLLIN, 0});
+    tags.push_back({POLL_KICK, 0});
+    fds.push_back({vsock_listen_fd, POLLIN, 0});
+    tags.push_back({POLL_LISTEN, 0});
+    {
+      std::lock_guard<std::mutex> lock(vsock_mtx);
+      for (size_t i = 0; i < vsock_handshakes.size(); i++) {
+        fds.push_back({vsock_handshakes[i].fd, POLLIN, 0});
+        tags.push_back({POLL_HANDSHAKE, i});
+      }
+      bool rx_avail = virtio_driver_ok(vvsock_dev) && virtq_has_avail(vvsock_dev, VSOCK_RXQ);
+      for (auto& [key, conn] : vsock_conns) {
+        short events = 0;
+        // only wait for host data when the guest has both credit and buffers for it
+        if (conn.established && !conn.host_eof && rx_avail && conn.credit() > 0) events |= POLLIN;
+        if (!conn.tx_pending.empty()) events |= POLLOUT;
+        if (!events) continue; // a hung up socket would otherwise wake us forever
+        fds.push_back({conn.fd, events, 0});
+        tags.push_back({POLL_CONN, key});
+      }
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) continue;
+
+    std::lock_guard<std::mutex> lock(vsock_mtx);
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (!fds[i].revents) continue;
+      switch (tags[i].kind) {
+        case POLL_KICK: {
+          uint64_t kicks;
+          [[maybe_unused]] ssize_t ret = read(vsock_kick_fd, &kicks, sizeof(kicks));
+          if (!virtio_driver_ok(vvsock_dev)) break;
+          bool pushed = false;
+          while (virtq_pop(vvsock_dev, VSOCK_TXQ, chain)) {
+            virtio_vsock_hdr pkt = {};
+            if (virtio_chain_read(chain, 0, &pkt, sizeof(pkt)) == sizeof(pkt)) vsock_handle_pkt(pkt, chain);
+            virtq_push(vvsock_dev, VSOCK_TXQ, chain.head, 0);
+            pushed = true;
+          }
+          if (pushed) virtio_send_int(vvsock_dev);
+          break;
+        }
+        case POLL_LISTEN: {
+          int fd = accept4(vsock_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+          if (fd >= 0) vsock_handshakes.push_back({fd, ""});
+          break;
+        }
+        case POLL_HANDSHAKE: {
+          // the list may have been cleared by a device reset since the poll
+          if (tags[i].key >= vsock_handshakes.size() || vsock_handshakes[tags[i].key].fd != fds[i].fd) break;
+          if (!vsock_handshake_rx(vsock_handshakes[tags[i].key])) vsock_handshakes[tags[i].key].fd = -1;
+          break;
+        }
+        case POLL_CONN: {
+          auto it = vsock_conns.find(tags[i].key);
+          if (it == vsock_conns.end() || it->second.fd != fds[i].fd) break;
+          vsock_conn& conn = it->second;
+          if (!conn.tx_pending.empty()) {
+            if (!vsock_conn_flush(conn)) {
+              vsock_close(tags[i].key, true);
+              break;
+            }
+            vsock_update_credit(conn);
+            if (conn.guest_shut) {
+              vsock_finish_shutdown(conn); // may close the connection
+              break;
+            }
+          }
+          if ((fds[i].events & POLLIN) && !vsock_conn_rx(conn, chain)) {
+            conn.host_eof = true;
+            vsock_send_ctrl(conn.local_port, conn.peer_port, OP_SHUTDOWN, VSOCK_SHUTDOWN_SEND);
+          }
+          break;
+        }
+      }
+    }
+    std::erase_if(vsock_handshakes, [](const vsock_handshake& hs) {return hs.fd < 0;});
+    vsock_flush_ctrl(chain);
+  }
+}
+
+void* virtio_vsock_r (uint64_t offset, uint8_t len) {
+  return virtio_mmio_r(vvsock_dev, offset, len);
+}
+void virtio_vsock_w (uint64_t offset, void* dataptr, uint8_t len) {
+  virtio_mmio_w(vvsock_dev, offset, dataptr, len);
+}
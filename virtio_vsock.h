@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+
+// virtio vsock with the host side exposed as UNIX sockets, in the same way as Firecracker's hybrid vsock
+// host to guest: connect to <path>, send "CONNECT <port>\n", and read back "OK <host port>\n" once the guest accepts
+// guest to host: connecting to CID 2 port <port> connects to the UNIX socket <path>_<port>
+
+#define VSOCK_HOST_CID 2
+#define VSOCK_DEFAULT_GUEST_CID 3
+
+// receive buffer advertised to the guest for each stream, the guest never has more than this in flight
+#define VSOCK_BUF_ALLOC (256 << 10)
+
+// spec is "/path/to/socket" with an optional ",cid=<n>" suffix for the guest CID
+bool virtio_vsock_set_socket(const char* spec);
+
+void virtio_vsock_init();
+void virtio_vsock_uninit();
+
+void virtio_vsock_loop();
+
+void* virtio_vsock_r (uint64_t offset, uint8_t len);
+void virtio_vsock_w (uint64_t offset, void* dataptr, uint8_t len);
+
+struct __attribute__ ((packed)) virtio_vsock_config {
+  uint64_t guest_cid;
+};
+
+struct __attribute__ ((packed)) virtio_vsock_hdr {
+  uint64_t src_cid;
+  uint64_t dst_cid;
+  uint32_t src_port;
+  uint32_t dst_port;
+  uint32_t len;
+  uint16_t type;
+  uint16_t op;
+  uint32_t flags;
+  uint32_t buf_alloc;
+  uint32_t fwd_cnt;
+};